@@ -0,0 +1,153 @@
+/*
+ *  EdgeGrid.h - Uniform grid over building edges for fast ray intersection.
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+#pragma once
+
+#include "VectorMath.h"
+#include <vector>
+
+// number of rays traced together by FindNearestHits
+#define EDGEGRID_PACKET_SIZE	4
+
+namespace Urc {
+
+	class UrcData;
+
+	/*
+	 * Name: EdgeGrid
+	 * Inherits: None
+	 * Description: A uniform grid holding every building edge in the network.
+	 * 				Rays are walked through the grid cell by cell (DDA), so only
+	 * 				edges near the ray are ever tested. The grid is built once
+	 * 				and is read-only afterwards, so any number of threads may
+	 * 				query it at the same time.
+	 */
+	class EdgeGrid {
+
+	public:
+
+		/*
+		 * Name: Edge
+		 * Description: One building edge and the building it belongs to, with what a
+		 * 				reflection off it needs worked out in advance.
+		 */
+		struct Edge {
+			VectorMath::LineSegment mLine;
+			long mBuilding;
+			VectorMath::Vector2D mDirection;		// unit vector from the start of the edge to its end
+			VectorMath::Vector2D mNormal;			// unit normal
+			VectorMath::Real mPermitivity;			// relative permitivity of the building
+		};
+
+		/*
+		 * Name: Hit
+		 * Description: The nearest intersection found along a ray.
+		 */
+		struct Hit {
+			VectorMath::Vector2D mPoint;		// point of intersection
+			VectorMath::Real mDistance;			// distance from the start of the ray
+			unsigned int mEdgeIndex;			// index of the edge that was hit
+		};
+
+		/*
+		 * Constructor arguments:
+		 * 		1. UrcData - the network whose buildings are to be gridded
+		 */
+		EdgeGrid( UrcData * );
+		~EdgeGrid();
+
+		/*
+		 * Method: bool FindNearestHit( VectorMath::LineSegment ray, VectorMath::Real minDistance, long ignoreBuilding, Hit *pHit ) const;
+		 * Description: Finds the closest edge crossed by the ray. Hits closer than minDistance to the start
+		 * 				of the ray, and edges of ignoreBuilding, are skipped. Returns false if nothing was hit.
+		 */
+		bool FindNearestHit( VectorMath::LineSegment ray, VectorMath::Real minDistance, long ignoreBuilding, Hit *pHit ) const;
+
+		/*
+		 * Method: void FindNearestHits( const VectorMath::LineSegment *rays, unsigned int count, VectorMath::Real minDistance, long ignoreBuilding, Hit *pHits, bool *pFound ) const;
+		 * Description: As FindNearestHit, for a packet of up to EDGEGRID_PACKET_SIZE rays at once. The rays should
+		 * 				be close together (e.g. adjacent launch angles), so that they pass through mostly the same cells.
+		 * 				pFound[i] says whether pHits[i] was filled in.
+		 */
+		void FindNearestHits( const VectorMath::LineSegment *rays, unsigned int count, VectorMath::Real minDistance, long ignoreBuilding, Hit *pHits, bool *pFound ) const;
+
+		/*
+		 * Method: void FindEdgesNear( VectorMath::Vector2D centre, VectorMath::Real radius, std::vector<unsigned int> *pEdges ) const;
+		 * Description: Gets the indices (ascending, without repeats) of every edge that comes within radius of the centre.
+		 */
+		void FindEdgesNear( VectorMath::Vector2D centre, VectorMath::Real radius, std::vector<unsigned int> *pEdges ) const;
+
+		/*
+		 * Method: const Edge &GetEdge( unsigned int index ) const;
+		 * Description: Get the edge at the given index.
+		 */
+		const Edge &GetEdge( unsigned int index ) const { return mEdges[index]; }
+
+		/*
+		 * Method: unsigned int GetEdgeCount() const;
+		 * Description: Get the number of edges in the grid.
+		 */
+		unsigned int GetEdgeCount() const { return mEdges.size(); }
+
+	protected:
+
+		// per-lane state for a packet of rays. The arrays line up with the SIMD lanes.
+		struct PacketState {
+			VectorMath::Real mStartX[EDGEGRID_PACKET_SIZE];
+			VectorMath::Real mStartY[EDGEGRID_PACKET_SIZE];
+			VectorMath::Real mEndX[EDGEGRID_PACKET_SIZE];
+			VectorMath::Real mEndY[EDGEGRID_PACKET_SIZE];
+			VectorMath::Real mDmin[EDGEGRID_PACKET_SIZE];		// distance to the nearest hit so far
+			VectorMath::Real mHitX[EDGEGRID_PACKET_SIZE];
+			VectorMath::Real mHitY[EDGEGRID_PACKET_SIZE];
+			VectorMath::Real mHitEdge[EDGEGRID_PACKET_SIZE];	// index of the edge hit, held as a Real so it can be blended
+		};
+
+		std::vector<Edge> mEdges;					// every building edge
+		std::vector<unsigned int> mCellStart;		// offset of each cell's first entry in mCellEdges (one extra at the end)
+		std::vector<unsigned int> mCellEdges;		// edge indices, grouped by cell
+
+		// copies of the edges in mCellEdges, split into separate coordinate arrays for the packet tests
+		std::vector<VectorMath::Real> mCellX0;
+		std::vector<VectorMath::Real> mCellY0;
+		std::vector<VectorMath::Real> mCellX1;
+		std::vector<VectorMath::Real> mCellY1;
+		std::vector<long> mCellBuilding;
+
+		VectorMath::Vector2D mOrigin;				// lower corner of the grid
+		VectorMath::Real mCellSize;					// width and height of a cell
+		int mCellsX;
+		int mCellsY;
+
+		/*
+		 * Method: bool ClipRay( VectorMath::LineSegment &ray, VectorMath::Real *tEnter, VectorMath::Real *tExit ) const;
+		 * Description: Clips the ray against the grid bounds, giving the parametric range [0,1] of the ray inside the grid.
+		 */
+		bool ClipRay( VectorMath::LineSegment &ray, VectorMath::Real *tEnter, VectorMath::Real *tExit ) const;
+
+		/*
+		 * Method: void IntersectCell( int cell, VectorMath::Real minDistance, long ignoreBuilding, PacketState *pState ) const;
+		 * Description: Tests every ray in the packet against every edge in the cell, keeping the nearest hit for each ray.
+		 */
+		void IntersectCell( int cell, VectorMath::Real minDistance, long ignoreBuilding, PacketState *pState ) const;
+
+	};
+
+};
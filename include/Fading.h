@@ -27,8 +27,17 @@
 #include <pthread.h>
 using namespace std;
 
+// Alignment of the sample table. One cache line on everything we run on.
+#define FADING_TABLE_ALIGNMENT	64
+
 namespace Urc {
 
+#ifdef USE_SINGLE_PRECISION_FADING
+	typedef float FadingReal;
+#else
+	typedef double FadingReal;
+#endif // #ifdef USE_SINGLE_PRECISION_FADING
+
 	/* class Fading
 	 * This is a class which reads in two randomly sampled gaussian component lists from a file and uses them to calculate Rayleigh and Rician fading
 	 * The format of these files is identical to the component files used in Qualnet
@@ -36,6 +45,17 @@ namespace Urc {
 	class Fading : public Singleton<Fading> {
 	public:
 		typedef vector<double> GaussianList;
+
+		/*
+		 * Name: GaussianSample
+		 * Description: Precomputed terms for one pair of gaussian components (c1,c2).
+		 * 				Rayleigh power is (c1^2+c2^2)/2; the Rician term is sqrt(2)*c1, so that
+		 * 				((c1+sqrt(2K))^2+c2^2)/(2(K+1)) = (power + term*sqrt(K) + K)/(K+1).
+		 */
+		struct GaussianSample {
+			FadingReal mRayleighPower;
+			FadingReal mRicianTerm;
+		};
 		
 		Fading(const char* componentsFile, int seed);
 		~Fading();
@@ -44,11 +64,23 @@ namespace Urc {
 		pthread_mutex_t mListMutex;
 		GaussianList mComponents1;
 		GaussianList mComponents2;
+		GaussianSample *mSamples;		// interleaved, aligned table built from the two component lists
 		int mSamplingRate;
 		int mBaseDopplerFrequency;
 		int mNumGaussianComponents;
 		int mCurrentIndex;
-		void SetArrayIdx();
+
+		/*
+		 * Method: void BuildSampleTable();
+		 * Description: Shuffles the component lists and rebuilds the sample table from them.
+		 */
+		void BuildSampleTable();
+
+		/*
+		 * Method: GaussianSample NextSample();
+		 * Description: Takes the next sample from the table, reshuffling when it has been used up.
+		 */
+		GaussianSample NextSample();
 
 	};
 
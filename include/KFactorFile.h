@@ -0,0 +1,188 @@
+/*
+ *  KFactorFile.h - Binary file of pre-computed K-factors
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <vector>
+#include <stdint.h>
+
+#include "VectorMath.h"
+#include "UrcData.h"
+
+#define KFACTORFILE_MAGIC			"URCK"
+#define KFACTORFILE_INDEX_MAGIC		"URCI"
+#define KFACTORFILE_VERSION			1
+#define KFACTORFILE_RECIPROCAL		0x1		// header flag: K-factors were computed in reciprocal mode
+
+namespace Urc {
+
+	/*
+	 * Name: KFactorFile
+	 * Inherits: None
+	 * Description: The layout of the binary K-factor file, shared by the writer and the reader.
+	 * 				All values are in the machine's own byte order.
+	 *
+	 * 				Header:		magic (4 chars), version, flags, unused (uint32 each), increment (double)
+	 * 				Records:	one per source link, laid out as in the text file. Counts and link indices are
+	 * 							variable length (7 bits to a byte). Each K-factor is a tag byte, followed by
+	 * 							the K-factor as a double unless it is 0 or infinite.
+	 * 				Index:		per record, its source link (int32), unused (int32), offset and size in bytes (uint64 each)
+	 * 				Footer:		offset of the index (uint64), number of records (uint32), magic (4 chars)
+	 *
+	 * 				The index is only written when the file is closed, so a file without its footer is incomplete.
+	 */
+	class KFactorFile {
+
+	public:
+
+		struct Header {
+			char mMagic[4];
+			uint32_t mVersion;
+			uint32_t mFlags;
+			uint32_t mUnused;
+			double mIncrement;
+		};
+
+		struct IndexEntry {
+			int32_t mLink;
+			int32_t mUnused;
+			uint64_t mOffset;
+			uint64_t mSize;
+		};
+
+		struct Footer {
+			uint64_t mIndexOffset;
+			uint32_t mCount;
+			char mMagic[4];
+		};
+
+		/*
+		 * Method: static bool IsKFactorFile( const char *filename );
+		 * Description: Whether the file starts like a binary K-factor file (as opposed to a text one).
+		 */
+		static bool IsKFactorFile( const char *filename );
+
+	};
+
+
+	/*
+	 * Name: KFactorWriter
+	 * Inherits: None
+	 * Description: Writes a binary K-factor file one source link at a time, so the whole set never
+	 * 				has to be held in memory. Errors while writing are reported by Close(). A file that was
+	 * 				never closed can be opened again to carry on, given the records in it to keep.
+	 */
+	class KFactorWriter {
+
+	protected:
+
+		FILE *m_pFile;
+		std::vector<KFactorFile::IndexEntry> mIndex;
+		uint64_t mOffset;				// where the next record goes
+
+		/*
+		 * Method: void Write( const void *pData, size_t size );
+		 * Description: Appends raw bytes to the file.
+		 */
+		void Write( const void *, size_t );
+
+	public:
+
+		/*
+		 * Constructor arguments:
+		 * 		1. Filename - file to create (or overwrite)
+		 * 		2. Reciprocal - whether the K-factors were computed in reciprocal mode
+		 * 		3. Increment - distance between positions along the links
+		 */
+		KFactorWriter( const char *, bool, VectorMath::Real );
+
+		/*
+		 * Constructor arguments:
+		 * 		1. Filename - file left part written (not closed) by an earlier writer
+		 * 		2. Records - the complete records in it to keep. Anything after the last of them is cut off,
+		 * 					 and writing carries on from there. Throws if the file doesn't hold them.
+		 */
+		KFactorWriter( const char *, const std::vector<KFactorFile::IndexEntry> & );
+		~KFactorWriter();
+
+		/*
+		 * Method: KFactorFile::IndexEntry WriteLink( int linkIndex, const UrcData::SourceLocationList &srcLocList );
+		 * Description: Appends one source link's K-factors as a record, and returns where it was put.
+		 */
+		KFactorFile::IndexEntry WriteLink( int, const UrcData::SourceLocationList & );
+
+		/*
+		 * Method: bool Flush();
+		 * Description: Pushes the records written so far out to the file. Returns false if that failed.
+		 */
+		bool Flush();
+
+		/*
+		 * Method: void Close();
+		 * Description: Writes the index and footer and closes the file. Throws if anything failed to be written.
+		 */
+		void Close();
+
+	};
+
+
+	/*
+	 * Name: KFactorReader
+	 * Inherits: None
+	 * Description: Maps a binary K-factor file into memory and decodes source links from it on demand.
+	 */
+	class KFactorReader {
+
+	protected:
+
+		const char *m_pData;
+		size_t mSize;
+		KFactorFile::Header mHeader;
+		std::vector<KFactorFile::IndexEntry> mIndex;		// sorted by link
+
+	public:
+
+		/*
+		 * Constructor arguments:
+		 * 		1. Filename - file to map. Throws if it can't be mapped, or isn't a complete K-factor file
+		 * 					  with every record inside it.
+		 */
+		KFactorReader( const char * );
+		~KFactorReader();
+
+		bool IsReciprocal() const { return ( mHeader.mFlags & KFACTORFILE_RECIPROCAL ) != 0; }
+
+		VectorMath::Real GetIncrement() const { return mHeader.mIncrement; }
+
+		unsigned int GetLinkCount() const { return mIndex.size(); }
+
+		int GetLink( unsigned int i ) const { return mIndex[i].mLink; }
+
+		/*
+		 * Method: bool ReadLink( int linkIndex, UrcData::SourceLocationList *pSrcLocList ) const;
+		 * Description: Decodes the given source link's K-factors. Returns false if the file has none for it, and
+		 * 				throws if its record is malformed.
+		 */
+		bool ReadLink( int, UrcData::SourceLocationList * ) const;
+
+	};
+
+};
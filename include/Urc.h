@@ -23,5 +23,7 @@
 #include "Singleton.h"
 #include "VectorMath.h"
 #include "UrcData.h"
+#include "EdgeGrid.h"
+#include "KFactorFile.h"
 #include "Fading.h"
 #include "Classifier.h"
@@ -24,9 +24,12 @@
 #include "VectorMath.h"
 #include <list>
 #include <map>
+#include <istream>
 
 namespace Urc {
 
+	class EdgeGrid;
+
 	/*
 	 * Name: UrcData
 	 * Inherits: Singleton
@@ -117,6 +120,44 @@ namespace Urc {
 		typedef std::vector<SourceLaneList> SourceLocationList;
 		typedef std::vector<SourceLocationList> RiceFactorMap;
 
+		/*
+		 * Name: KRun
+		 * Description: A run of equal K-factors along a destination link.
+		 */
+		struct KRun {
+			unsigned int mEnd;				// one past the run's last position
+			double mK;
+		};
+
+		/*
+		 * Name: KRunList
+		 * Description: The K-factors from one source position to one destination link, run-length encoded. The
+		 * 				destination's positions are laid out location by location, mLanes to each, so that the
+		 * 				long runs of Rayleigh and pure LOS along a street cost one run each. Positions past the
+		 * 				last run are Rayleigh (0).
+		 */
+		struct KRunList {
+			unsigned int mLanes;
+			std::vector<KRun> mRuns;		// ascending by mEnd
+		};
+
+		typedef std::map<int,KRunList> DestinationRunLookup;
+		typedef std::vector<DestinationRunLookup> SourceLaneRuns;
+		typedef std::vector<SourceLaneRuns> SourceLocationRuns;
+		typedef std::vector<SourceLocationRuns> RiceFactorRunMap;
+
+		/*
+		 * Name: RsuRiceFactors
+		 * Description: The pre-computed K-factors from one RSU to the links in LOS of it.
+		 */
+		struct RsuRiceFactors {
+			std::string mName;
+			VectorMath::Vector2D mPosition;
+			int mLink;								// link the RSU is on
+			VectorMath::Real mIncrement;			// between K-Factor calculations along the links
+			DestinationRunLookup mDestinations;
+		};
+
 		struct CarDefinition {
 
 			VectorMath::Real mAcceleration;
@@ -241,6 +282,14 @@ namespace Urc {
 		 */
 		Classification GetClassification( std::string link1, std::string link2 );
 
+		/*
+		 * Method: void GetLinkNeighbours( VectorMath::Real range, std::vector< std::vector<int> > *pNeighbours );
+		 * Description: For every summed link, gets the links (ascending) that any of its lanes could reach in LOS:
+		 * 				those classified LOS, or NLOS1/NLOS2 (which RefineClassification may turn into LOS),
+		 * 				whose bounds, lanes included, come within range of each other.
+		 */
+		void GetLinkNeighbours( VectorMath::Real range, std::vector< std::vector<int> > *pNeighbours );
+
 		/**
 		 *	Get the classification between the given points.
 		 */
@@ -254,9 +303,51 @@ namespace Urc {
 		/*
 		 * Method: VectorMath::Real GetK( LinkPair p, Vector2D srcPos, Vector2D destPos );
 		 * Description: Get the pre-computed k-factor between the given source and destination.
+		 * 				If the data was computed in reciprocal mode, the lookup is turned around
+		 * 				whenever the source link is above the destination link.
 		 */
 		VectorMath::Real GetK( VectorMath::OrderedIndexPair p, VectorMath::Vector2D srcPos, int srcLane, VectorMath::Vector2D destPos, int destLane, bool flipped = false );
 
+		/*
+		 * Method: void SetInterpolateK( bool interpolate );
+		 * Description: Whether GetK interpolates between the pre-computed positions around the source and destination,
+		 * 				rather than taking the nearest. This lets the K-factors be computed at a coarser increment.
+		 */
+		void SetInterpolateK( bool interpolate ) { mInterpolateK = interpolate; }
+
+		/*
+		 * Method: static void EncodeRuns( const DestinationLocationList &destLocList, KRunList *pRuns );
+		 * Description: Run-length encodes the K-factors from one source position to one destination link.
+		 */
+		static void EncodeRuns( const DestinationLocationList &, KRunList * );
+
+		/*
+		 * Method: void SetRiceFactors( int linkIndex, const SourceLocationList &srcLocList );
+		 * Description: Stores the pre-computed K-factors from one source link, encoded as runs.
+		 */
+		void SetRiceFactors( int, const SourceLocationList & );
+
+		/*
+		 * Method: void LoadRsuRiceFactors( const char *rsuDataFile );
+		 * Description: Loads the pre-computed K-factors from RSUs, written by the Raytracer's RSU pass. Each run of a
+		 * 				sharded configuration writes its own, so this may be called for several files.
+		 */
+		void LoadRsuRiceFactors( const char * );
+
+		/*
+		 * Method: int FindRsu( const std::string &name, VectorMath::Vector2D position );
+		 * Description: Get the index of the RSU with pre-computed K-factors by its name, or if the name is empty, the
+		 * 				one within a lane width of the position. Returns -1 if there isn't one.
+		 */
+		int FindRsu( const std::string &, VectorMath::Vector2D );
+
+		/*
+		 * Method: VectorMath::Real GetRsuK( int rsu, int destLink, VectorMath::Vector2D destPos, int destLane );
+		 * Description: Get the pre-computed k-factor between an RSU (from FindRsu) and a position on a link. The
+		 * 				channel is the same both ways, so this serves whether the RSU sends or receives.
+		 */
+		VectorMath::Real GetRsuK( int, int, VectorMath::Vector2D, int );
+
 		/*
 		 * Method: bool LinkIsInternal( std::string linkName, LinkIndexSet **pLinkIndices );
 		 * Description: Returns true if the given link name is an internal link, and returns a pointer to the parent node's connected links.
@@ -302,6 +393,18 @@ namespace Urc {
 		 */
 		void ComputeBuckets();
 
+		/*
+		 * Method: void ComputeEdgeGrid();
+		 * Description: Builds the edge grid used by the Raytracer. Call after manually adding buildings.
+		 */
+		void ComputeEdgeGrid();
+
+		/*
+		 * Method: const EdgeGrid *GetEdgeGrid();
+		 * Description: Get the grid of building edges. NULL if it hasn't been computed.
+		 */
+		const EdgeGrid *GetEdgeGrid() { return mEdgeGrid; }
+
 		/*
 		 * Method: VectorMath::Vector3D GetVehicleTypeDimensions( std::string );
 		 * Description: Get the width (x), length (y), and height (z) of vehicles of the given class.
@@ -320,8 +423,40 @@ namespace Urc {
 		 */
 		Classification GetClassificationFromInternalLinks( std::string txName, std::string rxName, VectorMath::Vector2D, VectorMath::Vector2D );
 
+		/*
+		 * Method: VectorMath::Real LookupK( unsigned int sourceLink, unsigned int sourcePos, int srcLane, unsigned int destLink, unsigned int destinationPos, int destLane );
+		 * Description: Get the pre-computed k-factor at the given positions along the links. Anything not in the table is Rayleigh (0).
+		 */
+		VectorMath::Real LookupK( unsigned int, unsigned int, int, unsigned int, unsigned int, int );
+
+		/*
+		 * Method: static VectorMath::Real LookupRun( const KRunList &runs, unsigned int destinationPos, int destLane );
+		 * Description: Get the k-factor at the given position along a destination link from its runs.
+		 */
+		static VectorMath::Real LookupRun( const KRunList &, unsigned int, int );
+
+		/*
+		 * Method: void GetInterpolationPoint( Link *pLink, VectorMath::Vector2D position, VectorMath::Real increment, unsigned int *pIndex, VectorMath::Real *pWeight );
+		 * Description: Finds the computed positions either side of the given one along a link: the index of the one before, and
+		 * 				the weight of the one after.
+		 */
+		void GetInterpolationPoint( Link *, VectorMath::Vector2D, VectorMath::Real, unsigned int *, VectorMath::Real * );
+
+		/*
+		 * Method: static VectorMath::Real BlendK( const VectorMath::Real *pK, const VectorMath::Real *pWeights, int count );
+		 * Description: The weighted average of K-factors, taken as logs, with Rayleigh and pure LOS weighed against the finite ones.
+		 */
+		static VectorMath::Real BlendK( const VectorMath::Real *, const VectorMath::Real *, int );
+
+		/*
+		 * Method: static void ReadRiceFactors( std::istream &stream, int *pLinkIndex, SourceLocationList *pSrcLocList );
+		 * Description: Reads one source link's K-factors, as laid out in the text file.
+		 */
+		static void ReadRiceFactors( std::istream &, int *, SourceLocationList * );
+
 
 		Bucket **m_ppBuckets;
+		EdgeGrid *mEdgeGrid;								// grid of building edges, shared by all tracers
 		unsigned int mBucketX;
 		unsigned int mBucketY;
 		VectorMath::Vector2D mCentroid;
@@ -357,8 +492,11 @@ namespace Urc {
 		ClassificationMap mClassificationMap;				// classifications
 		BuildingSet mBuildingSet;
 
-		RiceFactorMap mRiceFactorData;						// map of pre-computed K-factors
+		RiceFactorRunMap mRiceFactorData;					// map of pre-computed K-factors, as runs
+		std::vector<RsuRiceFactors> mRsuRiceFactors;		// pre-computed K-factors from the RSUs
 		int mLengthIncrement;								// Increment between K-Factor calculations along the links.
+		bool mReciprocalK;									// K-Factors were only computed with the source link at or below the destination link.
+		bool mInterpolateK;									// GetK interpolates between the positions computed, rather than taking the nearest.
 
 		CarDefinitionMap mCarDefinitions;					// map of car definitions
 
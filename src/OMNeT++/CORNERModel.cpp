@@ -96,8 +96,20 @@ void CORNERModel::filterSignal( AirFrame *frame, const Coord& sendersPos, const
 	UrcData::GetSingleton()->RefineClassification( c, posTv, posRv );
 	if ( staticK == -1 ) {
 		// There has been no static K factor specified. Get one from our index.
-		if ( c.mClassification == Classifier::LOS )
-			kFactor = UrcData::GetSingleton()->GetK( c.mLinkPair, posTv, txLaneId, posRv, rxLaneId, c.mFlipped );
+		// An RSU isn't at one of the positions along its link, so it has K factors of its own, if they were computed.
+		if ( c.mClassification == Classifier::LOS ) {
+			UrcData *pUrc = UrcData::GetSingleton();
+			int rsu = -1;
+			if ( ( pRsuTx != NULL ) != ( pRsuRx != NULL ) )
+				rsu = pRsuTx ? pUrc->FindRsu( pRsuTx->getRsuName(), posTv ) : pUrc->FindRsu( pRsuRx->getRsuName(), posRv );
+			if ( rsu >= 0 ) {
+				bool rsuFirst = ( ( pRsuTx != NULL ) != c.mFlipped );
+				int otherLink = ( rsuFirst ? c.mLinkPair.second : c.mLinkPair.first );
+				kFactor = pUrc->GetRsuK( rsu, otherLink, pRsuTx ? posRv : posTv, pRsuTx ? rxLaneId : txLaneId );
+			} else {
+				kFactor = pUrc->GetK( c.mLinkPair, posTv, txLaneId, posRv, rxLaneId, c.mFlipped );
+			}
+		}
 	} else {
 		kFactor = staticK;
 	}
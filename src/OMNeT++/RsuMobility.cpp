@@ -24,6 +24,7 @@ void RsuMobility::initialize( int stage )
 	if ( stage == 0 ) {
 		mHeight = par("height").doubleValue();
 		mRoadId = par("roadId").stringValue();
+		mRsuName = par("rsuName").stringValue();
 	}
 }
 
@@ -29,6 +29,7 @@ class RsuMobility : public ConstSpeedMobility
 public:
 	double getHeight() { return mHeight; }
 	std::string getRoadId() { return mRoadId; }
+	std::string getRsuName() { return mRsuName; }
 	int getLaneId() { return 0; }
 
 protected:
@@ -36,6 +37,7 @@ protected:
 
     double mHeight;			/**< The height in metres of this RSU off the ground. */
     std::string mRoadId;	/**< The id of the road in Sumo this RSU is on. */
+    std::string mRsuName;	/**< The name of this RSU in the Raytracer's RSU definition file, if it has one. */
 
 };
 
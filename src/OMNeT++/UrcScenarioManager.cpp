@@ -15,6 +15,7 @@
 
 
 #include <fstream>
+#include <sstream>
 #include <queue>
 #include <algorithm>
 #include "UrcScenarioManager.h"
@@ -76,6 +77,19 @@ void UrcScenarioManager::initialize(int stage) {
 		if ( Urc::UrcData::GetSingleton() == NULL )
 		    opp_error("Urc::UrcData Initialization failed for some reason.");
 
+		mUrcData->SetInterpolateK( par("interpolateK").boolValue() );
+
+		// each run of a sharded configuration writes its own RSU file
+		std::istringstream rsuFiles( par("rsuRiceFiles").stringValue() );
+		std::string rsuFile;
+		while ( rsuFiles >> rsuFile ) {
+			try {
+				mUrcData->LoadRsuRiceFactors( rsuFile.c_str() );
+			} catch (Exception &e) {
+				opp_error(e.What().c_str());
+			}
+		}
+
 		try {
 			mFading = new Urc::Fading( par("componentFile").stringValue(), par("randSeed").longValue() );
 		} catch (Exception &e) {
@@ -0,0 +1,375 @@
+/*
+ *  ImageSource.cpp - Image method K-factor estimator
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+#include <cfloat>
+
+#include "Urc.h"
+#include "ImageSource.h"
+
+using namespace std;
+using namespace VectorMath;
+using namespace Urc;
+
+
+
+/*
+ * Constructor arguments:
+ * 		1. Transmitter Position - location of the transmitter in the network
+ * 		2. Maximum Reflections - deepest images to build
+ */
+ImageSourceTracer::ImageSourceTracer( Vector2D tx, unsigned int maxReflections ) {
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	if ( pUrcData == NULL )
+		THROW_EXCEPTION("ImageSourceTracer requires an initialised UrcData Singleton. Found none!");
+
+	mEdgeGrid = pUrcData->GetEdgeGrid();
+	if ( mEdgeGrid == NULL )
+		THROW_EXCEPTION("ImageSourceTracer requires the UrcData edge grid to be computed. Found none!");
+
+	mPositionTX = tx;
+	mMaxReflections = maxReflections;
+	mRange = pUrcData->GetFreeSpaceRange();
+	mMinDistance = pUrcData->GetLaneWidth() / 2;
+	mTruncated = false;
+	mCompleteDepth = maxReflections;
+
+	mEdgeGrid->FindEdgesNear( tx, mRange, &mNearbyEdges );
+	BuildTree();
+
+}
+
+
+
+ImageSourceTracer::~ImageSourceTracer() {
+	mNodes.clear();
+	mNearbyEdges.clear();
+}
+
+
+
+/*
+ * Method: void BuildTree();
+ * Description: Builds the tree of images, breadth first.
+ */
+void ImageSourceTracer::BuildTree() {
+
+	ImageNode root;
+	root.mImage = root.mApertureA = root.mApertureB = mPositionTX;
+	root.mEdge = 0;
+	root.mParent = -1;
+	root.mDepth = 0;
+	mNodes.push_back( root );
+
+	for ( unsigned int i = 0; i < mNodes.size(); i++ ) {
+
+		ImageNode node = mNodes[i];		// a copy, since mNodes grows underneath us
+		if ( node.mDepth >= mMaxReflections )
+			continue;
+		long lastBuilding = ( node.mDepth > 0 ? mEdgeGrid->GetEdge( node.mEdge ).mBuilding : -1 );
+
+		std::vector<unsigned int>::iterator edgeIt;
+		for ( AllInVector( edgeIt, mNearbyEdges ) ) {
+
+			const EdgeGrid::Edge &edge = mEdgeGrid->GetEdge( *edgeIt );
+			if ( edge.mBuilding == lastBuilding )
+				continue;	// rays never reflect off the same building twice running
+
+			// only the part of the edge lit through the parent's aperture can make an image
+			LineSegment lit = edge.mLine;
+			if ( node.mDepth > 0 ) {
+				Vector2D normals[3];
+				Real offsets[3];
+				GetBeamPlanes( node, normals, offsets );
+				bool visible = true;
+				for ( int p = 0; p < 3 && visible; p++ )
+					visible = ClipHalfPlane( &lit, normals[p], offsets[p] );
+				if ( !visible )
+					continue;
+			}
+
+			// the unfolded path to any point on the edge is a straight line from the image
+			if ( lit.DistanceFromPoint( node.mImage ) >= mRange )
+				continue;
+
+			Real side = edge.mNormal.DotProduct( node.mImage - edge.mLine.mStart );
+			if ( fabs( side ) < 1e-9 )
+				continue;	// the image is on the edge's line, so nothing can reflect off it
+
+			ImageNode child;
+			child.mImage = node.mImage - edge.mNormal * ( 2 * side );
+			child.mApertureA = lit.mStart;
+			child.mApertureB = lit.mEnd;
+			Vector2D a = child.mApertureA - child.mImage, b = child.mApertureB - child.mImage;
+			if ( a.x * b.y - a.y * b.x < 0 )
+				std::swap( child.mApertureA, child.mApertureB );
+			child.mEdge = *edgeIt;
+			child.mParent = i;
+			child.mDepth = node.mDepth + 1;
+
+			// Breadth first, so it's the deepest images that are lost.
+			if ( mNodes.size() >= IMAGESOURCE_MAX_NODES ) {
+				mTruncated = true;
+				mCompleteDepth = node.mDepth;
+				return;
+			}
+			mNodes.push_back( child );
+
+		}
+
+	}
+
+}
+
+
+
+/*
+ * Method: void GetBeamPlanes( const ImageNode &node, VectorMath::Vector2D *pNormals, VectorMath::Real *pOffsets ) const;
+ * Description: The three half planes (normal.p >= offset) bounding the rays reflected off the node's edge:
+ * 				the far side of the edge from the image, and either side of the wedge through the aperture.
+ */
+void ImageSourceTracer::GetBeamPlanes( const ImageNode &node, Vector2D *pNormals, Real *pOffsets ) const {
+
+	const EdgeGrid::Edge &edge = mEdgeGrid->GetEdge( node.mEdge );
+	Real c = edge.mNormal.DotProduct( edge.mLine.mStart );
+	Real sign = ( edge.mNormal.DotProduct( node.mImage ) > c ? -1 : 1 );
+	pNormals[0] = edge.mNormal * sign;
+	pOffsets[0] = c * sign;
+
+	Vector2D a = node.mApertureA - node.mImage, b = node.mApertureB - node.mImage;
+	pNormals[1] = Vector2D( -a.y, a.x );
+	pOffsets[1] = pNormals[1].DotProduct( node.mImage );
+	pNormals[2] = Vector2D( b.y, -b.x );
+	pOffsets[2] = pNormals[2].DotProduct( node.mImage );
+
+}
+
+
+
+/*
+ * Method: static bool ClipHalfPlane( VectorMath::LineSegment *pLine, VectorMath::Vector2D normal, VectorMath::Real offset );
+ * Description: Cuts the line down to the part where normal.p >= offset. Returns false if nothing is left.
+ */
+bool ImageSourceTracer::ClipHalfPlane( LineSegment *pLine, Vector2D normal, Real offset ) {
+
+	Real f0 = normal.DotProduct( pLine->mStart ) - offset;
+	Real f1 = normal.DotProduct( pLine->mEnd ) - offset;
+	if ( f0 < 0 && f1 < 0 )
+		return false;
+
+	Vector2D crossing = pLine->mStart + ( pLine->mEnd - pLine->mStart ) * ( f0 / ( f0 - f1 ) );
+	if ( f0 < 0 )
+		pLine->mStart = crossing;
+	else if ( f1 < 0 )
+		pLine->mEnd = crossing;
+	return true;
+
+}
+
+
+
+/*
+ * Method: bool InBeam( const ImageNode &node, VectorMath::Vector2D p ) const;
+ * Description: Whether a point could be reached by a ray from the node's image reflected off the node's edge.
+ */
+bool ImageSourceTracer::InBeam( const ImageNode &node, Vector2D p ) const {
+
+	if ( node.mDepth == 0 )
+		return true;
+
+	Vector2D normals[3];
+	Real offsets[3];
+	GetBeamPlanes( node, normals, offsets );
+	for ( int i = 0; i < 3; i++ )
+		if ( normals[i].DotProduct( p ) < offsets[i] )
+			return false;
+	return true;
+
+}
+
+
+
+/*
+ * Method: bool IsClear( VectorMath::LineSegment segment, long ignoreBuilding ) const;
+ * Description: Whether the segment gets to its end without hitting an edge first.
+ */
+bool ImageSourceTracer::IsClear( LineSegment segment, long ignoreBuilding ) const {
+
+	EdgeGrid::Hit hit;
+	if ( !mEdgeGrid->FindNearestHit( segment, mMinDistance, ignoreBuilding, &hit ) )
+		return true;
+
+	// the edge a segment ends on is hit right at the end; anything before that is in the way.
+	return hit.mDistance >= segment.GetDistance() * ( 1 - 1e-9 );
+
+}
+
+
+
+/*
+ * Method: bool EvaluatePath( unsigned int node, VectorMath::Vector2D rx, VectorMath::Real radius, VectorMath::Real *pPower ) const;
+ * Description: Follows the node's path back from the receiver to the transmitter. If the path is real and
+ * 				unobstructed, gives the power it carries to a receiver of the given radius, and returns true.
+ */
+bool ImageSourceTracer::EvaluatePath( unsigned int index, Vector2D rx, Real radius, Real *pPower ) const {
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	unsigned int reflections = mNodes[index].mDepth;
+
+	// Work back from the receiver: each reflection point is where the line from the image to the
+	// point after it crosses the image's edge.
+	std::vector<Vector2D> points( reflections + 2 );
+	std::vector<const EdgeGrid::Edge*> edges( reflections );
+	points[0] = mPositionTX;
+	points[reflections+1] = rx;
+	for ( int n = index; mNodes[n].mDepth > 0; n = mNodes[n].mParent ) {
+
+		const ImageNode &node = mNodes[n];
+		const EdgeGrid::Edge &edge = mEdgeGrid->GetEdge( node.mEdge );
+		Vector2D next = points[ node.mDepth + 1 ];
+		Vector2D d = next - node.mImage;
+		Real denominator = edge.mNormal.DotProduct( d );
+		if ( denominator == 0 )
+			return false;
+		Real t = edge.mNormal.DotProduct( edge.mLine.mStart - node.mImage ) / denominator;
+		if ( t <= 0 || t >= 1 )
+			return false;
+
+		Vector2D q = node.mImage + d * t;
+		Real along = edge.mDirection.DotProduct( q - edge.mLine.mStart );
+		if ( along < 0 || along * along > ( edge.mLine.mEnd - edge.mLine.mStart ).MagnitudeSq() )
+			return false;
+
+		points[ node.mDepth ] = q;
+		edges[ node.mDepth - 1 ] = &edge;
+
+	}
+
+	// Now follow it forwards the way a launched ray would go.
+	Real distance = 0, coefficient = 1, reach = mRange;
+	for ( unsigned int j = 0; j <= reflections; j++ ) {
+
+		LineSegment segment( points[j], points[j+1] );
+		Real length = segment.GetDistance();
+		if ( length <= 0 || ( j < reflections && length < mMinDistance ) )
+			return false;	// a ray passes through edges this close
+		if ( distance + length >= reach )
+			return false;	// out of range
+		if ( !IsClear( segment, ( j == 0 ? -1 : edges[j-1]->mBuilding ) ) )
+			return false;
+		distance += length;
+
+		if ( j < reflections ) {
+
+			// the reflected ray's range is cut by the coefficient it had coming in
+			reach = coefficient * mRange;
+			if ( reach <= distance )
+				return false;
+
+			const EdgeGrid::Edge &edge = *edges[j];
+			Real permitivity = edge.mPermitivity;
+			Real cosAngle = MIN( fabs( segment.GetVector().DotProduct( edge.mNormal ) ) / length, 1.0 );
+			Real sinAngle = sqrt( 1 - cosAngle*cosAngle );
+			Real root = sqrt( permitivity - cosAngle*cosAngle );
+			coefficient *= ( root - permitivity*sinAngle ) / ( root + permitivity*sinAngle );
+
+		}
+
+	}
+
+	// Same power per ray as the launched rays, times the share of a full fan that crosses the receiver.
+	double phi = ( 2 * distance / pUrcData->GetWavelength() + reflections ) * 2 * M_PI;
+	*pPower = coefficient * coefficient * ( 0.5 + sin( phi ) / M_PI ) * radius / ( M_PI * distance );
+	return true;
+
+}
+
+
+
+/*
+ * Method: Raytracer::TraceReport ComputeK( VectorMath::Vector2D receiverPosition, VectorMath::Real gain );
+ * Description: Computes the K factor for the receiver from every specular path that reaches it. The ray
+ * 				counts are counts of paths, and mFactorKErrorDB is 0, since nothing is sampled.
+ */
+Raytracer::TraceReport ImageSourceTracer::ComputeK( Vector2D rx, Real gain ) {
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	Real r = sqrt(gain) * pUrcData->GetWavelength() / (2 * M_PI);
+
+	Raytracer::TraceReport t;
+	t.mSpecularPower = t.mDiffusePower = 0;
+	t.mFactorK = -1;
+	t.mSpecularRayCount = t.mDiffuseRayCount = 0;
+	t.mTransmitterPosition = mPositionTX;
+	t.mReceiverPosition = rx;
+	t.mRayPowerMean = t.mRayPowerVariance = t.mRayPowerMedian = 0;
+	t.mFactorKErrorDB = 0;
+
+	for ( unsigned int i = 0; i < mNodes.size(); i++ ) {
+
+		Real p;
+		if ( !InBeam( mNodes[i], rx ) || !EvaluatePath( i, rx, r, &p ) )
+			continue;
+
+		if ( mNodes[i].mDepth == 0 ) {
+			t.mSpecularPower += p;
+			t.mSpecularRayCount++;
+		} else {
+			t.mDiffusePower += p;
+			t.mDiffuseRayCount++;
+		}
+		t.mRayPowers.push_back( p );
+
+	}
+
+	if ( t.mRayPowers.empty() )
+		return t;	// no paths at all
+
+	t.mRayPowerMean = ComputeMean( t.mRayPowers );
+	t.mRayPowerVariance = ComputeVariance( t.mRayPowers );
+	t.mRayPowerMedian = ComputeMedian( t.mRayPowers );
+
+	if ( t.mSpecularRayCount == 0 ) {
+		// no direct path, so assume rayleigh
+		t.mFactorK = 0;
+		t.mSpecularPower = t.mDiffusePower = 0;
+	} else if ( t.mDiffusePower == 0 ) {
+		t.mFactorK = DBL_MAX;	// best stand-in for infinity I can think of.
+	} else {
+		t.mFactorK = t.mSpecularPower / t.mDiffusePower;
+	}
+
+	return t;
+
+}
+
+
+
+/*
+ * Method: void ComputeKBatch( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real gain, std::vector<Raytracer::TraceReport> *pReports );
+ * Description: ComputeK for each receiver in turn.
+ */
+void ImageSourceTracer::ComputeKBatch( const std::vector<Vector2D> &receivers, Real gain, std::vector<Raytracer::TraceReport> *pReports ) {
+
+	pReports->resize( receivers.size() );
+	for ( unsigned int i = 0; i < receivers.size(); i++ )
+		(*pReports)[i] = ComputeK( receivers[i], gain );
+
+}
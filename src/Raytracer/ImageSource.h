@@ -0,0 +1,152 @@
+/*
+ *  ImageSource.h - Image method K-factor estimator
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+
+
+#pragma once
+
+
+#include <vector>
+
+#include "Raytracer.h"
+
+// upper bound on the number of images kept for one transmitter
+#define IMAGESOURCE_MAX_NODES	200000
+
+namespace Urc {
+
+	/*
+	 * Name: ImageSourceTracer
+	 * Inherits: None
+	 * Description: Finds the exact specular paths from a transmitter to each receiver with the image method,
+	 * 				instead of launching rays. The transmitter is mirrored in every building edge it can reach,
+	 * 				and those images again in every edge they can reach through the edge that made them, up
+	 * 				to a maximum number of reflections. The tree of images is built once per transmitter and
+	 * 				shared by all of its receivers.
+	 *
+	 * 				Paths follow the same rules as the launched rays: a ray doesn't reflect off the same
+	 * 				building twice in a row, hits closer than half a lane width are passed through, and a
+	 * 				ray's range after each reflection is cut by its reflection coefficient. Each path is given
+	 * 				the power the launched rays crossing the receiver would carry, as a share of all the rays
+	 * 				launched, so the K factors are comparable with Raytracer's.
+	 */
+	class ImageSourceTracer {
+
+	protected:
+
+		// one image of the transmitter, and the part of its edge that its parent can see
+		struct ImageNode {
+			VectorMath::Vector2D mImage;				// the transmitter mirrored in every edge from the root down to here
+			VectorMath::Vector2D mApertureA;			// ends of the visible part of the edge, anticlockwise as seen from mImage
+			VectorMath::Vector2D mApertureB;
+			unsigned int mEdge;							// edge this image was mirrored in (unused for the root)
+			int mParent;
+			unsigned int mDepth;						// number of reflections
+		};
+
+		std::vector<ImageNode> mNodes;					// the tree, parents before children. The root is the transmitter itself.
+		std::vector<unsigned int> mNearbyEdges;			// edges in range of the transmitter
+		bool mTruncated;								// the tree reached IMAGESOURCE_MAX_NODES before it was complete
+		unsigned int mCompleteDepth;					// reflections up to which every image was built
+
+		VectorMath::Vector2D mPositionTX;
+		unsigned int mMaxReflections;
+		VectorMath::Real mRange;
+		VectorMath::Real mMinDistance;					// hits closer than this to the start of a segment are ignored
+
+		const EdgeGrid *mEdgeGrid;
+
+		/*
+		 * Method: void BuildTree();
+		 * Description: Builds the tree of images, breadth first.
+		 */
+		void BuildTree();
+
+		/*
+		 * Method: void GetBeamPlanes( const ImageNode &node, VectorMath::Vector2D *pNormals, VectorMath::Real *pOffsets ) const;
+		 * Description: The three half planes (normal.p >= offset) bounding the rays reflected off the node's edge:
+		 * 				the far side of the edge from the image, and either side of the wedge through the aperture.
+		 */
+		void GetBeamPlanes( const ImageNode &, VectorMath::Vector2D *, VectorMath::Real * ) const;
+
+		/*
+		 * Method: static bool ClipHalfPlane( VectorMath::LineSegment *pLine, VectorMath::Vector2D normal, VectorMath::Real offset );
+		 * Description: Cuts the line down to the part where normal.p >= offset. Returns false if nothing is left.
+		 */
+		static bool ClipHalfPlane( VectorMath::LineSegment *, VectorMath::Vector2D, VectorMath::Real );
+
+		/*
+		 * Method: bool InBeam( const ImageNode &node, VectorMath::Vector2D p ) const;
+		 * Description: Whether a point could be reached by a ray from the node's image reflected off the node's edge.
+		 */
+		bool InBeam( const ImageNode &, VectorMath::Vector2D ) const;
+
+		/*
+		 * Method: bool IsClear( VectorMath::LineSegment segment, long ignoreBuilding ) const;
+		 * Description: Whether the segment gets to its end without hitting an edge first.
+		 */
+		bool IsClear( VectorMath::LineSegment, long ) const;
+
+		/*
+		 * Method: bool EvaluatePath( unsigned int node, VectorMath::Vector2D rx, VectorMath::Real radius, VectorMath::Real *pPower ) const;
+		 * Description: Follows the node's path back from the receiver to the transmitter. If the path is real and
+		 * 				unobstructed, gives the power it carries to a receiver of the given radius, and returns true.
+		 */
+		bool EvaluatePath( unsigned int, VectorMath::Vector2D, VectorMath::Real, VectorMath::Real * ) const;
+
+	public:
+
+		/*
+		 * Constructor arguments:
+		 * 		1. Transmitter Position - location of the transmitter in the network
+		 * 		2. Maximum Reflections - deepest images to build
+		 */
+		ImageSourceTracer( VectorMath::Vector2D, unsigned int );
+		virtual ~ImageSourceTracer();
+
+		VectorMath::Vector2D GetTransmitterPosition() { return mPositionTX; }
+
+		unsigned int GetImageCount() const { return mNodes.size(); }
+
+		/*
+		 * Method: bool IsTruncated() const;
+		 * Description: Whether the tree ran into IMAGESOURCE_MAX_NODES. If it did, paths with more than
+		 * 				GetCompleteDepth() reflections may be missing, and the K factors are biased upwards.
+		 */
+		bool IsTruncated() const { return mTruncated; }
+
+		unsigned int GetCompleteDepth() const { return mCompleteDepth; }
+
+		/*
+		 * Method: Raytracer::TraceReport ComputeK( VectorMath::Vector2D receiverPosition, VectorMath::Real gain );
+		 * Description: Computes the K factor for the receiver from every specular path that reaches it. The ray
+		 * 				counts are counts of paths, and mFactorKErrorDB is 0, since nothing is sampled.
+		 */
+		Raytracer::TraceReport ComputeK( VectorMath::Vector2D, VectorMath::Real );
+
+		/*
+		 * Method: void ComputeKBatch( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real gain, std::vector<Raytracer::TraceReport> *pReports );
+		 * Description: ComputeK for each receiver in turn.
+		 */
+		void ComputeKBatch( const std::vector<VectorMath::Vector2D>&, VectorMath::Real, std::vector<Raytracer::TraceReport>* );
+
+	};
+
+};
@@ -18,11 +18,13 @@
  *  Contact Details: Cooper - andor734@gmail.com
  */
 
+#include <algorithm>
 #include <cfloat>
 #include <climits>
+#include <cstring>
 #include <list>
 #include <map>
-#include <queue>
+#include <sched.h>
 
 #include "Urc.h"
 #include "Raytracer.h"
@@ -35,158 +37,486 @@ using namespace Urc;
 using namespace VectorMath;
 using namespace std;
 
+// number of components per launched ray to reserve room for in each worker's buffer
+#define RAYTRACER_SEGMENTS_PER_RAY		4
+
+// upper bound on the number of cells along either axis of the grid over the finished trace
+#define RAYTRACER_MAX_SEGMENT_CELLS		1024
+
+// rays a receiver must intercept before a K of 0 or infinity (no direct, or no reflected, rays among them) is
+// taken as settled. With none of a kind in 30, that kind is under a tenth of the rays (rule of three, 95%).
+#define RAYTRACER_SETTLED_HITS			30
+
+
+
+/*
+ * Method: void TraceRay( RayPathComponent, unsigned int );
+ * Description: This traces a ray through the road network. Any reflected ray goes onto the given worker's queue.
+ */
+void Raytracer::TraceRay( Raytracer::RayPathComponent ray, unsigned int worker ) {
+
+	RayHit hit;
+	bool bFound = CheckIntersection( ray, &hit );
+	ReflectRay( ray, ( bFound ? &hit : NULL ), worker );
+
+}
+
 
 
 /*
- * Method: void TraceRay( RayPathComponent );
- * Description: This traces a ray through the road network.
+ * Method: void TracePacket( long, unsigned int );
+ * Description: Traces one packet of neighbouring launched rays together, queueing the reflections on the given worker.
  */
-void Raytracer::TraceRay( Raytracer::RayPathComponent ray ) {
+void Raytracer::TracePacket( long packet, unsigned int worker ) {
 
 	UrcData *pUrcData = UrcData::GetSingleton();
-	int lastEdge = ray.mLastReflectorIndex;
-	int intersectObjectIndex = 0;
-	Real incidenceAngle = 0, d, permitivity, scatCoef = 1, angle;
-	RayPathComponent newRay;
-	LineSegment impactedEdge;
-	Vector2D intersectPoint;
+	RayPathComponent rays[EDGEGRID_PACKET_SIZE];
+	LineSegment lines[EDGEGRID_PACKET_SIZE];
+	EdgeGrid::Hit hits[EDGEGRID_PACKET_SIZE];
+	bool found[EDGEGRID_PACKET_SIZE];
+
+	unsigned int first = mFirstRay + packet * EDGEGRID_PACKET_SIZE;
+	unsigned int count = MIN( mFirstRay + mRayCount - first, EDGEGRID_PACKET_SIZE );
+	for ( unsigned int i = 0; i < count; i++ ) {
+		rays[i] = MakeLaunchedRay( first + i );
+		lines[i] = rays[i].mLineSegment;
+	}
 
-	bool bFound = CheckIntersection( ray, &intersectPoint, &incidenceAngle, &impactedEdge, &intersectObjectIndex, &lastEdge );
-	lastEdge = intersectObjectIndex;
+	// launched rays haven't reflected off anything yet, so there's no building to ignore.
+	mEdgeGrid->FindNearestHits( lines, count, pUrcData->GetLaneWidth() / 2, -1, hits, found );
+
+	for ( unsigned int i = 0; i < count; i++ ) {
+		RayHit hit;
+		if ( found[i] )
+			FillHit( rays[i], hits[i], &hit );
+		ReflectRay( rays[i], ( found[i] ? &hit : NULL ), worker );
+	}
+
+	__sync_fetch_and_sub( &mOutstandingRays, count );
+
+}
+
+
+
+/*
+ * Method: void ReflectRay( RayPathComponent, const RayHit*, unsigned int );
+ * Description: Stores the traced component, and queues the reflected ray if there was a hit and it has range left.
+ * 				A NULL hit means the ray didn't hit anything.
+ */
+void Raytracer::ReflectRay( Raytracer::RayPathComponent ray, const RayHit *pHit, unsigned int worker ) {
+
+	Real d, permitivity, cosAngle, sinAngle, root;
+	RayPathComponent newRay;
 
 	// if we didn't find any intersections
-	if ( !bFound ) {
+	if ( pHit == NULL ) {
 
-		pthread_mutex_lock( &mRaySetMutex );
-		mRaySeq.push_back( ray );
-		pthread_mutex_unlock( &mRaySetMutex );
+		if ( mRecordTouched )
+			mWorkerContexts[worker].mEscaped = true;
+		StoreComponent( ray, worker );
 		return;
 
 	}
 
-	ray.mLineSegment = LineSegment( ray.mLineSegment.mStart, intersectPoint );
-	ray.mDistanceSum += ray.mLineSegment.GetDistance();
-	ray.mReflectionCount++;
-	pthread_mutex_lock( &mRaySetMutex );
-	mRaySeq.push_back( ray );
-	pthread_mutex_unlock( &mRaySetMutex );
+	if ( mRecordTouched )
+		mWorkerContexts[worker].mTouched[pHit->mBuilding] = true;
+
+	// the stored component keeps the distance and reflections from before it; the reflection adds to the new ray.
+	ray.mLineSegment = LineSegment( ray.mLineSegment.mStart, pHit->mPoint );
+	StoreComponent( ray, worker );
 
-	permitivity = pUrcData->GetBuilding( intersectObjectIndex )->mPermitivity;
+	permitivity = pHit->mPermitivity;
+	cosAngle = pHit->mCosIncidence;
+	sinAngle = sqrt( MAX( 1 - cosAngle*cosAngle, 0 ) );
+	root = sqrt( permitivity - cosAngle*cosAngle );
 
-	newRay.mReflectionCoefficient = ray.mReflectionCoefficient * ( sqrt(permitivity - cos(incidenceAngle)*cos(incidenceAngle)) - permitivity*sin(incidenceAngle) ) / ( sqrt(permitivity - cos(incidenceAngle)*cos(incidenceAngle)) + permitivity*sin(incidenceAngle) );
-	newRay.mDistanceSum = ray.mDistanceSum;
+	newRay.mReflectionCoefficient = ray.mReflectionCoefficient * ( root - permitivity*sinAngle ) / ( root + permitivity*sinAngle );
+	newRay.mDistanceSum = ray.mDistanceSum + ray.mLineSegment.GetDistance();
+	newRay.mReflectionCount = ray.mReflectionCount + 1;
 	d = ray.mReflectionCoefficient * mRayLength - newRay.mDistanceSum;
 	if ( d <= 0 )
 		return;
-	newRay.mLineSegment = LineSegment( intersectPoint, intersectPoint + ray.mLineSegment.GetVector().Reflect( impactedEdge ).Unitise() * d );
+	// mirror the ray's direction in the edge
+	Vector2D u = ray.mLineSegment.GetVector().Unitise();
+	Vector2D reflected = u - pHit->mNormal * ( 2 * u.DotProduct( pHit->mNormal ) );
+	newRay.mLineSegment = LineSegment( pHit->mPoint, pHit->mPoint + reflected * d );
+
+	newRay.mLastReflectorIndex = pHit->mBuilding;
+	newRay.mRayIndex = ray.mRayIndex;
+	newRay.mWeight = ray.mWeight;
+	if ( !Survives( &newRay ) )
+		return;
+	PushRay( newRay, worker );
+
+}
 
-	newRay.mLastReflectorIndex = lastEdge;
-	pthread_mutex_lock( &mRayQueueMutex );
-	mRayQueue.push( newRay );
-	pthread_mutex_unlock( &mRayQueueMutex );
+
+
+/*
+ * Method: RayPathComponent MakeLaunchedRay( unsigned int );
+ * Description: Builds the first component of the given launched ray. Each round's fan is turned by
+ * 				a fraction of the angle between rays, so that the rounds fill in between each other.
+ */
+Raytracer::RayPathComponent Raytracer::MakeLaunchedRay( unsigned int r ) {
+
+	unsigned int round = r / mRayCount;
+	Real alpha = mStartAngle + 2*M_PI*( r % mRayCount + RoundOffset( round ) )/mRayCount;
+	RayPathComponent newComponent;
+	newComponent.mDistanceSum = 0;
+	newComponent.mLineSegment = LineSegment( mPositionTX, mPositionTX+Vector2D(cos(alpha),sin(alpha))*mRayLength );
+	newComponent.mReflectionCoefficient = 1;
+	newComponent.mReflectionCount = 0;
+	newComponent.mLastReflectorIndex = -1;
+	newComponent.mRayIndex = r;
+	newComponent.mWeight = 1;
+	return newComponent;
 
 }
 
 
 
+/*
+ * Method: void SetSeed( unsigned int seed );
+ * Description: Sets the seed the start angle of the fan is drawn from. Must be called before the trace is started.
+ */
+void Raytracer::SetSeed( unsigned int seed ) {
+
+	if ( mStarted )
+		THROW_EXCEPTION( "The seed must be set before the trace is started." );
+
+	// the fan repeats every quarter turn, near enough, so the start angle only needs to cover that.
+	mSeed = seed;
+	mStartAngle = M_PI / 2 * ( (Real)seed / 4294967296.0 );
+
+}
+
 
 
 /*
- * Method: bool CheckIntersection( RayPathComponent, VectorMath::Vector2D*, Real *, int *, int );
- * Description: This traces a ray through the road network.
+ * Method: static unsigned int MakeSeed( VectorMath::Vector2D position, unsigned int base );
+ * Description: Mixes a base seed with the bits of a transmitter position, so each position gets its own
+ * 				seed that doesn't depend on which tracers were made before it.
  */
-bool Raytracer::CheckIntersection( RayPathComponent ray, VectorMath::Vector2D *intersectPoint, Real *incidentAngle, VectorMath::LineSegment *impactedLine, int *intersectObjectIndex, int *lastEdge ) {
+unsigned int Raytracer::MakeSeed( Vector2D position, unsigned int base ) {
 
-	UrcData *pUrcData = UrcData::GetSingleton();
-	Vector2D temp;
-	Real Dmin = DBL_MAX;
-	UrcData::LineSet::iterator lineIt;
-	UrcData::Bucket::iterator buckIt;
-
-	Rect rayRect = Rect(
-		std::min( ray.mLineSegment.mStart.x, ray.mLineSegment.mEnd.x ),
-		std::min( ray.mLineSegment.mStart.y, ray.mLineSegment.mEnd.y ),
-		fabs( ray.mLineSegment.mStart.x - ray.mLineSegment.mEnd.x ),
-		fabs( ray.mLineSegment.mStart.y - ray.mLineSegment.mEnd.y )
-	);
-
-	// scan through the list of building outlines
-	for ( AllInVector( buckIt, mBucket ) ) {
-
-		// if the current edge we're looking at is the same as the last edge we reflected off, ignore it
-		if ( lastEdge && *lastEdge >= 0 )
-			if ( *buckIt == *lastEdge )
-				continue;
+	unsigned long long x, y;
+	memcpy( &x, &position.x, sizeof(x) );
+	memcpy( &y, &position.y, sizeof(y) );
 
-		UrcData::Building *b = pUrcData->GetBuilding( *buckIt );
+	return (unsigned int)( MixWord( MixWord( base, x ), y ) >> 32 );
 
-		// check for intersection and store the intersection point in temp
-		for ( AllInVector( lineIt, b->mEdgeSet ) ) {
+}
 
-			if ( !rayRect.LineSegmentWithin( *lineIt ) )
-				continue;
 
-			if ( lineIt->IntersectLine( ray.mLineSegment, &temp ) ) {
 
-				// get the distance between the start of the ray and the intersection 
-				Real d = ( ray.mLineSegment.mStart - temp ).Magnitude();
+/*
+ * Method: static unsigned long long MixWord( unsigned long long hash, unsigned long long word );
+ * Description: Folds a word into a hash with the splitmix64 finaliser.
+ */
+unsigned long long Raytracer::MixWord( unsigned long long h, unsigned long long word ) {
 
-				Real dint = pUrcData->GetLaneWidth() / 2;
+	h ^= word + 0x9E3779B97F4A7C15ULL + ( h << 6 ) + ( h >> 2 );
+	h = ( h ^ ( h >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+	h = ( h ^ ( h >> 27 ) ) * 0x94D049BB133111EBULL;
+	return h ^ ( h >> 31 );
 
-				// we want to make sure this ray has actually gone somewhere.
-				// Also, we want to make sure that the found intersection is the closest one.
-				if ( d >= dint && d < Dmin ) {
+}
 
-					Dmin = d;
-					*intersectPoint = temp;
-					*intersectObjectIndex = *buckIt;
-					*incidentAngle = ray.mLineSegment.GetVector().AngleBetween( lineIt->GetNormal() );
-					*impactedLine = (*lineIt);
 
-				}
 
-			}
+/*
+ * Method: void SetBounds( VectorMath::Rect bounds );
+ * Description: Rays that reflect outside the bounds are stopped, and the traced components are cut off where
+ * 				they leave them. Use this when nothing outside the bounds can send a ray back in.
+ */
+void Raytracer::SetBounds( Rect bounds ) {
+
+	if ( mStarted )
+		THROW_EXCEPTION( "Termination criteria must be set before the trace is started." );
+	mBounds = bounds;
+	mHaveBounds = true;
 
+}
+
+
+
+/*
+ * Method: void SetMaxReflections( unsigned int maxReflections );
+ * Description: Rays are stopped once they have reflected this many times.
+ */
+void Raytracer::SetMaxReflections( unsigned int maxReflections ) {
+
+	if ( mStarted )
+		THROW_EXCEPTION( "Termination criteria must be set before the trace is started." );
+	mMaxReflections = maxReflections;
+
+}
+
+
+
+/*
+ * Method: void SetPowerFloor( VectorMath::Real floor, bool roulette );
+ * Description: Rays whose power has dropped below floor, relative to the direct ray, are stopped. With roulette,
+ * 				they are instead kept at random with probability power/floor, and those kept carry their power
+ * 				up to the floor, so the expected power is unchanged.
+ */
+void Raytracer::SetPowerFloor( Real floor, bool roulette ) {
+
+	if ( mStarted )
+		THROW_EXCEPTION( "Termination criteria must be set before the trace is started." );
+	mPowerFloor = floor;
+	mRoulette = roulette;
+
+}
+
+
+
+/*
+ * Method: void RecordTouchedBuildings();
+ * Description: Keep track of which buildings the rays hit, and whether any ray hit nothing.
+ */
+void Raytracer::RecordTouchedBuildings() {
+
+	if ( mStarted )
+		THROW_EXCEPTION( "Touched buildings must be recorded from the start of the trace." );
+	mRecordTouched = true;
+	for ( unsigned int w = 0; w < mNumberOfWorkers; w++ )
+		mWorkerContexts[w].mTouched.assign( UrcData::GetSingleton()->GetBuildingCount(), false );
+
+}
+
+
+
+/*
+ * Method: void GetTouchedBuildings( std::vector<int> *pBuildings ) const;
+ * Description: Gets the buildings (ascending) hit by any ray so far.
+ */
+void Raytracer::GetTouchedBuildings( std::vector<int> *pBuildings ) const {
+
+	pBuildings->clear();
+	if ( !mRecordTouched )
+		return;
+	for ( unsigned int b = 0; b < mWorkerContexts[0].mTouched.size(); b++ ) {
+		for ( unsigned int w = 0; w < mNumberOfWorkers; w++ ) {
+			if ( mWorkerContexts[w].mTouched[b] ) {
+				pBuildings->push_back( b );
+				break;
+			}
 		}
+	}
 
-	};
+}
 
-	// if we didn't find any intersections
-	if ( Dmin == DBL_MAX )
+
+
+/*
+ * Method: bool HasEscapedRays() const;
+ * Description: Whether any ray so far has hit nothing, and run out of range in the open.
+ */
+bool Raytracer::HasEscapedRays() const {
+
+	for ( unsigned int w = 0; w < mNumberOfWorkers; w++ )
+		if ( mWorkerContexts[w].mEscaped )
+			return true;
+	return false;
+
+}
+
+
+
+/*
+ * Method: bool Survives( RayPathComponent *pRay ) const;
+ * Description: Applies the termination criteria to a reflected ray about to be queued. The roulette draw is
+ * 				hashed from the seed, ray and reflection, so it comes out the same on every run.
+ */
+bool Raytracer::Survives( RayPathComponent *pRay ) const {
+
+	if ( pRay->mReflectionCount > mMaxReflections )
+		return false;
+	if ( mHaveBounds && !Rect( mBounds ).PointWithin( pRay->mLineSegment.mStart ) )
+		return false;
+
+	if ( mPowerFloor <= 0 )
+		return true;
+	Real power = pRay->mReflectionCoefficient * pRay->mReflectionCoefficient * pRay->mWeight;
+	if ( power >= mPowerFloor )
+		return true;
+	if ( !mRoulette )
+		return false;
+
+	Real survival = power / mPowerFloor;
+	unsigned long long h = MixWord( MixWord( mSeed, pRay->mRayIndex ), pRay->mReflectionCount );
+	if ( (Real)( h >> 11 ) / 9007199254740992.0 >= survival )
 		return false;
+	pRay->mWeight /= survival;
+	return true;
+
+}
+
+
+
+/*
+ * Method: void ClipToBounds( VectorMath::LineSegment *pLine ) const;
+ * Description: Cuts the end of the line off where it leaves the bounds. Lines starting outside are left alone.
+ */
+void Raytracer::ClipToBounds( LineSegment *pLine ) const {
+
+	Vector2D d = pLine->mEnd - pLine->mStart;
+	Real lower[2] = { mBounds.location.x, mBounds.location.y };
+	Real upper[2] = { mBounds.location.x + mBounds.size.x, mBounds.location.y + mBounds.size.y };
+	Real start[2] = { pLine->mStart.x, pLine->mStart.y };
+	Real dir[2] = { d.x, d.y };
+
+	Real tExit = 1;
+	for ( int axis = 0; axis < 2; axis++ ) {
+		if ( start[axis] < lower[axis] || start[axis] > upper[axis] )
+			return;
+		if ( dir[axis] > 0 )
+			tExit = MIN( tExit, ( upper[axis] - start[axis] ) / dir[axis] );
+		else if ( dir[axis] < 0 )
+			tExit = MIN( tExit, ( lower[axis] - start[axis] ) / dir[axis] );
+	}
+	pLine->mEnd = pLine->mStart + d * tExit;
+
+}
+
+
+
+/*
+ * Method: static Real RoundOffset( unsigned int round );
+ * Description: Fraction of the angle between rays that the given round is turned by. This is the base 2
+ * 				radical inverse (0, 1/2, 1/4, 3/4, ...), so any 2^n rounds together make an even fan.
+ */
+Real Raytracer::RoundOffset( unsigned int round ) {
+
+	Real offset = 0, scale = 0.5;
+	for ( ; round > 0; round >>= 1, scale *= 0.5 )
+		if ( round & 1 )
+			offset += scale;
+	return offset;
+
+}
+
+
+
+/*
+ * Method: void PushRay( RayPathComponent, unsigned int );
+ * Description: Queue a ray on the given worker's queue.
+ */
+void Raytracer::PushRay( Raytracer::RayPathComponent ray, unsigned int worker ) {
+
+	// count the ray before it becomes visible, so the total can't drop to zero while it's in flight.
+	__sync_fetch_and_add( &mOutstandingRays, 1 );
+
+	WorkerQueue &q = mWorkerQueues[worker];
+	pthread_mutex_lock( &q.mMutex );
+	q.mRays.push_back( ray );
+	pthread_mutex_unlock( &q.mMutex );
 
-	if ( *incidentAngle > M_PI/2 )
-		*incidentAngle = M_PI - *incidentAngle;
-	else if ( *incidentAngle < 0 )
-		*incidentAngle = M_PI + *incidentAngle;
+}
+
+
+
+/*
+ * Method: bool PopRay( RayPathComponent*, unsigned int );
+ * Description: Take a ray from the given worker's own queue, or steal one from another worker. Returns false if there were none.
+ */
+bool Raytracer::PopRay( Raytracer::RayPathComponent *pRay, unsigned int worker ) {
+
+	// our own queue first, newest ray first, since that's the one we just reflected.
+	WorkerQueue &own = mWorkerQueues[worker];
+	pthread_mutex_lock( &own.mMutex );
+	bool bFound = !own.mRays.empty();
+	if ( bFound ) {
+		*pRay = own.mRays.back();
+		own.mRays.pop_back();
+	}
+	pthread_mutex_unlock( &own.mMutex );
+
+	// otherwise steal the oldest ray from someone else.
+	for ( unsigned int i = 1; !bFound && i < mNumberOfWorkers; i++ ) {
+
+		WorkerQueue &victim = mWorkerQueues[ ( worker + i ) % mNumberOfWorkers ];
+		pthread_mutex_lock( &victim.mMutex );
+		bFound = !victim.mRays.empty();
+		if ( bFound ) {
+			*pRay = victim.mRays.front();
+			victim.mRays.pop_front();
+		}
+		pthread_mutex_unlock( &victim.mMutex );
+
+	}
+
+	return bFound;
+
+}
+
+
+
+
+
+/*
+ * Method: bool CheckIntersection( RayPathComponent, RayHit* );
+ * Description: Finds where the ray first hits a building. Returns false if it hits nothing.
+ */
+bool Raytracer::CheckIntersection( RayPathComponent ray, RayHit *pHit ) {
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	EdgeGrid::Hit hit;
+
+	// walk the ray through the edge grid, ignoring the building we last reflected off.
+	// we want to make sure this ray has actually gone somewhere, hence the minimum distance.
+	long ignoreBuilding = (int)ray.mLastReflectorIndex;
+	if ( !mEdgeGrid->FindNearestHit( ray.mLineSegment, pUrcData->GetLaneWidth() / 2, ignoreBuilding, &hit ) )
+		return false;
 
+	FillHit( ray, hit, pHit );
 	return true;
 
 }
 
 
 
+/*
+ * Method: void FillHit( RayPathComponent, const EdgeGrid::Hit&, RayHit* );
+ * Description: Works out the building and incidence angle for a hit found in the edge grid.
+ * 				The edge's normal and permitivity come precomputed from the grid.
+ */
+void Raytracer::FillHit( RayPathComponent ray, const EdgeGrid::Hit &hit, RayHit *pHit ) {
+
+	const EdgeGrid::Edge &edge = mEdgeGrid->GetEdge( hit.mEdgeIndex );
+	pHit->mPoint = hit.mPoint;
+	pHit->mBuilding = edge.mBuilding;
+	pHit->mNormal = edge.mNormal;
+	pHit->mPermitivity = edge.mPermitivity;
+
+	// the angle is folded into [0,pi/2] either side of the normal, so only the size of the dot product matters.
+	Vector2D v = ray.mLineSegment.GetVector();
+	pHit->mCosIncidence = MIN( fabs( v.DotProduct( edge.mNormal ) ) / v.Magnitude(), 1.0 );
+
+}
+
+
+
 
 
 
 /*
- * Method: static void *WorkerThread(void *pRT);
- * Description: Traces the rays through the network. Multiple worker threads can work in parallel.
+ * Method: static void WorkerTask(void *pContext);
+ * Description: Traces the rays through the network. Multiple workers can run in parallel.
  */
-void *Raytracer::WorkerThread(void *pRT) {
+void Raytracer::WorkerTask(void *pContext) {
 
-	Raytracer *raytracer = (Raytracer*)pRT;
-	if ( !raytracer ) {
+	WorkerContext *context = (WorkerContext*)pContext;
+	if ( !context || !context->m_pRaytracer ) {
 		THROW_EXCEPTION( "Invalid pointer passed to worker thread!" );
 	}
 
 	bool bDone = false;
 	while( !bDone ) {
-		bDone = raytracer->RunTrace();
+		bDone = context->m_pRaytracer->RunTrace( context->mIndex );
 	}
 
-	return NULL;
-
 }
 
 
@@ -197,36 +527,77 @@ void *Raytracer::WorkerThread(void *pRT) {
  * Constructor arguments:
  * 		1. Transmitter Position - location of the transmitter in the network
  * 		2. Ray Count - number of rays to simulate
- * 		4. Number of Workers - Specify the number of worker threads
+ * 		3. Number of Workers - Specify the number of worker threads
+ * 		4. Thread Pool - pool to run the workers on. If NULL, the tracer makes its own when it needs more than one worker.
  */
-Raytracer::Raytracer( Vector2D tx, unsigned int N, unsigned int nWorkers ) {
+Raytracer::Raytracer( Vector2D tx, unsigned int N, unsigned int nWorkers, ThreadPool *pPool ) {
 
 	mRaySeq.clear();
 
 	mPositionTX = tx;
 	mRayCount = N;
-	mStartAngle = M_PI * (Real)rand() / ( 2 * (Real)RAND_MAX );
+	mStarted = false;
+	SetSeed( MakeSeed( tx, 0 ) );
 
 	// check for a UrcData singleton, used by GetLineSet()
 	UrcData *pUrcData = UrcData::GetSingleton();
 	if ( pUrcData == NULL )
 		THROW_EXCEPTION("Raytracer requires an initialised UrcData Singleton. Found none!");
 
+	mEdgeGrid = pUrcData->GetEdgeGrid();
+	if ( mEdgeGrid == NULL )
+		THROW_EXCEPTION("Raytracer requires the UrcData edge grid to be computed. Found none!");
+
 	mExecuted = false;
 
 	mRayLength = pUrcData->GetFreeSpaceRange();
 
-	mNumberOfWorkers = nWorkers;
-	mRayQueueMutex = PTHREAD_MUTEX_INITIALIZER;
-	mRaySetMutex = PTHREAD_MUTEX_INITIALIZER;
-	mWorkerThreads = new pthread_t[mNumberOfWorkers];
+	mNumberOfWorkers = MAX( nWorkers, 1 );
+	m_pPool = pPool;
+	mOwnPool = NULL;
+	if ( m_pPool == NULL && mNumberOfWorkers > 1 )
+		m_pPool = mOwnPool = new ThreadPool( mNumberOfWorkers );
+	mWorkerQueues = new WorkerQueue[mNumberOfWorkers];
+	mWorkerSegments = new RayPathComponentSet[mNumberOfWorkers];
+	mWorkerContexts = new WorkerContext[mNumberOfWorkers];
+	for ( unsigned int i = 0; i < mNumberOfWorkers; i++ ) {
+		pthread_mutex_init( &mWorkerQueues[i].mMutex, NULL );
+		mWorkerContexts[i].m_pRaytracer = this;
+		mWorkerContexts[i].mIndex = i;
+		mWorkerContexts[i].mSegmentCount = 0;
+		mWorkerContexts[i].mEscaped = false;
+	}
+	mOutstandingRays = 0;
+	mNextPacket = mPacketCount = 0;
+	mFirstRay = 0;
+	mRoundCount = 0;
+	mSegmentCellsX = mSegmentCellsY = 0;
+	mSegmentCellSize = 1;
+	mSegmentCellStart.push_back( 0 );
+	mStreaming = false;
+	mWorkerStreams = NULL;
+	mReceiverRadius = 0;
+	mHaveBounds = false;
+	mMaxReflections = UINT_MAX;
+	mPowerFloor = 0;
+	mRoulette = false;
+	mRecordTouched = false;
 
 }
 
 
 
 Raytracer::~Raytracer() {
+	if ( mStarted && !mExecuted )
+		Wait();		// don't pull the queues out from under running workers
+	delete mOwnPool;
 	mRaySeq.clear();
+	for ( unsigned int i = 0; i < mNumberOfWorkers; i++ )
+		pthread_mutex_destroy( &mWorkerQueues[i].mMutex );
+	delete[] mWorkerQueues;
+	delete[] mWorkerContexts;
+	delete[] mWorkerSegments;
+	delete[] mWorkerStreams;
 }
 
 
@@ -245,26 +616,35 @@ const Raytracer::RayPathComponentSet *Raytracer::GetRaySet() const {
 
 
 /*
- * Method: void RunTrace();
- * Description: Run the trace in the worker thread. Returns true if done.
+ * Method: bool RunTrace( unsigned int worker );
+ * Description: Trace one ray in the given worker thread. Returns true once there is no work left anywhere.
  */
-bool Raytracer::RunTrace() {
+bool Raytracer::RunTrace( unsigned int worker ) {
 
 	Raytracer::RayPathComponent ray;
 
-	bool isEmpty = false;
-	pthread_mutex_lock( &mRayQueueMutex );
-	isEmpty = mRayQueue.empty();
-	if ( !isEmpty ) {
-		ray = mRayQueue.front();
-		mRayQueue.pop();
+	// the launched rays go out first, in packets.
+	if ( mNextPacket < mPacketCount ) {
+		long packet = __sync_fetch_and_add( &mNextPacket, 1 );
+		if ( packet < mPacketCount ) {
+			TracePacket( packet, worker );
+			return false;
+		}
 	}
-	pthread_mutex_unlock( &mRayQueueMutex );
 
-	if ( !isEmpty ) {
-		TraceRay( ray );
+	if ( PopRay( &ray, worker ) ) {
+		TraceRay( ray, worker );
+		__sync_fetch_and_sub( &mOutstandingRays, 1 );
+		return false;
 	}
-	return isEmpty;
+
+	// Nothing to take, but other workers may still be tracing rays that will reflect.
+	// Only stop once nothing is queued or in flight.
+	if ( __sync_fetch_and_add( &mOutstandingRays, 0 ) == 0 )
+		return true;
+
+	sched_yield();
+	return false;
 
 }
 
@@ -272,41 +652,327 @@ bool Raytracer::RunTrace() {
 
 /*
  * Method: void Execute();
- * Description: Run the trace.
+ * Description: Run the trace, and wait for it to finish.
  */
 void Raytracer::Execute() {
 
-	if ( mExecuted )
+	ExecuteAsync();
+	Wait();
+
+}
+
+
+
+/*
+ * Method: void ExecuteAsync();
+ * Description: Start the trace on the thread pool and return straight away. Call Wait() before using the results.
+ * 				With a single worker and no pool, the trace runs on the calling thread before this returns.
+ */
+void Raytracer::ExecuteAsync() {
+
+	if ( mStarted )
 		THROW_EXCEPTION( "Trace has already been executed." );
+	mStarted = true;
+
+	StartRound();
+
+}
+
+
+
+/*
+ * Method: void ExecuteRound();
+ * Description: Trace another round of rays, turned to fall between the earlier ones, and add them to the trace.
+ */
+void Raytracer::ExecuteRound() {
+
+	ExecuteRoundAsync();
+	Wait();
+
+}
+
+
+
+/*
+ * Method: void ExecuteRoundAsync();
+ * Description: As ExecuteRound, but returns straight away. Call Wait() before using the results.
+ */
+void Raytracer::ExecuteRoundAsync() {
+
+	if ( !mExecuted )
+		THROW_EXCEPTION( "The previous round must be finished before another can be started." );
+	mExecuted = false;
+
+	StartRound();
+
+}
 
-	UrcData::GetSingleton()->CollectBucketsInRange( 2*mRayLength, mPositionTX, &mBucket );
 
-	for ( unsigned int r = 0; r < mRayCount; r++ ) {
-		Real alpha = mStartAngle + 2*M_PI*r/mRayCount;
-		RayPathComponent newComponent;
-		newComponent.mDistanceSum = 0;
-		newComponent.mLineSegment = LineSegment( mPositionTX, mPositionTX+Vector2D(cos(alpha),sin(alpha))*mRayLength );
-		newComponent.mReflectionCoefficient = 1;
-		newComponent.mReflectionCount = 0;
-		newComponent.mLastReflectorIndex = -1;
-		mRayQueue.push( newComponent );
+
+/*
+ * Method: void StartRound();
+ * Description: Sets up the next round of launched rays and hands it to the workers.
+ */
+void Raytracer::StartRound() {
+
+	mFirstRay = mRoundCount * mRayCount;
+	mRoundCount++;
+
+	// The launched rays aren't queued; the workers claim them a packet at a time.
+	// They count as outstanding until their packet has been traced.
+	mPacketCount = ( mRayCount + EDGEGRID_PACKET_SIZE - 1 ) / EDGEGRID_PACKET_SIZE;
+	mNextPacket = 0;
+	mOutstandingRays = mRayCount;
+
+	// Most rays bounce a few times, so give each worker room for that up front. Streamed
+	// components aren't kept, so they need none.
+	if ( !mStreaming ) {
+		for ( unsigned int w = 0; w < mNumberOfWorkers; w++ )
+			mWorkerSegments[w].reserve( RAYTRACER_SEGMENTS_PER_RAY * mRayCount / mNumberOfWorkers + 1 );
 	}
 
+	if ( m_pPool == NULL ) {
+		WorkerTask( &mWorkerContexts[0] );
+		return;
+	}
 
-	unsigned int i;
-	for ( i = 0; i < mNumberOfWorkers; i++ ) {
-		if ( pthread_create( &mWorkerThreads[i], NULL, &Raytracer::WorkerThread, this ) ) {
-			THROW_EXCEPTION( "Could not create worker threads for Raytracer." );
+	for ( unsigned int i = 0; i < mNumberOfWorkers; i++ )
+		m_pPool->Submit( &Raytracer::WorkerTask, &mWorkerContexts[i], &mTraceGroup );
+
+}
+
+
+
+/*
+ * Method: void Wait();
+ * Description: Wait for a trace started with ExecuteAsync() to finish.
+ */
+void Raytracer::Wait() {
+
+	if ( !mStarted )
+		THROW_EXCEPTION( "Trace has not been started." );
+	if ( mExecuted )
+		return;
+
+	if ( m_pPool )
+		m_pPool->Wait( &mTraceGroup );
+
+	if ( mStreaming ) {
+		MergeIntercepts();
+	} else {
+		MergeSegments();
+		IndexSegments();
+	}
+	mExecuted = true;
+
+}
+
+
+
+/*
+ * Method: unsigned long GetSegmentCount() const;
+ * Description: Number of ray path components generated over all rounds so far (before any are culled).
+ */
+unsigned long Raytracer::GetSegmentCount() const {
+
+	unsigned long count = 0;
+	for ( unsigned int w = 0; w < mNumberOfWorkers; w++ )
+		count += mWorkerContexts[w].mSegmentCount;
+	return count;
+
+}
+
+
+
+/*
+ * Method: void MergeSegments();
+ * Description: Gathers the workers' components for the latest round onto the end of mRaySeq, ordered by
+ * 				launched ray and then by reflection, so the trace comes out the same whatever the number of workers.
+ */
+void Raytracer::MergeSegments() {
+
+	// Count the components of each launched ray, and turn the counts into offsets.
+	unsigned int base = mRaySeq.size();
+	std::vector<unsigned int> offsets( mRayCount + 1, 0 );
+	unsigned int w;
+	RayPathComponentSet::iterator componentIt;
+	for ( w = 0; w < mNumberOfWorkers; w++ )
+		for ( AllInVector( componentIt, mWorkerSegments[w] ) )
+			offsets[ componentIt->mRayIndex - mFirstRay + 1 ]++;
+	for ( unsigned int r = 0; r < mRayCount; r++ )
+		offsets[r+1] += offsets[r];
+
+	// A ray's path never branches, so its reflection count gives each component its slot.
+	mRaySeq.resize( base + offsets[mRayCount] );
+	for ( w = 0; w < mNumberOfWorkers; w++ ) {
+		for ( AllInVector( componentIt, mWorkerSegments[w] ) )
+			mRaySeq[ base + offsets[ componentIt->mRayIndex - mFirstRay ] + componentIt->mReflectionCount ] = *componentIt;
+		RayPathComponentSet().swap( mWorkerSegments[w] );
+	}
+
+}
+
+
+
+/*
+ * Method: void IndexSegments();
+ * Description: Builds the grid over mRaySeq used by ComputeK. Each component is entered in every cell it passes through.
+ */
+void Raytracer::IndexSegments() {
+
+	mSegmentCellStart.assign( 1, 0 );
+	mSegmentCellEntries.clear();
+	mSegmentCellsX = mSegmentCellsY = 0;
+	if ( mRaySeq.empty() )
+		return;
+
+	RayPathComponentSet::iterator componentIt;
+	Vector2D lower( DBL_MAX, DBL_MAX ), upper( -DBL_MAX, -DBL_MAX );
+	for ( AllInVector( componentIt, mRaySeq ) ) {
+		LineSegment &line = componentIt->mLineSegment;
+		lower.x = std::min( lower.x, std::min( line.mStart.x, line.mEnd.x ) );
+		lower.y = std::min( lower.y, std::min( line.mStart.y, line.mEnd.y ) );
+		upper.x = std::max( upper.x, std::max( line.mStart.x, line.mEnd.x ) );
+		upper.y = std::max( upper.y, std::max( line.mStart.y, line.mEnd.y ) );
+	}
+
+	// Roughly one component per cell. The components are long, so most cells end up holding a few.
+	Vector2D size = upper - lower;
+	mSegmentCellSize = sqrt( MAX( size.x, 1.0 ) * MAX( size.y, 1.0 ) / mRaySeq.size() );
+	mSegmentCellSize = MAX( mSegmentCellSize, UrcData::GetSingleton()->GetLaneWidth() );
+	mSegmentCellSize = MAX( mSegmentCellSize, MAX( size.x, size.y ) / RAYTRACER_MAX_SEGMENT_CELLS );
+	mSegmentOrigin = lower;
+	mSegmentCellsX = (int)floor( size.x / mSegmentCellSize ) + 1;
+	mSegmentCellsY = (int)floor( size.y / mSegmentCellSize ) + 1;
+
+	// Walk each component through the grid, noting every cell it passes through.
+	std::vector< std::pair<int,unsigned int> > entries;
+	std::vector<int> cells;
+	std::vector<int>::iterator cellIt;
+	for ( unsigned int i = 0; i < mRaySeq.size(); i++ ) {
+		cells.clear();
+		WalkCells( mRaySeq[i].mLineSegment, mSegmentOrigin, mSegmentCellSize, mSegmentCellsX, mSegmentCellsY, &cells );
+		for ( AllInVector( cellIt, cells ) )
+			entries.push_back( std::make_pair( *cellIt, i ) );
+	}
+
+	// Counting sort into the cells. The entries are already in mRaySeq order, and stay that way within each cell.
+	std::vector<unsigned int> counts( mSegmentCellsX * mSegmentCellsY, 0 );
+	std::vector< std::pair<int,unsigned int> >::iterator entryIt;
+	for ( AllInVector( entryIt, entries ) )
+		counts[ entryIt->first ]++;
+	for ( unsigned int c = 0; c < counts.size(); c++ )
+		mSegmentCellStart.push_back( mSegmentCellStart.back() + counts[c] );
+	std::copy( mSegmentCellStart.begin(), mSegmentCellStart.end()-1, counts.begin() );
+	mSegmentCellEntries.resize( entries.size() );
+	for ( AllInVector( entryIt, entries ) )
+		mSegmentCellEntries[ counts[ entryIt->first ]++ ] = entryIt->second;
+
+}
+
+
+
+/*
+ * Method: void FindNearbySegments( VectorMath::Vector2D, VectorMath::Real, std::vector<unsigned int>* ) const;
+ * Description: Gets the indices (in mRaySeq order, without repeats) of the components that could pass within
+ * 				the given distance of the point.
+ */
+void Raytracer::FindNearbySegments( Vector2D p, Real r, std::vector<unsigned int> *pIndices ) const {
+
+	pIndices->clear();
+	if ( mSegmentCellsX == 0 )
+		return;
+
+	int x0 = MAX( (int)floor( ( p.x - r - mSegmentOrigin.x ) / mSegmentCellSize ), 0 );
+	int y0 = MAX( (int)floor( ( p.y - r - mSegmentOrigin.y ) / mSegmentCellSize ), 0 );
+	int x1 = MIN( (int)floor( ( p.x + r - mSegmentOrigin.x ) / mSegmentCellSize ), mSegmentCellsX-1 );
+	int y1 = MIN( (int)floor( ( p.y + r - mSegmentOrigin.y ) / mSegmentCellSize ), mSegmentCellsY-1 );
+
+	for ( int y = y0; y <= y1; y++ ) {
+		for ( int x = x0; x <= x1; x++ ) {
+			int cell = y*mSegmentCellsX + x;
+			pIndices->insert( pIndices->end(), mSegmentCellEntries.begin() + mSegmentCellStart[cell], mSegmentCellEntries.begin() + mSegmentCellStart[cell+1] );
+		}
+	}
+
+	// A component can be in several of the cells, and ComputeK must see them in trace order.
+	std::sort( pIndices->begin(), pIndices->end() );
+	pIndices->erase( std::unique( pIndices->begin(), pIndices->end() ), pIndices->end() );
+
+}
+
+
+
+/*
+ * Method: static void WalkCells( VectorMath::LineSegment, VectorMath::Vector2D, VectorMath::Real, int, int, std::vector<int>* );
+ * Description: Appends the index of every cell of the given grid (origin, cell size, cells across and down)
+ * 				that the line passes through, in order along the line. The parts outside the grid are skipped.
+ */
+void Raytracer::WalkCells( LineSegment line, Vector2D origin, Real cellSize, int cellsX, int cellsY, std::vector<int> *pCells ) {
+
+	// Clip the line to the grid first.
+	Vector2D d = line.GetVector();
+	Real lower[2] = { origin.x, origin.y };
+	Real upper[2] = { origin.x + cellsX * cellSize, origin.y + cellsY * cellSize };
+	Real start[2] = { line.mStart.x, line.mStart.y };
+	Real dir[2] = { d.x, d.y };
+	Real tEnter = 0, tExit = 1;
+	for ( int axis = 0; axis < 2; axis++ ) {
+		if ( dir[axis] == 0 ) {
+			if ( start[axis] < lower[axis] || start[axis] > upper[axis] )
+				return;
+			continue;
 		}
+		Real t0 = ( lower[axis] - start[axis] ) / dir[axis];
+		Real t1 = ( upper[axis] - start[axis] ) / dir[axis];
+		if ( t0 > t1 )
+			std::swap( t0, t1 );
+		tEnter = MAX( tEnter, t0 );
+		tExit = MIN( tExit, t1 );
 	}
+	if ( tEnter > tExit )
+		return;
 
-	for ( i = 0; i < mNumberOfWorkers; i++ ) {
-		pthread_join( mWorkerThreads[i], NULL );
+	Vector2D p0 = line.mStart + d * tEnter, p1 = line.mStart + d * tExit;
+	int x = MIN( MAX( (int)floor( ( p0.x - origin.x ) / cellSize ), 0 ), cellsX-1 );
+	int y = MIN( MAX( (int)floor( ( p0.y - origin.y ) / cellSize ), 0 ), cellsY-1 );
+	int xEnd = MIN( MAX( (int)floor( ( p1.x - origin.x ) / cellSize ), 0 ), cellsX-1 );
+	int yEnd = MIN( MAX( (int)floor( ( p1.y - origin.y ) / cellSize ), 0 ), cellsY-1 );
+
+	int stepX = ( xEnd > x ? 1 : ( xEnd < x ? -1 : 0 ) );
+	int stepY = ( yEnd > y ? 1 : ( yEnd < y ? -1 : 0 ) );
+	Real tMaxX = ( stepX != 0 ? ( origin.x + ( x + ( stepX > 0 ) ) * cellSize - line.mStart.x ) / d.x : DBL_MAX );
+	Real tMaxY = ( stepY != 0 ? ( origin.y + ( y + ( stepY > 0 ) ) * cellSize - line.mStart.y ) / d.y : DBL_MAX );
+	Real tDeltaX = ( stepX != 0 ? cellSize / fabs( d.x ) : DBL_MAX );
+	Real tDeltaY = ( stepY != 0 ? cellSize / fabs( d.y ) : DBL_MAX );
+
+	// a 4-connected walk from the first cell to the last takes exactly this many steps.
+	int steps = abs( xEnd - x ) + abs( yEnd - y );
+	pCells->push_back( y*cellsX + x );
+	for ( int n = 0; n < steps; n++ ) {
+		if ( ( tMaxX < tMaxY && x != xEnd ) || y == yEnd ) {
+			x += stepX;
+			tMaxX += tDeltaX;
+		} else {
+			y += stepY;
+			tMaxY += tDeltaY;
+		}
+		pCells->push_back( y*cellsX + x );
 	}
 
-	delete[] mWorkerThreads;
+}
 
-	mExecuted = true;
+
+
+/*
+ * Method: Real ComputeRayPower( const RayPathComponent&, VectorMath::Real distance );
+ * Description: The power a component delivers to a receiver the given distance along it.
+ */
+Real Raytracer::ComputeRayPower( const RayPathComponent &component, Real distance ) {
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	double phi = ( 2 * ( distance + component.mDistanceSum ) / pUrcData->GetWavelength() + component.mReflectionCount ) * 2 * M_PI;
+	return component.mWeight * component.mReflectionCoefficient * component.mReflectionCoefficient * ( 0.5 + sin( phi ) / M_PI );
 
 }
 
@@ -319,14 +985,19 @@ void Raytracer::Execute() {
 Raytracer::TraceReport Raytracer::ComputeK( VectorMath::Vector2D rx, VectorMath::Real gain ) {
 
 	UrcData *pUrcData = UrcData::GetSingleton();
-	RayPathComponentSet::iterator componentIt;
 	Real r = sqrt(gain) * pUrcData->GetWavelength() / (2 * M_PI);
 	unsigned int minRefl=UINT_MAX;
 
 	vector< InterceptedRay > interceptedRays;
 
-	for ( AllInVector( componentIt, mRaySeq ) ) {
+	// only the components that pass near the receiver need testing.
+	std::vector<unsigned int> nearby;
+	std::vector<unsigned int>::iterator nearbyIt;
+	FindNearbySegments( rx, r, &nearby );
+
+	for ( AllInVector( nearbyIt, nearby ) ) {
 
+		RayPathComponentSet::iterator componentIt = mRaySeq.begin() + *nearbyIt;
 		Real d = componentIt->mLineSegment.DistanceAlongLine( rx );
 		if ( componentIt->mLineSegment.DistanceFromLine( rx ) < r && d > 0 && d < componentIt->mLineSegment.GetDistance() ) {
 
@@ -349,6 +1020,7 @@ Raytracer::TraceReport Raytracer::ComputeK( VectorMath::Vector2D rx, VectorMath:
 
 	t.mTransmitterPosition = mPositionTX;
 	t.mReceiverPosition = rx;
+	t.mFactorKErrorDB = DBL_MAX;
 
 	if ( interceptedRays.size() == 0 )
 		return t;	// if we got no intercepted rays
@@ -361,8 +1033,7 @@ Raytracer::TraceReport Raytracer::ComputeK( VectorMath::Vector2D rx, VectorMath:
 	t.mDiffuseRayCount = 0;
 	for ( AllInVector( interceptIt, interceptedRays ) ) {
 
-		double phi = ( 2 * ( interceptIt->mDistance + interceptIt->m_pComponent->mDistanceSum ) / pUrcData->GetWavelength() + interceptIt->m_pComponent->mReflectionCount ) * 2 * M_PI;
-		double p = interceptIt->m_pComponent->mReflectionCoefficient * interceptIt->m_pComponent->mReflectionCoefficient * ( 0.5 + sin( phi ) / M_PI );
+		double p = ComputeRayPower( *interceptIt->m_pComponent, interceptIt->mDistance );
 		if ( interceptIt->m_pComponent->mReflectionCount == minRefl ) {
 			t.mSpecularPower += p;
 			t.mSpecularRayCount++;
@@ -403,9 +1074,369 @@ Raytracer::TraceReport Raytracer::ComputeK( VectorMath::Vector2D rx, VectorMath:
 
 
 
+/*
+ * Method: void ComputeKBatch( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real gain, std::vector<TraceReport> *pReports );
+ * Description: Computes the K factor for every receiver at once. The receivers are put in a grid, and each
+ * 				component of the trace is walked through it once. The K factors, powers and ray counts match
+ * 				ComputeK, but the per-ray powers and their statistics are not filled in.
+ */
+void Raytracer::ComputeKBatch( const std::vector<Vector2D> &receivers, Real gain, std::vector<TraceReport> *pReports ) {
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	Real r = sqrt(gain) * pUrcData->GetWavelength() / (2 * M_PI);
+	unsigned int i;
+
+	std::vector<ReceiverTally> tallies( receivers.size() );
+	for ( i = 0; i < tallies.size(); i++ )
+		InitTally( &tallies[i] );
+
+	if ( !receivers.empty() && !mRaySeq.empty() ) {
+
+		ReceiverGrid grid;
+		BinReceivers( receivers, r, &grid );
 
+		// Now stream through the trace once. The components go by in trace order, so each receiver
+		// adds up its powers in the same order ComputeK would.
+		std::vector<int> cells;
+		std::vector<int>::iterator cellIt;
+		for ( unsigned int c = 0; c < mRaySeq.size(); c++ ) {
 
+			RayPathComponent &component = mRaySeq[c];
+			cells.clear();
+			WalkCells( component.mLineSegment, grid.mOrigin, grid.mCellSize, grid.mCellsX, grid.mCellsY, &cells );
 
+			for ( AllInVector( cellIt, cells ) ) {
+				for ( unsigned int e = grid.mCellStart[*cellIt]; e < grid.mCellStart[*cellIt+1]; e++ ) {
+
+					ReceiverTally &tally = tallies[ grid.mCellEntries[e] ];
+					if ( tally.mLastComponent == c )
+						continue;
+					tally.mLastComponent = c;
+
+					Vector2D rx = receivers[ grid.mCellEntries[e] ];
+					Real d = component.mLineSegment.DistanceAlongLine( rx );
+					if ( !( component.mLineSegment.DistanceFromLine( rx ) < r && d > 0 && d < component.mLineSegment.GetDistance() ) )
+						continue;
+
+					AddPower( &tally, component.mRayIndex, component.mReflectionCount, ComputeRayPower( component, d ) );
+
+				}
+			}
+
+		}
+
+	}
+
+	MakeReports( &tallies, receivers, pReports );
+
+}
 
 
 
+/*
+ * Method: void SetReceivers( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real gain );
+ * Description: Switches the tracer to streaming mode, in which each component is tested against the given receivers
+ * 				as it is traced, and then thrown away. Must be called before the trace is started.
+ */
+void Raytracer::SetReceivers( const std::vector<Vector2D> &receivers, Real gain ) {
+
+	if ( mStarted )
+		THROW_EXCEPTION( "Receivers must be set before the trace is started." );
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	mReceiverRadius = sqrt(gain) * pUrcData->GetWavelength() / (2 * M_PI);
+	mReceivers = receivers;
+	mReceiverTallies.resize( receivers.size() );
+	for ( unsigned int i = 0; i < mReceiverTallies.size(); i++ )
+		InitTally( &mReceiverTallies[i] );
+	if ( !receivers.empty() )
+		BinReceivers( receivers, mReceiverRadius, &mReceiverGrid );
+
+	delete[] mWorkerStreams;
+	mWorkerStreams = new WorkerStream[mNumberOfWorkers];
+	for ( unsigned int w = 0; w < mNumberOfWorkers; w++ ) {
+		mWorkerStreams[w].mStamps.assign( receivers.size(), 0 );
+		mWorkerStreams[w].mComponentCount = 0;
+		RayPathComponentSet().swap( mWorkerSegments[w] );
+	}
+	mStreaming = true;
+
+}
+
+
+
+/*
+ * Method: void GetReceiverReports( std::vector<TraceReport> *pReports );
+ * Description: In streaming mode, the K factors of the receivers given to SetReceivers, from every round traced
+ * 				so far. They match what ComputeKBatch gives for the same receivers on a stored trace.
+ */
+void Raytracer::GetReceiverReports( std::vector<TraceReport> *pReports ) {
+
+	if ( !mStreaming )
+		THROW_EXCEPTION( "Receiver reports are only gathered in streaming mode." );
+	Wait();
+
+	std::vector<ReceiverTally> tallies( mReceiverTallies );
+	MakeReports( &tallies, mReceivers, pReports );
+
+}
+
+
+
+/*
+ * Method: void StoreComponent( RayPathComponent component, unsigned int worker );
+ * Description: Keeps a traced component for merging, or in streaming mode, records the power it delivers
+ * 				to each receiver it passes and drops it.
+ */
+void Raytracer::StoreComponent( RayPathComponent component, unsigned int worker ) {
+
+	mWorkerContexts[worker].mSegmentCount++;
+	if ( mHaveBounds )
+		ClipToBounds( &component.mLineSegment );
+
+	if ( !mStreaming ) {
+		mWorkerSegments[worker].push_back( component );
+		return;
+	}
+	if ( mReceivers.empty() )
+		return;
+
+	WorkerStream &stream = mWorkerStreams[worker];
+	unsigned int stamp = ++stream.mComponentCount;
+	LineSegment line = component.mLineSegment;
+	stream.mCells.clear();
+	WalkCells( line, mReceiverGrid.mOrigin, mReceiverGrid.mCellSize, mReceiverGrid.mCellsX, mReceiverGrid.mCellsY, &stream.mCells );
+
+	std::vector<int>::iterator cellIt;
+	for ( AllInVector( cellIt, stream.mCells ) ) {
+		for ( unsigned int e = mReceiverGrid.mCellStart[*cellIt]; e < mReceiverGrid.mCellStart[*cellIt+1]; e++ ) {
+
+			unsigned int receiver = mReceiverGrid.mCellEntries[e];
+			if ( stream.mStamps[receiver] == stamp )
+				continue;
+			stream.mStamps[receiver] = stamp;
+
+			Vector2D rx = mReceivers[receiver];
+			Real d = line.DistanceAlongLine( rx );
+			if ( !( line.DistanceFromLine( rx ) < mReceiverRadius && d > 0 && d < line.GetDistance() ) )
+				continue;
+
+			Intercept intercept;
+			intercept.mReceiver = receiver;
+			intercept.mRayIndex = component.mRayIndex;
+			intercept.mReflectionCount = component.mReflectionCount;
+			intercept.mPower = ComputeRayPower( component, d );
+			stream.mIntercepts.push_back( intercept );
+
+		}
+	}
+
+}
+
+
+
+/*
+ * Method: void MergeIntercepts();
+ * Description: Adds the workers' intercepts for the latest round into the receiver tallies, in trace order,
+ * 				so the sums come out the same whatever the number of workers.
+ */
+void Raytracer::MergeIntercepts() {
+
+	std::vector<Intercept> intercepts;
+	unsigned int w;
+	for ( w = 0; w < mNumberOfWorkers; w++ ) {
+		intercepts.insert( intercepts.end(), mWorkerStreams[w].mIntercepts.begin(), mWorkerStreams[w].mIntercepts.end() );
+		std::vector<Intercept>().swap( mWorkerStreams[w].mIntercepts );
+	}
+	std::sort( intercepts.begin(), intercepts.end() );
+
+	std::vector<Intercept>::iterator interceptIt;
+	for ( AllInVector( interceptIt, intercepts ) )
+		AddPower( &mReceiverTallies[ interceptIt->mReceiver ], interceptIt->mRayIndex, interceptIt->mReflectionCount, interceptIt->mPower );
+
+}
+
+
+
+/*
+ * Method: void BinReceivers( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real radius, ReceiverGrid *pGrid ) const;
+ * Description: Puts each receiver in every cell its disc of the given radius touches, so any component
+ * 				passing within that radius of it crosses one of its cells.
+ */
+void Raytracer::BinReceivers( const std::vector<Vector2D> &receivers, Real r, ReceiverGrid *pGrid ) const {
+
+	UrcData *pUrcData = UrcData::GetSingleton();
+	unsigned int i;
+
+	Vector2D lower( DBL_MAX, DBL_MAX ), upper( -DBL_MAX, -DBL_MAX );
+	for ( i = 0; i < receivers.size(); i++ ) {
+		lower.x = std::min( lower.x, receivers[i].x - r );
+		lower.y = std::min( lower.y, receivers[i].y - r );
+		upper.x = std::max( upper.x, receivers[i].x + r );
+		upper.y = std::max( upper.y, receivers[i].y + r );
+	}
+
+	Vector2D size = upper - lower;
+	Real cellSize = sqrt( MAX( size.x, 1.0 ) * MAX( size.y, 1.0 ) / receivers.size() );
+	cellSize = MAX( cellSize, pUrcData->GetLaneWidth() );
+	cellSize = MAX( cellSize, MAX( size.x, size.y ) / RAYTRACER_MAX_SEGMENT_CELLS );
+	int cellsX = (int)floor( size.x / cellSize ) + 1;
+	int cellsY = (int)floor( size.y / cellSize ) + 1;
+
+	pGrid->mOrigin = lower;
+	pGrid->mCellSize = cellSize;
+	pGrid->mCellsX = cellsX;
+	pGrid->mCellsY = cellsY;
+	pGrid->mCellStart.assign( 1, 0 );
+	pGrid->mCellEntries.clear();
+
+	std::vector<unsigned int> counts( cellsX * cellsY, 0 );
+	for ( int pass = 0; pass < 2; pass++ ) {
+
+		for ( i = 0; i < receivers.size(); i++ ) {
+			int x0 = (int)floor( ( receivers[i].x - r - lower.x ) / cellSize );
+			int y0 = (int)floor( ( receivers[i].y - r - lower.y ) / cellSize );
+			int x1 = MIN( (int)floor( ( receivers[i].x + r - lower.x ) / cellSize ), cellsX-1 );
+			int y1 = MIN( (int)floor( ( receivers[i].y + r - lower.y ) / cellSize ), cellsY-1 );
+			for ( int y = y0; y <= y1; y++ ) {
+				for ( int x = x0; x <= x1; x++ ) {
+					if ( pass == 0 )
+						counts[ y*cellsX + x ]++;
+					else
+						pGrid->mCellEntries[ counts[ y*cellsX + x ]++ ] = i;
+				}
+			}
+		}
+
+		if ( pass == 0 ) {
+			for ( unsigned int c = 0; c < counts.size(); c++ )
+				pGrid->mCellStart.push_back( pGrid->mCellStart.back() + counts[c] );
+			pGrid->mCellEntries.resize( pGrid->mCellStart.back() );
+			std::copy( pGrid->mCellStart.begin(), pGrid->mCellStart.end()-1, counts.begin() );
+		}
+
+	}
+
+}
+
+
+
+/*
+ * Method: static void InitTally( ReceiverTally *pTally );
+ * Description: Clears a receiver's tally before any components have been counted.
+ */
+void Raytracer::InitTally( ReceiverTally *pTally ) {
+
+	pTally->mSpecularPower = pTally->mDiffusePower = 0;
+	pTally->mSpecularRayCount = pTally->mDiffuseRayCount = 0;
+	pTally->mMinReflections = UINT_MAX;
+	pTally->mLastComponent = UINT_MAX;
+	pTally->mRound = 0;
+	pTally->mRoundSpecularPower = pTally->mRoundDiffusePower = 0;
+	pTally->mSumSpecularSq = pTally->mSumSpecularDiffuse = pTally->mSumDiffuseSq = 0;
+
+}
+
+
+
+/*
+ * Method: void AddPower( ReceiverTally *pTally, unsigned int rayIndex, unsigned int reflectionCount, VectorMath::Real power );
+ * Description: Counts the power delivered to a receiver by one component of the given ray.
+ */
+void Raytracer::AddPower( ReceiverTally *pTally, unsigned int rayIndex, unsigned int reflectionCount, Real p ) {
+
+	// Only the direct components count as specular in the end, since with no direct
+	// component at all the receiver is taken as Rayleigh.
+	unsigned int round = rayIndex / mRayCount;
+	if ( round != pTally->mRound ) {
+		FoldRound( pTally );
+		pTally->mRound = round;
+	}
+	if ( reflectionCount == 0 ) {
+		pTally->mSpecularPower += p;
+		pTally->mSpecularRayCount++;
+		pTally->mRoundSpecularPower += p;
+	} else {
+		pTally->mDiffusePower += p;
+		pTally->mDiffuseRayCount++;
+		pTally->mRoundDiffusePower += p;
+	}
+	pTally->mMinReflections = MIN( pTally->mMinReflections, reflectionCount );
+
+}
+
+
+
+/*
+ * Method: void MakeReports( std::vector<ReceiverTally> *pTallies, const std::vector<VectorMath::Vector2D> &receivers, std::vector<TraceReport> *pReports );
+ * Description: Turns the receivers' tallies into reports, the same way ComputeK finishes off. The tallies are used up.
+ */
+void Raytracer::MakeReports( std::vector<ReceiverTally> *pTallies, const std::vector<Vector2D> &receivers, std::vector<TraceReport> *pReports ) {
+
+	pReports->resize( receivers.size() );
+	for ( unsigned int i = 0; i < receivers.size(); i++ ) {
+
+		ReceiverTally &tally = (*pTallies)[i];
+		TraceReport &t = (*pReports)[i];
+		t.mSpecularPower = t.mDiffusePower = 0;
+		t.mFactorK = -1;
+		t.mSpecularRayCount = t.mDiffuseRayCount = 0;
+		t.mTransmitterPosition = mPositionTX;
+		t.mReceiverPosition = receivers[i];
+		t.mRayPowerMean = t.mRayPowerVariance = t.mRayPowerMedian = 0;
+		t.mRayPowers.clear();
+		t.mFactorKErrorDB = DBL_MAX;
+
+		// A K of 0 or infinity has no spread between rounds to go by, so it only counts as settled once enough
+		// rays have come by. Until then the kind of ray it's missing may just not have turned up yet.
+		unsigned int intercepted = tally.mSpecularRayCount + tally.mDiffuseRayCount;
+		if ( mRoundCount > 1 && intercepted >= RAYTRACER_SETTLED_HITS )
+			t.mFactorKErrorDB = 0;
+		if ( intercepted == 0 )
+			continue;	// if we got no intercepted rays
+
+		t.mFactorK = 0;
+		t.mDiffuseRayCount = intercepted;
+		if ( tally.mMinReflections > 0 )
+			continue;	// got no LOS rays, so assume rayleigh
+
+		t.mSpecularPower = tally.mSpecularPower;
+		t.mDiffusePower = tally.mDiffusePower;
+		t.mSpecularRayCount = tally.mSpecularRayCount;
+		t.mDiffuseRayCount = tally.mDiffuseRayCount;
+
+		if ( t.mDiffusePower == 0 )
+			t.mFactorK = DBL_MAX;	// best stand-in for infinity I can think of.
+		else
+			t.mFactorK = t.mSpecularPower / t.mDiffusePower;
+
+		// Standard error of the pooled ratio, from how much the rounds disagree:
+		// var(K) = sum_j ( s_j - K d_j )^2 / ( n (n-1) dbar^2 ), where s_j and d_j are round j's powers.
+		if ( mRoundCount > 1 && t.mFactorK != DBL_MAX && t.mFactorK > 0 ) {
+			FoldRound( &tally );
+			Real n = mRoundCount;
+			Real K = t.mFactorK;
+			Real dMean = t.mDiffusePower / n;
+			Real spread = tally.mSumSpecularSq - 2 * K * tally.mSumSpecularDiffuse + K * K * tally.mSumDiffuseSq;
+			Real error = sqrt( MAX( spread, 0 ) / ( n * ( n - 1 ) ) ) / dMean;
+			t.mFactorKErrorDB = 10 / log( 10.0 ) * error / K;
+		}
+
+	}
+
+}
+
+
+
+/*
+ * Method: static void FoldRound( ReceiverTally *pTally );
+ * Description: Adds the powers a receiver got in its current round into the running sums of squares, and clears them.
+ */
+void Raytracer::FoldRound( ReceiverTally *pTally ) {
+
+	pTally->mSumSpecularSq += pTally->mRoundSpecularPower * pTally->mRoundSpecularPower;
+	pTally->mSumSpecularDiffuse += pTally->mRoundSpecularPower * pTally->mRoundDiffusePower;
+	pTally->mSumDiffuseSq += pTally->mRoundDiffusePower * pTally->mRoundDiffusePower;
+	pTally->mRoundSpecularPower = pTally->mRoundDiffusePower = 0;
+
+}
@@ -23,9 +23,11 @@
 #pragma once
 
 
-#include <queue>
+#include <deque>
 #include <pthread.h>
 
+#include "ThreadPool.h"
+
 namespace Urc {
 	
 	class UrcData;
@@ -50,6 +52,8 @@ namespace Urc {
 			VectorMath::Real mReflectionCoefficient;	// reflection coefficient
 			unsigned int mReflectionCount;				// number of reflections undergone by this ray
 			unsigned int mLastReflectorIndex;
+			unsigned int mRayIndex;						// index of the launched ray this component descends from
+			VectorMath::Real mWeight;					// power multiplier for rays kept by roulette (otherwise 1)
 		};
 
 		typedef std::vector<RayPathComponent> RayPathComponentSet;
@@ -66,6 +70,7 @@ namespace Urc {
 			VectorMath::Real mRayPowerVariance;
 			VectorMath::Real mRayPowerMedian;
 			std::vector<VectorMath::Real> mRayPowers;
+			VectorMath::Real mFactorKErrorDB;			// standard error of K in dB between rounds (ComputeKBatch only; DBL_MAX from ComputeK, with one round, or too few rays)
 		};
 		
 	protected:
@@ -76,44 +81,297 @@ namespace Urc {
 			RayPathComponent *m_pComponent;
 		};
 
+		// where a ray hit a building, and at what angle
+		struct RayHit {
+			VectorMath::Vector2D mPoint;
+			VectorMath::Vector2D mNormal;				// unit normal of the edge hit
+			VectorMath::Real mCosIncidence;				// cosine of the angle between the ray and the normal, in [0,1]
+			VectorMath::Real mPermitivity;
+			int mBuilding;
+		};
+
+		// what ComputeKBatch gathers for one receiver as the components stream past
+		struct ReceiverTally {
+			VectorMath::Real mSpecularPower;			// power of intercepted components that haven't reflected
+			VectorMath::Real mDiffusePower;				// power of intercepted components that have
+			unsigned int mSpecularRayCount;
+			unsigned int mDiffuseRayCount;
+			unsigned int mMinReflections;
+			unsigned int mLastComponent;				// last component tested against this receiver, so it's only counted once
+			unsigned int mRound;						// round of the powers below
+			VectorMath::Real mRoundSpecularPower;
+			VectorMath::Real mRoundDiffusePower;
+			VectorMath::Real mSumSpecularSq;			// sums over rounds, for the spread between them
+			VectorMath::Real mSumSpecularDiffuse;
+			VectorMath::Real mSumDiffuseSq;
+		};
+
+		// the power one component delivers to one receiver, recorded as the trace runs in streaming mode
+		struct Intercept {
+			unsigned int mReceiver;
+			unsigned int mRayIndex;
+			unsigned int mReflectionCount;
+			VectorMath::Real mPower;
+			bool operator<( const Intercept &rhs ) const {
+				if ( mRayIndex != rhs.mRayIndex )
+					return mRayIndex < rhs.mRayIndex;
+				if ( mReflectionCount != rhs.mReflectionCount )
+					return mReflectionCount < rhs.mReflectionCount;
+				return mReceiver < rhs.mReceiver;
+			}
+		};
+
+		// what each worker keeps while testing its components against the receivers in streaming mode
+		struct WorkerStream {
+			std::vector<Intercept> mIntercepts;			// this round's intercepts, merged in trace order by Wait()
+			std::vector<unsigned int> mStamps;			// last component tested against each receiver, so it's only counted once
+			unsigned int mComponentCount;
+			std::vector<int> mCells;
+		};
+
+		// uniform grid over the receivers. Each receiver is entered in every cell its disc touches.
+		struct ReceiverGrid {
+			std::vector<unsigned int> mCellStart;		// offset of each cell's first entry in mCellEntries (one extra at the end)
+			std::vector<unsigned int> mCellEntries;		// receiver indices, grouped by cell
+			VectorMath::Vector2D mOrigin;
+			VectorMath::Real mCellSize;
+			int mCellsX;
+			int mCellsY;
+		};
+
+		// rays waiting to be traced by one worker. Other workers steal from the front when they run dry.
+		struct WorkerQueue {
+			std::deque<RayPathComponent> mRays;
+			pthread_mutex_t mMutex;
+		};
+
+		// handed to each worker thread so it knows which queue is its own
+		struct WorkerContext {
+			Raytracer *m_pRaytracer;
+			unsigned int mIndex;
+			unsigned long mSegmentCount;				// components this worker has generated
+			std::vector<bool> mTouched;					// buildings this worker's rays have hit, if they're being recorded
+			bool mEscaped;								// one of this worker's rays hit nothing
+		};
+
 		RayPathComponentSet mRaySeq;					// set of rays generated by the transmitter
 
-		unsigned int mRayCount;							// number of rays to be generated
+		unsigned int mRayCount;							// number of rays to be generated in each round
+		unsigned int mRoundCount;						// rounds started so far
+		unsigned int mFirstRay;							// index of the first ray of the latest round
 		VectorMath::Real mStartAngle;					// vector angle to start generating rays from
+		unsigned int mSeed;								// seed the start angle was drawn from
 		VectorMath::Real mCarPermitivity;				// LPF of car material
 
 		VectorMath::Real mRayLength;
 
+		bool mStarted;									// the trace has been started
 		bool mExecuted; 								// the trace has been executed
 
 		VectorMath::Vector2D mPositionTX;
 
-		std::queue<RayPathComponent> mRayQueue;
-
-		UrcData::Bucket mBucket;
+		const EdgeGrid *mEdgeGrid;						// building edges, shared with every other tracer
 
-		pthread_t *mWorkerThreads;
+		ThreadPool *m_pPool;							// pool the workers run on
+		ThreadPool *mOwnPool;							// set if we had to make the pool ourselves
+		ThreadPool::TaskGroup mTraceGroup;
 		unsigned int mNumberOfWorkers;
-		pthread_mutex_t mRayQueueMutex;
-		pthread_mutex_t mRaySetMutex;
+		WorkerQueue *mWorkerQueues;						// one queue of pending rays per worker
+		WorkerContext *mWorkerContexts;
+		volatile long mOutstandingRays;					// rays queued or being traced; the trace is done when this hits zero
+		volatile long mNextPacket;						// next packet of launched rays to be claimed by a worker
+		long mPacketCount;
+		RayPathComponentSet *mWorkerSegments;			// components traced by each worker, merged into mRaySeq at the end
+
+		// uniform grid over the finished trace, so ComputeK only looks at the components near a receiver
+		std::vector<unsigned int> mSegmentCellStart;	// offset of each cell's first entry in mSegmentCellEntries (one extra at the end)
+		std::vector<unsigned int> mSegmentCellEntries;	// indices into mRaySeq, grouped by cell
+		VectorMath::Vector2D mSegmentOrigin;			// lower corner of the grid
+		VectorMath::Real mSegmentCellSize;
+		int mSegmentCellsX;
+		int mSegmentCellsY;
+
+		// streaming mode: the receivers are known before the trace, and components are dropped once counted
+		bool mStreaming;
+		std::vector<VectorMath::Vector2D> mReceivers;
+		VectorMath::Real mReceiverRadius;
+		ReceiverGrid mReceiverGrid;
+		std::vector<ReceiverTally> mReceiverTallies;	// merged tallies of every round so far
+		WorkerStream *mWorkerStreams;
+
+		// termination criteria, on top of the ray running out of range
+		VectorMath::Rect mBounds;
+		bool mHaveBounds;
+		unsigned int mMaxReflections;
+		VectorMath::Real mPowerFloor;					// relative to the direct ray; 0 for none
+		bool mRoulette;
+
+		bool mRecordTouched;							// keep track of the buildings the rays hit
+
+		/*
+		 * Method: void TraceRay( RayPathComponent, unsigned int );
+		 * Description: This traces a ray through the road network. Any reflected ray goes onto the given worker's queue.
+		 */
+		void TraceRay( RayPathComponent, unsigned int );
+
+		/*
+		 * Method: void TracePacket( long, unsigned int );
+		 * Description: Traces one packet of neighbouring launched rays together, queueing the reflections on the given worker.
+		 */
+		void TracePacket( long, unsigned int );
+
+		/*
+		 * Method: void ReflectRay( RayPathComponent, const RayHit*, unsigned int );
+		 * Description: Stores the traced component, and queues the reflected ray if there was a hit and it has range left.
+		 * 				A NULL hit means the ray didn't hit anything.
+		 */
+		void ReflectRay( RayPathComponent, const RayHit*, unsigned int );
+
+		/*
+		 * Method: RayPathComponent MakeLaunchedRay( unsigned int );
+		 * Description: Builds the first component of the given launched ray.
+		 */
+		RayPathComponent MakeLaunchedRay( unsigned int );
+
+		/*
+		 * Method: static Real RoundOffset( unsigned int round );
+		 * Description: Fraction of the angle between rays that the given round is turned by. This is the base 2
+		 * 				radical inverse (0, 1/2, 1/4, 3/4, ...), so any 2^n rounds together make an even fan.
+		 */
+		static VectorMath::Real RoundOffset( unsigned int );
+
+		/*
+		 * Method: void StartRound();
+		 * Description: Sets up the next round of launched rays and hands it to the workers.
+		 */
+		void StartRound();
+
+		/*
+		 * Method: static void FoldRound( ReceiverTally *pTally );
+		 * Description: Adds the powers a receiver got in its current round into the running sums of squares, and clears them.
+		 */
+		static void FoldRound( ReceiverTally * );
+
+		/*
+		 * Method: void PushRay( RayPathComponent, unsigned int );
+		 * Description: Queue a ray on the given worker's queue.
+		 */
+		void PushRay( RayPathComponent, unsigned int );
+
+		/*
+		 * Method: bool PopRay( RayPathComponent*, unsigned int );
+		 * Description: Take a ray from the given worker's own queue, or steal one from another worker. Returns false if there were none.
+		 */
+		bool PopRay( RayPathComponent*, unsigned int );
 
 		/*
-		 * Method: void TraceRay( RayPathComponent );
-		 * Description: This traces a ray through the road network.
+		 * Method: bool CheckIntersection( RayPathComponent, RayHit* );
+		 * Description: Finds where the ray first hits a building. Returns false if it hits nothing.
 		 */
-		void TraceRay( RayPathComponent );
+		bool CheckIntersection( RayPathComponent, RayHit* );
 
 		/*
-		 * Method: bool CheckIntersection( RayPathComponent, VectorMath::Vector2D*, Real*, VectorMath::LineSegment*, int *, int );
-		 * Description: This traces a ray through the road network.
+		 * Method: void FillHit( RayPathComponent, const EdgeGrid::Hit&, RayHit* );
+		 * Description: Works out the building and incidence angle for a hit found in the edge grid.
 		 */
-		bool CheckIntersection( RayPathComponent, VectorMath::Vector2D*, VectorMath::Real*, VectorMath::LineSegment*, int *, int* );
+		void FillHit( RayPathComponent, const EdgeGrid::Hit&, RayHit* );
 
 		/*
-		 * Method: static void *WorkerThread(void *pRT);
-		 * Description: Traces the rays through the network. Multiple worker threads can work in parallel.
+		 * Method: void MergeSegments();
+		 * Description: Gathers the workers' components into mRaySeq, ordered by launched ray and then by reflection,
+		 * 				so the trace comes out the same whatever the number of workers.
 		 */
-		static void *WorkerThread(void *pRT);
+		void MergeSegments();
+
+		/*
+		 * Method: void IndexSegments();
+		 * Description: Builds the grid over mRaySeq used by ComputeK. Each component is entered in every cell it passes through.
+		 */
+		void IndexSegments();
+
+		/*
+		 * Method: void FindNearbySegments( VectorMath::Vector2D, VectorMath::Real, std::vector<unsigned int>* ) const;
+		 * Description: Gets the indices (in mRaySeq order, without repeats) of the components that could pass within
+		 * 				the given distance of the point.
+		 */
+		void FindNearbySegments( VectorMath::Vector2D, VectorMath::Real, std::vector<unsigned int>* ) const;
+
+		/*
+		 * Method: static void WalkCells( VectorMath::LineSegment, VectorMath::Vector2D, VectorMath::Real, int, int, std::vector<int>* );
+		 * Description: Appends the index of every cell of the given grid (origin, cell size, cells across and down)
+		 * 				that the line passes through, in order along the line. The parts outside the grid are skipped.
+		 */
+		static void WalkCells( VectorMath::LineSegment, VectorMath::Vector2D, VectorMath::Real, int, int, std::vector<int>* );
+
+		/*
+		 * Method: Real ComputeRayPower( const RayPathComponent&, VectorMath::Real distance );
+		 * Description: The power a component delivers to a receiver the given distance along it.
+		 */
+		VectorMath::Real ComputeRayPower( const RayPathComponent&, VectorMath::Real );
+
+		/*
+		 * Method: void StoreComponent( RayPathComponent component, unsigned int worker );
+		 * Description: Keeps a traced component for merging, or in streaming mode, records the power it delivers
+		 * 				to each receiver it passes and drops it.
+		 */
+		void StoreComponent( RayPathComponent, unsigned int );
+
+		/*
+		 * Method: static unsigned long long MixWord( unsigned long long hash, unsigned long long word );
+		 * Description: Folds a word into a hash with the splitmix64 finaliser.
+		 */
+		static unsigned long long MixWord( unsigned long long, unsigned long long );
+
+		/*
+		 * Method: bool Survives( RayPathComponent *pRay ) const;
+		 * Description: Applies the termination criteria to a reflected ray about to be queued. The roulette draw is
+		 * 				hashed from the seed, ray and reflection, so it comes out the same on every run.
+		 */
+		bool Survives( RayPathComponent * ) const;
+
+		/*
+		 * Method: void ClipToBounds( VectorMath::LineSegment *pLine ) const;
+		 * Description: Cuts the end of the line off where it leaves the bounds. Lines starting outside are left alone.
+		 */
+		void ClipToBounds( VectorMath::LineSegment * ) const;
+
+		/*
+		 * Method: void MergeIntercepts();
+		 * Description: Adds the workers' intercepts for the latest round into the receiver tallies, in trace order,
+		 * 				so the sums come out the same whatever the number of workers.
+		 */
+		void MergeIntercepts();
+
+		/*
+		 * Method: void BinReceivers( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real radius, ReceiverGrid *pGrid ) const;
+		 * Description: Puts each receiver in every cell its disc of the given radius touches, so any component
+		 * 				passing within that radius of it crosses one of its cells.
+		 */
+		void BinReceivers( const std::vector<VectorMath::Vector2D>&, VectorMath::Real, ReceiverGrid* ) const;
+
+		/*
+		 * Method: static void InitTally( ReceiverTally *pTally );
+		 * Description: Clears a receiver's tally before any components have been counted.
+		 */
+		static void InitTally( ReceiverTally* );
+
+		/*
+		 * Method: void AddPower( ReceiverTally *pTally, unsigned int rayIndex, unsigned int reflectionCount, VectorMath::Real power );
+		 * Description: Counts the power delivered to a receiver by one component of the given ray.
+		 */
+		void AddPower( ReceiverTally*, unsigned int, unsigned int, VectorMath::Real );
+
+		/*
+		 * Method: void MakeReports( std::vector<ReceiverTally> *pTallies, const std::vector<VectorMath::Vector2D> &receivers, std::vector<TraceReport> *pReports );
+		 * Description: Turns the receivers' tallies into reports, the same way ComputeK finishes off. The tallies are used up.
+		 */
+		void MakeReports( std::vector<ReceiverTally>*, const std::vector<VectorMath::Vector2D>&, std::vector<TraceReport>* );
+
+		/*
+		 * Method: static void WorkerTask(void *pContext);
+		 * Description: Traces the rays through the network. Multiple workers can run in parallel.
+		 */
+		static void WorkerTask(void *pContext);
 
 		
 	public:
@@ -123,12 +381,71 @@ namespace Urc {
 		 * 		1. Transmitter Position - location of the transmitter in the network
 		 * 		2. Ray Count - number of rays to simulate
 		 * 		3. Number of Workers - Specify the number of worker threads
+		 * 		4. Thread Pool - pool to run the workers on. If NULL, the tracer makes its own when it needs more than one worker.
 		 */
-		Raytracer( VectorMath::Vector2D, unsigned int, unsigned int = 1 );
+		Raytracer( VectorMath::Vector2D, unsigned int, unsigned int = 1, ThreadPool * = NULL );
 		virtual ~Raytracer();
 
 		VectorMath::Vector2D GetTransmitterPosition() { return mPositionTX; }
 
+		/*
+		 * Method: void SetSeed( unsigned int seed );
+		 * Description: Sets the seed the start angle of the fan is drawn from. Must be called before the trace is started.
+		 * 				By default the seed is MakeSeed( transmitter position, 0 ), so a tracer's results depend only on its
+		 * 				position, never on how many tracers came before it or on the number of workers.
+		 */
+		void SetSeed( unsigned int );
+
+		unsigned int GetSeed() const { return mSeed; }
+
+		/*
+		 * Method: static unsigned int MakeSeed( VectorMath::Vector2D position, unsigned int base );
+		 * Description: Mixes a base seed with the bits of a transmitter position, so each position gets its own
+		 * 				seed that doesn't depend on which tracers were made before it.
+		 */
+		static unsigned int MakeSeed( VectorMath::Vector2D, unsigned int );
+
+		/*
+		 * Method: void SetBounds( VectorMath::Rect bounds );
+		 * Description: Rays that reflect outside the bounds are stopped, and the traced components are cut off where
+		 * 				they leave them. Use this when nothing outside the bounds can send a ray back in.
+		 */
+		void SetBounds( VectorMath::Rect );
+
+		/*
+		 * Method: void SetMaxReflections( unsigned int maxReflections );
+		 * Description: Rays are stopped once they have reflected this many times.
+		 */
+		void SetMaxReflections( unsigned int );
+
+		/*
+		 * Method: void SetPowerFloor( VectorMath::Real floor, bool roulette );
+		 * Description: Rays whose power has dropped below floor, relative to the direct ray, are stopped. With roulette,
+		 * 				they are instead kept at random with probability power/floor, and those kept carry their power
+		 * 				up to the floor, so the expected power is unchanged.
+		 */
+		void SetPowerFloor( VectorMath::Real, bool );
+
+		/*
+		 * Method: void RecordTouchedBuildings();
+		 * Description: Keep track of which buildings the rays hit, and whether any ray hit nothing. Every ray
+		 * 				lies between the transmitter and the buildings it hit, unless it escaped, so this bounds
+		 * 				where a change to the buildings could make a difference to the trace.
+		 */
+		void RecordTouchedBuildings();
+
+		/*
+		 * Method: void GetTouchedBuildings( std::vector<int> *pBuildings ) const;
+		 * Description: Gets the buildings (ascending) hit by any ray so far.
+		 */
+		void GetTouchedBuildings( std::vector<int> * ) const;
+
+		/*
+		 * Method: bool HasEscapedRays() const;
+		 * Description: Whether any ray so far has hit nothing, and run out of range in the open.
+		 */
+		bool HasEscapedRays() const;
+
 		void SetRayLength( VectorMath::Real l ) { mRayLength = l; }
 
 		/*
@@ -138,22 +455,82 @@ namespace Urc {
 		const RayPathComponentSet *GetRaySet() const;
 
 		/*
-		 * Method: bool RunTrace();
-		 * Description: Run the trace in the worker thread.
+		 * Method: bool RunTrace( unsigned int worker );
+		 * Description: Trace one packet of launched rays, or one reflected ray, in the given worker thread.
+		 * 				Returns true once there is no work left anywhere.
 		 */
-		bool RunTrace();
+		bool RunTrace( unsigned int );
 
 		/*
 		 * Method: void Execute();
-		 * Description: Run the trace.
+		 * Description: Run the trace, and wait for it to finish.
 		 */
 		void Execute();
 
+		/*
+		 * Method: void ExecuteAsync();
+		 * Description: Start the trace on the thread pool and return straight away. Call Wait() before using the results.
+		 */
+		void ExecuteAsync();
+
+		/*
+		 * Method: void ExecuteRound();
+		 * Description: Trace another round of rays, turned to fall between the earlier ones, and add them to the trace.
+		 */
+		void ExecuteRound();
+
+		/*
+		 * Method: void ExecuteRoundAsync();
+		 * Description: As ExecuteRound, but returns straight away. Call Wait() before using the results.
+		 */
+		void ExecuteRoundAsync();
+
+		/*
+		 * Method: unsigned int GetLaunchedRayCount();
+		 * Description: Number of rays launched over all rounds so far.
+		 */
+		unsigned int GetLaunchedRayCount() const { return mRoundCount * mRayCount; }
+
+		/*
+		 * Method: unsigned long GetSegmentCount() const;
+		 * Description: Number of ray path components generated over all rounds so far (before any are culled).
+		 */
+		unsigned long GetSegmentCount() const;
+
+		/*
+		 * Method: void Wait();
+		 * Description: Wait for a trace started with ExecuteAsync() to finish.
+		 */
+		void Wait();
+
 		/*
 		 * Method: TraceReport ComputeK( VectorMath::Vector2D receiverPosition, VectorMath::Real gain );
 		 * Description: This computes the K factor for the receiver given its position, and gain.
 		 */
 		TraceReport ComputeK( VectorMath::Vector2D, VectorMath::Real );
+
+		/*
+		 * Method: void ComputeKBatch( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real gain, std::vector<TraceReport> *pReports );
+		 * Description: Computes the K factor for every receiver at once. The receivers are put in a grid, and each
+		 * 				component of the trace is walked through it once. The K factors, powers and ray counts match
+		 * 				ComputeK, but the per-ray powers and their statistics are not filled in.
+		 */
+		void ComputeKBatch( const std::vector<VectorMath::Vector2D>&, VectorMath::Real, std::vector<TraceReport>* );
+
+		/*
+		 * Method: void SetReceivers( const std::vector<VectorMath::Vector2D> &receivers, VectorMath::Real gain );
+		 * Description: Switches the tracer to streaming mode, in which each component is tested against the given receivers
+		 * 				as it is traced, and then thrown away. Must be called before the trace is started. The trace itself
+		 * 				is not kept, so GetRaySet, ComputeK and ComputeKBatch see an empty trace.
+		 */
+		void SetReceivers( const std::vector<VectorMath::Vector2D>&, VectorMath::Real );
+
+		/*
+		 * Method: void GetReceiverReports( std::vector<TraceReport> *pReports );
+		 * Description: In streaming mode, the K factors of the receivers given to SetReceivers, from every round traced
+		 * 				so far. They match what ComputeKBatch gives for the same receivers on a stored trace.
+		 */
+		void GetReceiverReports( std::vector<TraceReport>* );
 		
 	};
 
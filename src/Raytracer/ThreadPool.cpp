@@ -0,0 +1,144 @@
+/*
+ *  ThreadPool.cpp - Long-lived pool of worker threads for the Raytracer
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+#include "Singleton.h"
+#include "ThreadPool.h"
+
+using namespace Urc;
+
+
+
+/*
+ * Method: static void *WorkerThread( void *pPool );
+ * Description: Takes tasks off the queue and runs them until the pool is destroyed.
+ */
+void *ThreadPool::WorkerThread( void *pPool ) {
+
+	ThreadPool *pool = (ThreadPool*)pPool;
+	if ( !pool ) {
+		THROW_EXCEPTION( "Invalid pointer passed to pool thread!" );
+	}
+
+	pthread_mutex_lock( &pool->mMutex );
+	while ( 1 ) {
+
+		while ( pool->mTasks.empty() && !pool->mShutdown )
+			pthread_cond_wait( &pool->mTaskAvailable, &pool->mMutex );
+
+		if ( pool->mTasks.empty() )
+			break;	// shutting down, and nothing left to do
+
+		QueuedTask t = pool->mTasks.front();
+		pool->mTasks.pop_front();
+
+		pthread_mutex_unlock( &pool->mMutex );
+		t.mTask( t.m_pArgument );
+		pthread_mutex_lock( &pool->mMutex );
+
+		if ( --t.m_pGroup->mPending == 0 )
+			pthread_cond_broadcast( &pool->mTaskFinished );
+
+	}
+	pthread_mutex_unlock( &pool->mMutex );
+
+	return NULL;
+
+}
+
+
+
+/*
+ * Constructor arguments:
+ * 		1. Thread Count - number of threads to start
+ */
+ThreadPool::ThreadPool( unsigned int threadCount ) {
+
+	mThreadCount = ( threadCount > 0 ? threadCount : 1 );
+	mShutdown = false;
+	pthread_mutex_init( &mMutex, NULL );
+	pthread_cond_init( &mTaskAvailable, NULL );
+	pthread_cond_init( &mTaskFinished, NULL );
+
+	mThreads = new pthread_t[mThreadCount];
+	for ( unsigned int i = 0; i < mThreadCount; i++ ) {
+		if ( pthread_create( &mThreads[i], NULL, &ThreadPool::WorkerThread, this ) ) {
+			THROW_EXCEPTION( "Could not create threads for the thread pool." );
+		}
+	}
+
+}
+
+
+
+/*
+ * Destructor: runs any tasks still queued, then joins the threads.
+ */
+ThreadPool::~ThreadPool() {
+
+	pthread_mutex_lock( &mMutex );
+	mShutdown = true;
+	pthread_cond_broadcast( &mTaskAvailable );
+	pthread_mutex_unlock( &mMutex );
+
+	for ( unsigned int i = 0; i < mThreadCount; i++ )
+		pthread_join( mThreads[i], NULL );
+
+	delete[] mThreads;
+	pthread_cond_destroy( &mTaskFinished );
+	pthread_cond_destroy( &mTaskAvailable );
+	pthread_mutex_destroy( &mMutex );
+
+}
+
+
+
+/*
+ * Method: void Submit( Task task, void *pArgument, TaskGroup *pGroup );
+ * Description: Queue a task to be run on one of the pool's threads, as part of the given group.
+ */
+void ThreadPool::Submit( Task task, void *pArgument, TaskGroup *pGroup ) {
+
+	QueuedTask t;
+	t.mTask = task;
+	t.m_pArgument = pArgument;
+	t.m_pGroup = pGroup;
+
+	pthread_mutex_lock( &mMutex );
+	pGroup->mPending++;
+	mTasks.push_back( t );
+	pthread_cond_signal( &mTaskAvailable );
+	pthread_mutex_unlock( &mMutex );
+
+}
+
+
+
+/*
+ * Method: void Wait( TaskGroup *pGroup );
+ * Description: Block until every task in the group has finished.
+ */
+void ThreadPool::Wait( TaskGroup *pGroup ) {
+
+	pthread_mutex_lock( &mMutex );
+	while ( pGroup->mPending > 0 )
+		pthread_cond_wait( &mTaskFinished, &mMutex );
+	pthread_mutex_unlock( &mMutex );
+
+}
@@ -0,0 +1,104 @@
+/*
+ *  ThreadPool.h - Long-lived pool of worker threads for the Raytracer
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+
+
+#pragma once
+
+
+#include <deque>
+#include <pthread.h>
+
+namespace Urc {
+
+	/*
+	 * Name: ThreadPool
+	 * Inherits: None
+	 * Description: A fixed set of threads that run submitted tasks in order of submission.
+	 * 				The threads live as long as the pool, so many short jobs (such as one
+	 * 				trace per source position) don't each pay for creating threads.
+	 */
+	class ThreadPool {
+
+	public:
+
+		typedef void (*Task)( void * );
+
+		/*
+		 * Name: TaskGroup
+		 * Description: A set of submitted tasks that can be waited on together.
+		 */
+		struct TaskGroup {
+			unsigned int mPending;			// tasks submitted but not yet finished
+			TaskGroup() : mPending( 0 ) {  }
+		};
+
+	protected:
+
+		struct QueuedTask {
+			Task mTask;
+			void *m_pArgument;
+			TaskGroup *m_pGroup;
+		};
+
+		pthread_t *mThreads;
+		unsigned int mThreadCount;
+		std::deque<QueuedTask> mTasks;
+		pthread_mutex_t mMutex;
+		pthread_cond_t mTaskAvailable;		// signalled when a task is queued, or on shutdown
+		pthread_cond_t mTaskFinished;		// broadcast whenever a group's last task finishes
+		bool mShutdown;
+
+		/*
+		 * Method: static void *WorkerThread( void *pPool );
+		 * Description: Takes tasks off the queue and runs them until the pool is destroyed.
+		 */
+		static void *WorkerThread( void *pPool );
+
+	public:
+
+		/*
+		 * Constructor arguments:
+		 * 		1. Thread Count - number of threads to start
+		 */
+		ThreadPool( unsigned int );
+
+		/*
+		 * Destructor: runs any tasks still queued, then joins the threads.
+		 */
+		virtual ~ThreadPool();
+
+		unsigned int GetThreadCount() { return mThreadCount; }
+
+		/*
+		 * Method: void Submit( Task task, void *pArgument, TaskGroup *pGroup );
+		 * Description: Queue a task to be run on one of the pool's threads, as part of the given group.
+		 */
+		void Submit( Task, void *, TaskGroup * );
+
+		/*
+		 * Method: void Wait( TaskGroup *pGroup );
+		 * Description: Block until every task in the group has finished.
+		 */
+		void Wait( TaskGroup * );
+
+	};
+
+};
@@ -21,11 +21,18 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <cfloat>
+#include <cstdio>
+#include <climits>
 #include <ctime>
+#include <sys/time.h>
+#include <set>
+#include <algorithm>
 
 #include "Urc.h"
 #include "Raytracer.h"
+#include "ImageSource.h"
 
 using namespace std;
 using namespace Urc;
@@ -198,12 +205,1010 @@ typedef std::vector<DestinationLookup> SourceLaneList;
 typedef std::vector<SourceLaneList> SourceLocationList;
 typedef std::map<int,SourceLocationList> RiceFactorMap;
 
+// where a receiver's K factor goes in the destination lookup
+struct ReceiverSlot {
+	int mLink;
+	unsigned int mLocation;
+	unsigned int mLane;
+};
+
+
+#define ISEVEN(x) (x%2)==0
+
+// links whose source positions are queued ahead of the one being written out, per core
+#define LINK_WINDOW_PER_CORE	4
+
+// how each trace is set up
+struct TraceOptions {
+	int mRayCount;
+	unsigned int mSeed;
+	bool mCullAtBounds;
+	Rect mBounds;
+	unsigned int mMaxReflections;
+	Real mPowerFloor;
+	bool mRoulette;
+	bool mRecordTouched;				// note the buildings each trace touches, for --update
+};
+
+// everything a source position's task needs to know about the run
+struct RunOptions {
+	TraceOptions mTrace;
+	Real mIncrement;
+	Real mLaneWidth;
+	Real mRangeSq;
+	Real mRxGain;
+	bool mReciprocal;
+	bool mAdaptive;
+	Real mTargetError;
+	int mMaxRays;
+	bool mStreaming;
+	bool mImageSource;
+	int mMaxReflections;
+	bool mUseVisualiser;
+	std::vector< std::vector<int> > mNeighbours;	// for each link, the links its sources could see (UrcData::GetLinkNeighbours)
+};
+
+// what went into some part of the run, for the stats file
+struct WorkStats {
+	unsigned long mSources;
+	unsigned long mReceivers;
+	unsigned long mRays;				// rays launched
+	unsigned long mSegments;			// ray path components generated
+	unsigned long mKEvaluations;		// receivers' K factors worked out (once per receiver per round)
+	unsigned long mTruncatedSources;	// image method: sources whose tree of images was cut off
+	double mGatherSeconds;				// finding the receivers
+	double mTraceSeconds;
+	double mKSeconds;
+	double mIOSeconds;					// writing the journal and output
+
+	WorkStats() : mSources( 0 ), mReceivers( 0 ), mRays( 0 ), mSegments( 0 ), mKEvaluations( 0 ), mTruncatedSources( 0 ), mGatherSeconds( 0 ), mTraceSeconds( 0 ), mKSeconds( 0 ), mIOSeconds( 0 ) {  }
+
+	void Add( const WorkStats &rhs ) {
+		mSources += rhs.mSources;
+		mReceivers += rhs.mReceivers;
+		mRays += rhs.mRays;
+		mSegments += rhs.mSegments;
+		mKEvaluations += rhs.mKEvaluations;
+		mTruncatedSources += rhs.mTruncatedSources;
+		mGatherSeconds += rhs.mGatherSeconds;
+		mTraceSeconds += rhs.mTraceSeconds;
+		mKSeconds += rhs.mKSeconds;
+		mIOSeconds += rhs.mIOSeconds;
+	}
+};
+
+// what one source position's trace touched, as kept in the .touched file
+struct TouchedEntry {
+	bool mEscaped;						// some rays went their full range without hitting anything
+	std::vector<int> mBuildings;		// ascending
+
+	TouchedEntry() : mEscaped( true ) {  }
+};
+
+// touched entries by link, location and lane
+typedef std::map< std::pair< int, std::pair<int,int> >, TouchedEntry > TouchedMap;
+
+// one source position along a link
+struct SourcePosition {
+	Vector2D mPosition;
+	int mLocation;
+	int mLane;
+};
+
+// one source position, worked out on the pool
+struct SourceTask {
+	const RunOptions *m_pOptions;
+	int mLink;
+	unsigned int mIndex;				// among the link's source positions
+	Vector2D mPosition;
+	int mLocation;						// where the position is in the link's K factors
+	int mLane;
+	DestinationLookup mDestLookup;		// the K factors, filled in by the task
+	std::string mLog;					// anything to go in the log, written out in order
+	WorkStats mStats;
+	TouchedEntry mTouched;
+	bool mAllDestinations;				// an RSU, whose table has every link in it, even in reciprocal mode
+
+	SourceTask() : mAllDestinations( false ) {  }
+};
+
+
+struct RsuDef {
+	std::string mName;
+	std::string mRoadId;
+	Vector2D mPosition;
+};
+
+
+// wall clock time, in seconds
+double Seconds() {
+
+	timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+
+}
+
+
+/*
+ * Method: void WriteStats( ostream &out, const WorkStats &stats, double seconds );
+ * Description: Writes the stats as JSON members (without the braces). Rates are per second of the given
+ * 				wall time; the time split is in thread seconds, so it adds up to more than the wall time
+ * 				when the threads are busy together.
+ */
+void WriteStats( ostream &out, const WorkStats &stats, double seconds ) {
+
+	double perSecond = ( seconds > 0 ? 1 / seconds : 0 );
+	out << "\"sources\":" << stats.mSources
+		<< ",\"receivers\":" << stats.mReceivers
+		<< ",\"rays\":" << stats.mRays
+		<< ",\"segments\":" << stats.mSegments
+		<< ",\"kEvaluations\":" << stats.mKEvaluations
+		<< ",\"truncatedSources\":" << stats.mTruncatedSources
+		<< ",\"raysPerSecond\":" << stats.mRays * perSecond
+		<< ",\"segmentsPerSecond\":" << stats.mSegments * perSecond
+		<< ",\"kEvaluationsPerSecond\":" << stats.mKEvaluations * perSecond
+		<< ",\"gatherSeconds\":" << stats.mGatherSeconds
+		<< ",\"traceSeconds\":" << stats.mTraceSeconds
+		<< ",\"kSeconds\":" << stats.mKSeconds
+		<< ",\"ioSeconds\":" << stats.mIOSeconds;
+
+}
+
+
+Raytracer *MakeTracer( Vector2D position, const TraceOptions &options ) {
+
+	// Each source position has a thread of its own, so the tracer runs on the calling thread.
+	Raytracer *rt = new Raytracer( position, options.mRayCount );
+	rt->SetSeed( Raytracer::MakeSeed( position, options.mSeed ) );
+	if ( options.mCullAtBounds )
+		rt->SetBounds( options.mBounds );
+	rt->SetMaxReflections( options.mMaxReflections );
+	rt->SetPowerFloor( options.mPowerFloor, options.mRoulette );
+	if ( options.mRecordTouched )
+		rt->RecordTouchedBuildings();
+	return rt;
+
+}
+
+
+/*
+ * Method: void GetSourcePositions( int linkIndex, Real increment, Real laneWidth, std::vector<SourcePosition> *pPositions );
+ * Description: Lays out the source positions along a link: every increment along its length, and across each of its lanes.
+ */
+void GetSourcePositions( int linkIndex, Real increment, Real laneWidth, std::vector<SourcePosition> *pPositions ) {
+
+	UrcData *pUrc = UrcData::GetSingleton();
+	UrcData::Link *pLink = pUrc->GetSummedLink( linkIndex );
+	LineSegment srcPath( pUrc->GetNode( pLink->nodeAindex )->position, pUrc->GetNode( pLink->nodeBindex )->position );
+
+	pPositions->clear();
+	int srcLocation = 0;
+	for ( Real srcT = 0; srcT <= 1; srcT += increment/srcPath.GetDistance(), srcLocation++ ) {
+
+		Vector2D srcDir = srcPath.GetVector().Unitise();
+		Vector2D srcLinkPos = srcPath.mStart + srcPath.GetVector() * srcT;
+		Vector2D srcLinkNorm = Vector2D( -srcDir.y, srcDir.x ).Unitise();
+		// Note iterate through each lane.
+		for ( int srcLane = 0; srcLane < pLink->NumberOfLanes; srcLane++ ) {
+
+			SourcePosition pos;
+			if ( ISEVEN( pLink->NumberOfLanes ) )
+				pos.mPosition = srcLinkPos + srcLinkNorm * ( srcLane - pLink->NumberOfLanes / 2 ) * laneWidth / 2;
+			else
+				pos.mPosition = srcLinkPos + srcLinkNorm * ( srcLane - ( pLink->NumberOfLanes - 1 ) / 2 ) * laneWidth;
+			pos.mLocation = srcLocation;
+			pos.mLane = srcLane;
+			pPositions->push_back( pos );
+
+		}
+
+	}
+
+}
+
+
+/*
+ * Method: void ProcessSource( void *pTask );
+ * Description: Works out the K factors from one source position (a SourceTask) to every receiver in range of it.
+ * 				Run on the pool, one task per source position, each with a single threaded tracer of its own.
+ */
+void ProcessSource( void *pArgument ) {
+
+	SourceTask *pTask = (SourceTask*)pArgument;
+	const RunOptions &options = *pTask->m_pOptions;
+	UrcData *pUrc = UrcData::GetSingleton();
+	int linkIndex = pTask->mLink;
+	Vector2D srcPos = pTask->mPosition;
+	Real laneWidth = options.mLaneWidth;
+	WorkStats &stats = pTask->mStats;
+	double startTime = Seconds();
+
+	// Cycle through the links in reach of this one, gathering the receivers. The layout of the lookup is built as
+	// we go, and the K factors are filled in once they're all known. UrcData::GetK indexes
+	// the lookup by location and lane, so skipped lanes and locations are kept as Rayleigh (0)
+	// placeholders; only the trailing ones are dropped.
+	DestinationLookup &destLookup = pTask->mDestLookup;
+	std::vector<Vector2D> receivers;
+	std::vector<ReceiverSlot> receiverSlots;
+	const std::vector<int> &neighbours = options.mNeighbours[linkIndex];
+	for ( unsigned int n = 0; n < neighbours.size(); n++ ) {
+
+		int destLink = neighbours[n];
+
+		// In reciprocal mode, the K factor from a higher link to a lower one is looked up the other way around.
+		if ( options.mReciprocal && destLink < linkIndex && !pTask->mAllDestinations )
+			continue;
+
+		UrcData::Classification cls = pUrc->GetClassification( linkIndex, destLink );
+
+		DestinationLocationList destLocList;
+		UrcData::Link *pLinkDest = pUrc->GetSummedLink( destLink );
+
+		// this link is LOS
+		LineSegment destPath( pUrc->GetNode( pLinkDest->nodeAindex )->position, pUrc->GetNode( pLinkDest->nodeBindex )->position );
+		for ( Real destT = 0; destT <= 1; destT += options.mIncrement/destPath.GetDistance() ) {
+
+			Vector2D destDir = destPath.GetVector().Unitise();
+			Vector2D destLinkPos = destPath.mStart + destPath.GetVector() * destT;
+			Vector2D destLinkNorm = Vector2D( -destDir.y, destDir.x ).Unitise();
+			DestinationLaneList destLaneList;
+			int lastReceiverLane = -1;
+			for ( int destLane = 0; destLane < pLinkDest->NumberOfLanes; destLane++ ) {
+
+				Vector2D destPos;
+				if ( ISEVEN( pLinkDest->NumberOfLanes ) )
+					destPos = destLinkPos + destLinkNorm * ( destLane - pLinkDest->NumberOfLanes / 2 ) * laneWidth / 2;
+				else
+					destPos = destLinkPos + destLinkNorm * ( destLane - ( pLinkDest->NumberOfLanes - 1 ) / 2 ) * laneWidth;
+
+				destLaneList.push_back( 0 );
+				if ( (destPos-srcPos).MagnitudeSq() >= options.mRangeSq )
+					continue;
+
+				UrcData::Classification clsRefined = cls;
+				pUrc->RefineClassification( clsRefined, srcPos, destPos/*, ( cls.mLinkPair.first != linkIndex )*/ );
+				if ( clsRefined.mClassification != Classifier::LOS )
+					continue;
+
+				ReceiverSlot slot;
+				slot.mLink = destLink;
+				slot.mLocation = destLocList.size();
+				slot.mLane = destLane;
+				receivers.push_back( destPos );
+				receiverSlots.push_back( slot );
+				lastReceiverLane = destLane;
+				//std::cout << "S:" << linkIndex << "-" << srcLane << "-" << srcT << "\tD:" << destLink << "-" << destLane << "-" << destT << std::endl;
+
+			}
+
+			destLaneList.resize( lastReceiverLane + 1 );
+			destLocList.push_back( destLaneList );
+
+		}
+
+		while ( !destLocList.empty() && destLocList.back().empty() )
+			destLocList.pop_back();
+		if ( !destLocList.empty() )
+			destLookup[destLink] = destLocList;
+
+	}
+
+	double traceTime = Seconds();
+	stats.mSources = 1;
+	stats.mReceivers = receivers.size();
+	stats.mGatherSeconds = traceTime - startTime;
+
+	// Work out all of the receivers in one pass over the trace, or in streaming mode, as it's traced.
+	// (The image engine's time all goes down to K evaluation, and streaming mode's testing of the
+	// receivers to the trace.)
+	std::vector<Raytracer::TraceReport> reports;
+	Raytracer *rt = NULL;
+	double kTime;
+	if ( options.mImageSource ) {
+		kTime = Seconds();
+		ImageSourceTracer images( srcPos, options.mMaxReflections );
+		images.ComputeKBatch( receivers, options.mRxGain, &reports );
+		if ( images.IsTruncated() ) {
+			std::ostringstream line;
+			line << "Link " << linkIndex << " source " << pTask->mIndex << ": image tree cut off at " << images.GetImageCount()
+				 << " images; paths with more than " << images.GetCompleteDepth() << " reflections may be missing.\n";
+			pTask->mLog += line.str();
+			stats.mTruncatedSources = 1;
+		}
+	} else if ( options.mStreaming ) {
+		rt = MakeTracer( srcPos, options.mTrace );
+		rt->SetReceivers( receivers, options.mRxGain );
+		rt->Execute();
+		kTime = Seconds();
+		rt->GetReceiverReports( &reports );
+	} else {
+		rt = MakeTracer( srcPos, options.mTrace );
+		rt->Execute();
+		kTime = Seconds();
+		rt->ComputeKBatch( receivers, options.mRxGain, &reports );
+	}
+	stats.mTraceSeconds += kTime - traceTime;
+	stats.mKSeconds += Seconds() - kTime;
+	stats.mKEvaluations += receivers.size();
+
+#ifdef USE_VISUALISER
+	if ( options.mUseVisualiser && rt && !options.mStreaming ) {
+		for ( unsigned int r = 0; r < receivers.size(); r++ ) {
+			StartPass();
+			DrawTrace( rt );
+			DrawMarker(     srcPos, Vector3D(1,0,0) );
+			DrawMarker( receivers[r], Vector3D(0,1,0) );
+			Present();
+		}
+	}
+#endif // #ifdef USE_VISUALISER
+
+	// In adaptive mode, keep adding rounds of rays until every receiver's K has settled to within
+	// the target error, or the ray budget runs out.
+	while ( rt && options.mAdaptive && !receivers.empty() && (int)( rt->GetLaunchedRayCount() + options.mTrace.mRayCount ) <= options.mMaxRays ) {
+
+		Real worstError = 0;
+		for ( unsigned int r = 0; r < reports.size(); r++ )
+			worstError = MAX( worstError, reports[r].mFactorKErrorDB );
+		if ( worstError <= options.mTargetError )
+			break;
+
+		traceTime = Seconds();
+		rt->ExecuteRound();
+		kTime = Seconds();
+		if ( options.mStreaming )
+			rt->GetReceiverReports( &reports );
+		else
+			rt->ComputeKBatch( receivers, options.mRxGain, &reports );
+		stats.mTraceSeconds += kTime - traceTime;
+		stats.mKSeconds += Seconds() - kTime;
+		stats.mKEvaluations += receivers.size();
+
+	}
+	if ( rt && options.mAdaptive ) {
+		std::ostringstream line;
+		line << "Link " << linkIndex << " source " << pTask->mIndex << ": " << rt->GetLaunchedRayCount() << " rays for " << receivers.size() << " receivers.\n";
+		pTask->mLog = line.str();
+	}
+
+	for ( unsigned int r = 0; r < receivers.size(); r++ ) {
+		ReceiverSlot &slot = receiverSlots[r];
+		Real k = reports[r].mFactorK;
+		destLookup[slot.mLink][slot.mLocation][slot.mLane] = MAX( k, 0 );
+	}
+
+	if ( rt ) {
+		stats.mRays = rt->GetLaunchedRayCount();
+		stats.mSegments = rt->GetSegmentCount();
+	}
+
+	// The image engine doesn't say which buildings it used, so its positions count as reaching their full range.
+	if ( rt && options.mTrace.mRecordTouched ) {
+		rt->GetTouchedBuildings( &pTask->mTouched.mBuildings );
+		pTask->mTouched.mEscaped = rt->HasEscapedRays();
+	}
+
+	delete rt;
+
+}
+
+
+/*
+ * Method: void WriteSourceLink( ostream &out, int linkIndex, const SourceLocationList &srcLocList );
+ * Description: Writes one source link's K factors, laid out as in the .urc.k file.
+ */
+void WriteSourceLink( ostream &out, int linkIndex, const SourceLocationList &srcLocList ) {
+
+	// Write the index of the source link and the number of locations.
+	out << linkIndex << " " << srcLocList.size() << "\n";
+
+	// Iterate through the source locations
+	SourceLocationList::const_iterator srcLocIt;
+	for ( AllInVector( srcLocIt, srcLocList ) ) {
+
+		// Write the number of source lanes.
+		out << srcLocIt->size() << "\n";
+
+		// Now iterate through the lane list.
+		SourceLaneList::const_iterator srcLaneIt;
+		for ( AllInVector( srcLaneIt, (*srcLocIt) ) ) {
+
+			// Write the number of the destination links.
+			out << srcLaneIt->size() << "\n";
+
+			// Iterate through the destination lookup.
+			DestinationLookup::const_iterator destIt;
+			for ( AllInVector( destIt, (*srcLaneIt) ) ) {
+
+				// Write the index of the destination link and number of locations.
+				out << destIt->first << " " << destIt->second.size() << "\n";
+
+				// Iterate through destination locations.
+				DestinationLocationList::const_iterator destLocIt;
+				for ( AllInVector( destLocIt, destIt->second ) ) {
+
+					// Write the number of destination lanes.
+					out << destLocIt->size() << "\n";
+
+					// Iterate through the destination lanes.
+					DestinationLaneList::const_iterator destLaneIt;
+					for ( AllInVector( destLaneIt, (*destLocIt) ) ) {
+
+						// Write the K-factor.
+						if ( *destLaneIt == DBL_MAX )
+							out << "inf\n";
+						else
+							out << *destLaneIt << "\n";
+
+					}
+
+				}
+
+			}
+
+		}
+
+	}
+
+}
+
+
+/*
+ * Method: bool ReadSourceLink( istream &in, int *pLinkIndex, SourceLocationList *pSrcLocList );
+ * Description: Reads back one source link written by WriteSourceLink. Returns false if the stream
+ * 				ran out, or didn't make sense, part way through.
+ */
+bool ReadSourceLink( istream &in, int *pLinkIndex, SourceLocationList *pSrcLocList ) {
+
+	int srcLocCount;
+	if ( !( in >> *pLinkIndex >> srcLocCount ) || srcLocCount < 0 )
+		return false;
+
+	pSrcLocList->resize( srcLocCount );
+	for ( int srcLoc = 0; srcLoc < srcLocCount; srcLoc++ ) {
+
+		int srcLaneCount;
+		if ( !( in >> srcLaneCount ) || srcLaneCount < 0 )
+			return false;
+
+		SourceLaneList &srcLaneList = (*pSrcLocList)[srcLoc];
+		srcLaneList.resize( srcLaneCount );
+		for ( int srcLane = 0; srcLane < srcLaneCount; srcLane++ ) {
+
+			int destLinkCount;
+			if ( !( in >> destLinkCount ) || destLinkCount < 0 )
+				return false;
+
+			for ( int destLink = 0; destLink < destLinkCount; destLink++ ) {
+
+				int destId, destLocCount;
+				if ( !( in >> destId >> destLocCount ) || destLocCount < 0 )
+					return false;
+
+				DestinationLocationList &destLocList = srcLaneList[srcLane][destId];
+				destLocList.resize( destLocCount );
+				for ( int destLoc = 0; destLoc < destLocCount; destLoc++ ) {
+
+					int destLaneCount;
+					if ( !( in >> destLaneCount ) || destLaneCount < 0 )
+						return false;
+
+					for ( int destLane = 0; destLane < destLaneCount; destLane++ ) {
+
+						std::string kStr;
+						if ( !( in >> kStr ) )
+							return false;
+						if ( "inf" == kStr )
+							destLocList[destLoc].push_back( DBL_MAX );
+						else
+							destLocList[destLoc].push_back( atof( kStr.c_str() ) );
+
+					}
+
+				}
+
+			}
+
+		}
+
+	}
+
+	return true;
+
+}
+
+
+/*
+ * Method: bool WriteKFile( const char *filename, bool reciprocal, Real increment, RiceFactorMap &riceData );
+ * Description: Writes a text .urc.k file. Returns false if it couldn't be written.
+ */
+bool WriteKFile( const char *filename, bool reciprocal, Real increment, RiceFactorMap &riceData ) {
+
+	ofstream outputFile;
+	outputFile.precision( 12 );
+	outputFile.open( filename );
+
+	if ( reciprocal )
+		outputFile << "reciprocal\n";
+	outputFile << increment << "\n";
+	outputFile << riceData.size() << "\n";
+
+	RiceFactorMap::iterator mapIt;
+	for ( AllInVector( mapIt, riceData ) )
+		WriteSourceLink( outputFile, mapIt->first, mapIt->second );
+
+	outputFile.close();
+	return !outputFile.fail();
+
+}
+
+
+/*
+ * Method: void ReadKFile( const char *filename, bool *pReciprocal, Real *pIncrement, std::vector< std::pair<int,SourceLocationList> > *pLinks );
+ * Description: Reads a .urc.k file, text or binary, a source link at a time. Throws if it can't be read, or is incomplete.
+ */
+void ReadKFile( const char *filename, bool *pReciprocal, Real *pIncrement, std::vector< std::pair<int,SourceLocationList> > *pLinks ) {
+
+	if ( KFactorFile::IsKFactorFile( filename ) ) {
+
+		KFactorReader reader( filename );
+		*pReciprocal = reader.IsReciprocal();
+		*pIncrement = reader.GetIncrement();
+		pLinks->resize( reader.GetLinkCount() );
+		for ( unsigned int i = 0; i < reader.GetLinkCount(); i++ ) {
+			(*pLinks)[i].first = reader.GetLink( i );
+			reader.ReadLink( (*pLinks)[i].first, &(*pLinks)[i].second );
+		}
+
+	} else {
+
+		ifstream in( filename );
+		if ( in.fail() ) {
+			THROW_EXCEPTION( "Cannot open K-factor file: %s", filename );
+		}
+
+		std::string header;
+		int count;
+		in >> header;
+		*pReciprocal = ( header == "reciprocal" );
+		if ( *pReciprocal )
+			in >> header;
+		*pIncrement = atof( header.c_str() );
+		if ( !( in >> count ) ) {
+			THROW_EXCEPTION( "Not a K-factor file: %s", filename );
+		}
+		pLinks->resize( count );
+		for ( int i = 0; i < count; i++ ) {
+			if ( !ReadSourceLink( in, &(*pLinks)[i].first, &(*pLinks)[i].second ) ) {
+				THROW_EXCEPTION( "K-factor file is incomplete: %s", filename );
+			}
+		}
+
+	}
+
+}
+
+
+// orders links by cost, dearest first, then by index
+static bool CostlierLink( const std::pair<Real,int> &a, const std::pair<Real,int> &b ) {
+	if ( a.first != b.first )
+		return a.first > b.first;
+	return a.second < b.second;
+}
+
+
+/*
+ * Method: int MergeShards( int argc, char *pArgv[] );
+ * Description: Combines the .urc.k files of the runs of a sharded configuration into one.
+ * 				Called as 'Raytracer -m <output> <shard> [<shard> ...]'. The output is binary if the
+ * 				first shard is, and text otherwise.
+ */
+int MergeShards( int argc, char *pArgv[] ) {
+
+	if ( argc < 4 ) {
+		cout << "Require an output file and the shard files to merge into it.\n";
+		return -1;
+	}
+
+	const char *outputFilename = pArgv[2];
+	bool binaryOutput = KFactorFile::IsKFactorFile( pArgv[3] );
+	KFactorWriter *pBinaryOut = NULL;
+	RiceFactorMap riceData;
+	std::set<int> linksSeen;
+	bool reciprocal = false;
+	Real increment = 0;
+
+	try {
+
+		for ( int a = 3; a < argc; a++ ) {
+
+			const char *shardFilename = pArgv[a];
+			std::vector< std::pair<int,SourceLocationList> > links;
+			bool shardReciprocal;
+			Real shardIncrement;
+
+			ReadKFile( shardFilename, &shardReciprocal, &shardIncrement, &links );
+
+			if ( a == 3 ) {
+				reciprocal = shardReciprocal;
+				increment = shardIncrement;
+				if ( binaryOutput )
+					pBinaryOut = new KFactorWriter( outputFilename, reciprocal, increment );
+			} else if ( shardReciprocal != reciprocal || shardIncrement != increment ) {
+				THROW_EXCEPTION( "Shard file was computed with different settings: %s", shardFilename );
+			}
+
+			for ( unsigned int i = 0; i < links.size(); i++ ) {
+
+				if ( !linksSeen.insert( links[i].first ).second ) {
+					THROW_EXCEPTION( "Source link %d is in more than one shard (again in %s).", links[i].first, shardFilename );
+				}
+
+				if ( pBinaryOut )
+					pBinaryOut->WriteLink( links[i].first, links[i].second );
+				else
+					riceData[links[i].first].swap( links[i].second );
+
+			}
+
+			cout << "Merged " << links.size() << " source links from " << shardFilename << "\n";
+
+		}
+
+		if ( pBinaryOut )
+			pBinaryOut->Close();
+		else if ( !WriteKFile( outputFilename, reciprocal, increment, riceData ) ) {
+			THROW_EXCEPTION( "Could not write %s", outputFilename );
+		}
+
+	} catch( Exception &e ) {
+
+		cout << e.What() << "\n";
+		delete pBinaryOut;
+		return -1;
+
+	}
+
+	delete pBinaryOut;
+	cout << "Written " << linksSeen.size() << " source links to " << outputFilename << "\n";
+	return 0;
+
+}
+
+
+/*
+ * Method: void WriteTouched( ostream &out, int linkIndex, int location, int lane, const TouchedEntry &entry );
+ * Description: Writes one source position's line of the .touched file: its link, location and lane, whether
+ * 				any rays escaped, then the count and indices of the buildings they hit.
+ */
+void WriteTouched( ostream &out, int linkIndex, int location, int lane, const TouchedEntry &entry ) {
+
+	out << linkIndex << " " << location << " " << lane << " " << ( entry.mEscaped ? 1 : 0 ) << " " << entry.mBuildings.size();
+	for ( unsigned int b = 0; b < entry.mBuildings.size(); b++ )
+		out << " " << entry.mBuildings[b];
+	out << "\n";
+
+}
+
+
+/*
+ * Method: bool ReadTouched( const char *filename, TouchedMap *pTouched );
+ * Description: Reads a .touched file. A run that was resumed may have written a position more than once, so
+ * 				later lines replace earlier ones, and a line cut short is skipped. Returns false if the file
+ * 				can't be opened, or isn't a .touched file.
+ */
+bool ReadTouched( const char *filename, TouchedMap *pTouched ) {
+
+	ifstream in( filename );
+	string line;
+	if ( in.fail() || !getline( in, line ) || line != "touched" )
+		return false;
+
+	while ( getline( in, line ) ) {
+
+		std::istringstream lineIn( line );
+		int linkIndex, location, lane, escaped, count;
+		if ( !( lineIn >> linkIndex >> location >> lane >> escaped >> count ) || count < 0 )
+			continue;
+
+		TouchedEntry entry;
+		entry.mEscaped = ( escaped != 0 );
+		entry.mBuildings.resize( count );
+		int b = 0;
+		while ( b < count && lineIn >> entry.mBuildings[b] )
+			b++;
+		if ( b < count )
+			continue;
+
+		(*pTouched)[std::make_pair( linkIndex, std::make_pair( location, lane ) )] = entry;
+
+	}
+
+	return true;
+
+}
+
+
+// a building's footprint, which is all that the trace sees of it
+struct BuildingOutline {
+	Real mPermitivity;
+	std::vector<Vector2D> mVertices;
+};
+
+
+/*
+ * Method: void ReadBuildingOutlines( const char *filename, std::vector<BuildingOutline> *pOutlines );
+ * Description: Reads the outlines from a .corner.bld file, in the order UrcData numbers them. Throws if it can't be read.
+ */
+void ReadBuildingOutlines( const char *filename, std::vector<BuildingOutline> *pOutlines ) {
+
+	ifstream in( filename );
+	if ( in.fail() ) {
+		THROW_EXCEPTION( "Cannot open building file: %s", filename );
+	}
+
+	int count;
+	if ( !( in >> count ) ) {
+		THROW_EXCEPTION( "Not a building file: %s", filename );
+	}
+	pOutlines->resize( count );
+	for ( int c = 0; c < count; c++ ) {
+
+		BuildingOutline &outline = (*pOutlines)[c];
+		int tmp, vertexCount;
+		Real maxHeight, heightStdDev;
+		if ( !( in >> tmp >> outline.mPermitivity >> maxHeight >> heightStdDev >> vertexCount ) || vertexCount < 0 ) {
+			THROW_EXCEPTION( "Building file is incomplete: %s", filename );
+		}
+		outline.mVertices.resize( vertexCount );
+		for ( int v = 0; v < vertexCount; v++ ) {
+			if ( !( in >> outline.mVertices[v].x >> outline.mVertices[v].y ) ) {
+				THROW_EXCEPTION( "Building file is incomplete: %s", filename );
+			}
+		}
+
+	}
+
+}
+
+
+// The outline of one of the loaded buildings; each edge starts at the next vertex.
+BuildingOutline GetBuildingOutline( UrcData::Building *pBuilding ) {
+
+	BuildingOutline outline;
+	outline.mPermitivity = pBuilding->mPermitivity;
+	UrcData::LineSet::iterator edgeIt;
+	for ( AllInVector( edgeIt, pBuilding->mEdgeSet ) )
+		outline.mVertices.push_back( edgeIt->mStart );
+	return outline;
+
+}
+
+
+// Outlines with the same key are the same to the trace.
+string GetOutlineKey( const BuildingOutline &outline ) {
+
+	std::ostringstream key;
+	key.precision( 17 );
+	key << outline.mPermitivity;
+	for ( unsigned int v = 0; v < outline.mVertices.size(); v++ )
+		key << " " << outline.mVertices[v].x << "," << outline.mVertices[v].y;
+	return key.str();
+
+}
+
+
+// Grows the box (min and max corners) to take in the outline.
+void AddToBox( const BuildingOutline &outline, Vector2D *pMin, Vector2D *pMax ) {
+
+	for ( unsigned int v = 0; v < outline.mVertices.size(); v++ ) {
+		pMin->x = MIN( pMin->x, outline.mVertices[v].x );
+		pMin->y = MIN( pMin->y, outline.mVertices[v].y );
+		pMax->x = MAX( pMax->x, outline.mVertices[v].x );
+		pMax->y = MAX( pMax->y, outline.mVertices[v].y );
+	}
+
+}
+
 
-struct RsuDef {
-	std::string mName;
-	std::string mRoadId;
-	Vector2D mPosition;
-};
+/*
+ * Method: int UpdateKFactors( RunOptions &options, int cores, const char *strKFile, const char *strTouched, const char *oldBuildingFile, ostream &log );
+ * Description: Brings a run's K-factors up to date with a change to the buildings, given the building file they
+ * 				were computed with. The buildings are matched up by their outlines, and only the source positions
+ * 				whose traces could have changed are worked out again: those whose rays hit a building that has
+ * 				gone or changed, and those whose rays could reach one that is new or changed. Every ray lies
+ * 				between its source and the buildings it hit, unless it escaped, in which case it's only known
+ * 				to be in range. The K-factor and .touched files are rewritten in place.
+ */
+int UpdateKFactors( RunOptions &options, int cores, const char *strKFile, const char *strTouched, const char *oldBuildingFile, ostream &log ) {
+
+	UrcData *pUrc = UrcData::GetSingleton();
+	Real range = pUrc->GetFreeSpaceRange();
+	bool binary = KFactorFile::IsKFactorFile( strKFile );
+	RiceFactorMap riceData;
+	TouchedMap touched;
+	std::vector<SourceTask*> tasks;
+	int positions = 0;
+
+	try {
+
+		bool reciprocal;
+		Real increment;
+		std::vector< std::pair<int,SourceLocationList> > links;
+		ReadKFile( strKFile, &reciprocal, &increment, &links );
+		if ( reciprocal != options.mReciprocal || fabs( increment - options.mIncrement ) > 1e-9 * options.mIncrement ) {
+			THROW_EXCEPTION( "'%s' was computed with different settings.", strKFile );
+		}
+		for ( unsigned int i = 0; i < links.size(); i++ )
+			riceData[links[i].first].swap( links[i].second );
+
+		if ( !ReadTouched( strTouched, &touched ) ) {
+			THROW_EXCEPTION( "No record of the buildings touched in '%s'; the run needs 'touched true'.", strTouched );
+		}
+
+		// Adding or removing a building renumbers the ones after it, so they're matched by outline rather than index.
+		std::vector<BuildingOutline> oldOutlines;
+		ReadBuildingOutlines( oldBuildingFile, &oldOutlines );
+		std::map< string, std::vector<int> > newByKey;
+		for ( int b = pUrc->GetBuildingCount()-1; b >= 0; b-- )
+			newByKey[GetOutlineKey( GetBuildingOutline( pUrc->GetBuilding( b ) ) )].push_back( b );
+
+		std::vector<int> oldToNew( oldOutlines.size(), -1 );
+		std::vector<bool> newMatched( pUrc->GetBuildingCount(), false );
+		for ( unsigned int b = 0; b < oldOutlines.size(); b++ ) {
+			std::map< string, std::vector<int> >::iterator keyIt = newByKey.find( GetOutlineKey( oldOutlines[b] ) );
+			if ( keyIt == newByKey.end() || keyIt->second.empty() )
+				continue;
+			oldToNew[b] = keyIt->second.back();
+			newMatched[oldToNew[b]] = true;
+			keyIt->second.pop_back();
+		}
+
+		// the boxes around every building that is only in one of the two
+		std::vector< std::pair<Vector2D,Vector2D> > changedBoxes;
+		int removed = 0, added = 0;
+		for ( unsigned int b = 0; b < oldOutlines.size(); b++ ) {
+			if ( oldToNew[b] >= 0 )
+				continue;
+			std::pair<Vector2D,Vector2D> box( Vector2D( DBL_MAX, DBL_MAX ), Vector2D( -DBL_MAX, -DBL_MAX ) );
+			AddToBox( oldOutlines[b], &box.first, &box.second );
+			changedBoxes.push_back( box );
+			removed++;
+		}
+		for ( int b = 0; b < pUrc->GetBuildingCount(); b++ ) {
+			if ( newMatched[b] )
+				continue;
+			std::pair<Vector2D,Vector2D> box( Vector2D( DBL_MAX, DBL_MAX ), Vector2D( -DBL_MAX, -DBL_MAX ) );
+			AddToBox( GetBuildingOutline( pUrc->GetBuilding( b ) ), &box.first, &box.second );
+			changedBoxes.push_back( box );
+			added++;
+		}
+		log << "Buildings changed or removed: " << removed << ", changed or added: " << added << "\n";
+
+		ThreadPool pool( MAX( cores, 1 ) );
+		ThreadPool::TaskGroup group;
+		RiceFactorMap::iterator mapIt;
+		for ( AllInVector( mapIt, riceData ) ) {
+
+			std::vector<SourcePosition> srcPositions;
+			GetSourcePositions( mapIt->first, increment, options.mLaneWidth, &srcPositions );
+			for ( unsigned int i = 0; i < srcPositions.size(); i++ ) {
+
+				SourcePosition &pos = srcPositions[i];
+				positions++;
+
+				// A position the last run didn't record has to be done again.
+				TouchedMap::iterator touchedIt = touched.find( std::make_pair( mapIt->first, std::make_pair( pos.mLocation, pos.mLane ) ) );
+				bool affected = ( touchedIt == touched.end() );
+				if ( !affected ) {
+
+					const TouchedEntry &entry = touchedIt->second;
+					Vector2D boxMin = pos.mPosition, boxMax = pos.mPosition;
+					for ( unsigned int b = 0; b < entry.mBuildings.size() && !affected; b++ ) {
+						int building = entry.mBuildings[b];
+						if ( building < 0 || building >= (int)oldOutlines.size() || oldToNew[building] < 0 )
+							affected = true;
+						else
+							AddToBox( oldOutlines[building], &boxMin, &boxMax );
+					}
+					for ( unsigned int c = 0; c < changedBoxes.size() && !affected; c++ ) {
+						const Vector2D &changedMin = changedBoxes[c].first, &changedMax = changedBoxes[c].second;
+						if ( entry.mEscaped ) {
+							// in range of the source
+							Vector2D nearest( MIN( MAX( pos.mPosition.x, changedMin.x ), changedMax.x ), MIN( MAX( pos.mPosition.y, changedMin.y ), changedMax.y ) );
+							affected = ( ( nearest - pos.mPosition ).MagnitudeSq() <= range * range );
+						} else {
+							affected = ( changedMin.x <= boxMax.x && changedMax.x >= boxMin.x && changedMin.y <= boxMax.y && changedMax.y >= boxMin.y );
+						}
+					}
+
+				}
+				if ( !affected )
+					continue;
+
+				SourceTask *pTask = new SourceTask;
+				pTask->m_pOptions = &options;
+				pTask->mLink = mapIt->first;
+				pTask->mIndex = i;
+				pTask->mPosition = pos.mPosition;
+				pTask->mLocation = pos.mLocation;
+				pTask->mLane = pos.mLane;
+				tasks.push_back( pTask );
+				pool.Submit( &ProcessSource, pTask, &group );
+
+			}
+
+		}
+		pool.Wait( &group );
+
+		// The positions that weren't done again keep what they touched, under the buildings' new indices.
+		TouchedMap::iterator touchedIt;
+		for ( AllInVector( touchedIt, touched ) ) {
+			std::vector<int> &buildings = touchedIt->second.mBuildings;
+			unsigned int kept = 0;
+			for ( unsigned int b = 0; b < buildings.size(); b++ ) {
+				if ( buildings[b] >= 0 && buildings[b] < (int)oldToNew.size() && oldToNew[buildings[b]] >= 0 )
+					buildings[kept++] = oldToNew[buildings[b]];
+			}
+			buildings.resize( kept );
+			std::sort( buildings.begin(), buildings.end() );
+		}
+
+		for ( unsigned int t = 0; t < tasks.size(); t++ ) {
+
+			SourceTask *pTask = tasks[t];
+			log << pTask->mLog;
+			SourceLocationList &srcLocList = riceData[pTask->mLink];
+			if ( (int)srcLocList.size() <= pTask->mLocation )
+				srcLocList.resize( pTask->mLocation + 1 );
+			if ( (int)srcLocList[pTask->mLocation].size() <= pTask->mLane )
+				srcLocList[pTask->mLocation].resize( pTask->mLane + 1 );
+			srcLocList[pTask->mLocation][pTask->mLane].swap( pTask->mDestLookup );
+			touched[std::make_pair( pTask->mLink, std::make_pair( pTask->mLocation, pTask->mLane ) )] = pTask->mTouched;
+
+		}
+
+		// Both files are written beside the old ones, which are only replaced once the new ones are complete.
+		string kTemp = string( strKFile ) + ".tmp";
+		if ( binary ) {
+			KFactorWriter writer( kTemp.c_str(), reciprocal, increment );
+			for ( AllInVector( mapIt, riceData ) )
+				writer.WriteLink( mapIt->first, mapIt->second );
+			writer.Close();
+		} else if ( !WriteKFile( kTemp.c_str(), reciprocal, increment, riceData ) ) {
+			THROW_EXCEPTION( "Could not write %s", kTemp.c_str() );
+		}
+
+		string touchedTemp = string( strTouched ) + ".tmp";
+		ofstream touchedOut( touchedTemp.c_str() );
+		touchedOut << "touched\n";
+		for ( AllInVector( touchedIt, touched ) )
+			WriteTouched( touchedOut, touchedIt->first.first, touchedIt->first.second.first, touchedIt->first.second.second, touchedIt->second );
+		touchedOut.close();
+		if ( touchedOut.fail() ) {
+			THROW_EXCEPTION( "Could not write %s", touchedTemp.c_str() );
+		}
+
+		if ( rename( kTemp.c_str(), strKFile ) != 0 || rename( touchedTemp.c_str(), strTouched ) != 0 ) {
+			THROW_EXCEPTION( "Could not replace %s", strKFile );
+		}
+
+	} catch( Exception &e ) {
+
+		log << e.What() << "\n";
+		for ( unsigned int t = 0; t < tasks.size(); t++ )
+			delete tasks[t];
+		return -1;
+
+	}
+
+	log << "Recomputed " << tasks.size() << " of " << positions << " source positions.\n";
+	for ( unsigned int t = 0; t < tasks.size(); t++ )
+		delete tasks[t];
+	return 0;
+
+}
 
 
 void ParseArgs( int argc, char *pArgv[] ) {
@@ -218,6 +1223,20 @@ void ParseArgs( int argc, char *pArgv[] ) {
 	Real laneWidth = 5;
 	string configFilename("config");
 	string rsuDefFile("none");
+	bool reciprocal = false;
+	bool adaptive = false;
+	bool streaming = false;
+	int maxReflections = 0;
+	bool imageSource = false;
+	bool cullAtBounds = false;
+	Real powerFloor = 0;
+	bool roulette = false;
+	bool binaryOutput = false;
+	Real statsInterval = 10;
+	bool recordTouched = false;
+	unsigned int seed = 0;
+	Real targetError = 1;
+	int maxRays = 0;
 #ifdef USE_VISUALISER
 	bool useVisualiser = false;
 #endif // #ifdef USE_VISUALISER
@@ -274,6 +1293,67 @@ void ParseArgs( int argc, char *pArgv[] ) {
 				laneWidth = atof(pArgv[a]);
 				break;
 
+			case 'S':
+				reciprocal = true;
+				break;
+
+			case 'a':
+				a++;
+				adaptive = true;
+				targetError = atof(pArgv[a]);
+				break;
+
+			case 'M':
+				a++;
+				maxRays = atoi(pArgv[a]);
+				break;
+
+			case 'L':
+				streaming = true;
+				break;
+
+			case 'I':
+				a++;
+				imageSource = true;
+				maxReflections = atoi(pArgv[a]);
+				break;
+
+			case 'X':
+				a++;
+				maxReflections = atoi(pArgv[a]);
+				break;
+
+			case 'C':
+				cullAtBounds = true;
+				break;
+
+			case 'P':
+				a++;
+				powerFloor = atof(pArgv[a]);
+				break;
+
+			case 'U':
+				roulette = true;
+				break;
+
+			case 'B':
+				binaryOutput = true;
+				break;
+
+			case 'T':
+				a++;
+				statsInterval = atof(pArgv[a]);
+				break;
+
+			case 'W':
+				recordTouched = true;
+				break;
+
+			case 's':
+				a++;
+				seed = strtoul( pArgv[a], NULL, 10 );
+				break;
+
 #ifdef USE_VISUALISER
 			case 'V':
 				useVisualiser = true;
@@ -304,6 +1384,21 @@ void ParseArgs( int argc, char *pArgv[] ) {
 	cfg << "cores " << cores << "\n";
 	cfg << "rxGain " << rxGain << "\n";
 	cfg << "laneWidth " << laneWidth << "\n";
+	cfg << "reciprocal " << ( reciprocal ? "true" : "false" ) << "\n";
+	cfg << "adaptive " << ( adaptive ? "true" : "false" ) << "\n";
+	cfg << "targetError " << targetError << "\n";
+	cfg << "maxRays " << ( maxRays > 0 ? maxRays : 8 * raycount ) << "\n";
+	cfg << "streaming " << ( streaming ? "true" : "false" ) << "\n";
+	cfg << "seed " << seed << "\n";
+	cfg << "engine " << ( imageSource ? "image" : "raylaunch" ) << "\n";
+	if ( maxReflections > 0 )
+		cfg << "maxReflections " << maxReflections << "\n";
+	cfg << "cullBounds " << ( cullAtBounds ? "true" : "false" ) << "\n";
+	cfg << "powerFloor " << powerFloor << "\n";
+	cfg << "roulette " << ( roulette ? "true" : "false" ) << "\n";
+	cfg << "output " << ( binaryOutput ? "binary" : "text" ) << "\n";
+	cfg << "statsInterval " << statsInterval << "\n";
+	cfg << "touched " << ( recordTouched ? "true" : "false" ) << "\n";
 #ifdef USE_VISUALISER
 	cfg << "useVisualiser " << ( useVisualiser ? "true" : "false" ) << "\n";
 #endif // #ifdef USE_VISUALISER
@@ -314,20 +1409,42 @@ void ParseArgs( int argc, char *pArgv[] ) {
 		(basename+".corner.cls").c_str(),
 		(basename+".corner.bld").c_str(),
 		(basename+".corner.lnm").c_str(),
-		15, 0.124378109, 1.1666, 1142.9, pow(10,-11), 0.25, 200
+		laneWidth, 0.124378109, 10.1666, 1142.9, pow(10,-11), 0.25, 1000
 	);
 
 	Rect mapRect = pUrc->GetMapRect();
 
-	delete pUrc;
-
-	int gridX = (int)sqrt( mapRect.size.x * areaCount / mapRect.size.y );
-	int gridY = (int)sqrt( mapRect.size.y * areaCount / mapRect.size.x );
-
-	if ( gridX == 0 )
-		gridX = 1;
+	// Share the source links out between the runs so that each has about the same amount of work.
+	// A link's cost is taken as its length, times its lanes (its source positions), times the links
+	// in reach of it (the receivers each of those will have). Dearest first, each link goes to the
+	// run with the least work so far.
+	int linkCount = pUrc->GetSummedLinkCount();
+	std::vector< std::vector<int> > neighbours;
+	pUrc->GetLinkNeighbours( pUrc->GetFreeSpaceRange(), &neighbours );
+	std::vector< std::pair<Real,int> > linkCosts;
+	for ( int l = 0; l < linkCount; l++ ) {
+
+		UrcData::Link *pLink = pUrc->GetSummedLink( l );
+		Real length = pUrc->GetNode( pLink->nodeAindex )->position.Distance( pUrc->GetNode( pLink->nodeBindex )->position );
+		int reach = 0;
+		for ( unsigned int n = 0; n < neighbours[l].size(); n++ ) {
+			if ( !reciprocal || neighbours[l][n] >= l )
+				reach++;
+		}
+		linkCosts.push_back( std::pair<Real,int>( MAX( length, increment ) * pLink->NumberOfLanes * MAX( reach, 1 ), l ) );
 
-	Vector2D s( mapRect.size.x / gridX, mapRect.size.y / gridY );
+	}
+	std::sort( linkCosts.begin(), linkCosts.end(), CostlierLink );
+
+	std::vector< std::vector<int> > shardLinks( MAX( areaCount, 1 ) );
+	std::vector<Real> shardCosts( shardLinks.size(), 0 );
+	Real totalCost = 0;
+	for ( unsigned int i = 0; i < linkCosts.size(); i++ ) {
+		int shard = std::min_element( shardCosts.begin(), shardCosts.end() ) - shardCosts.begin();
+		shardLinks[shard].push_back( linkCosts[i].second );
+		shardCosts[shard] += linkCosts[i].first;
+		totalCost += linkCosts[i].first;
+	}
 
 	// load RSU file
 	std::vector<RsuDef> rsuSet;
@@ -347,21 +1464,55 @@ void ParseArgs( int argc, char *pArgv[] ) {
 
 	}
 
+	// Each RSU is traced by one run as a single source position against every link in reach of its
+	// own, so it costs about what one position along its link does. It goes to the run with the
+	// least work so far. One whose road has no mapping costs nothing, and is reported by its run.
+	std::vector< std::vector<RsuDef> > shardRsus( shardLinks.size() );
+	for ( unsigned int i = 0; i < rsuSet.size(); i++ ) {
+		int rsuLink;
+		Real cost = 0;
+		if ( pUrc->LinkHasMapping( rsuSet[i].mRoadId, &rsuLink ) )
+			cost = increment * MAX( (int)neighbours[rsuLink].size(), 1 );
+		int shard = std::min_element( shardCosts.begin(), shardCosts.end() ) - shardCosts.begin();
+		shardRsus[shard].push_back( rsuSet[i] );
+		shardCosts[shard] += cost;
+		totalCost += cost;
+	}
+
+	delete pUrc;
+
+	int gridX = (int)sqrt( mapRect.size.x * areaCount / mapRect.size.y );
+	int gridY = (int)sqrt( mapRect.size.y * areaCount / mapRect.size.x );
+
+	if ( gridX == 0 )
+		gridX = 1;
+	if ( gridY == 0 )
+		gridY = 1;
+
+	Vector2D s( mapRect.size.x / gridX, mapRect.size.y / gridY );
+
 	for ( int run = 0; run < areaCount; run++ ) {
 
 		int x = run % gridX;
 		int y = run / gridX;
 
-		Vector2D p( s.x*x, s.y*y );
+		Vector2D p( mapRect.location.x + s.x*x, mapRect.location.y + s.y*y );
 
 		cfg << "run " << run << "\n";
 		cfg << "area " << p.x << "," << p.y << "," << s.x << "," << s.y << "\n";
+
+		std::sort( shardLinks[run].begin(), shardLinks[run].end() );
+		cfg << "links ";
+		if ( shardLinks[run].empty() )
+			cfg << "none";
+		for ( unsigned int i = 0; i < shardLinks[run].size(); i++ )
+			cfg << ( i > 0 ? "," : "" ) << shardLinks[run][i];
+		cfg << "\n";
+		cout << "Run " << run << ": " << shardLinks[run].size() << " links, " << shardRsus[run].size() << " RSUs, " << floor( 100 * shardCosts[run] / MAX( totalCost, 1e-9 ) + 0.5 ) << "% of the work\n";
+
 		std::vector<RsuDef>::iterator rsuIt;
-		for ( AllInVector( rsuIt, rsuSet ) ) {
-			if ( Rect( p, s ).PointWithin( rsuIt->mPosition ) ) {
-				cfg << "rsu " << rsuIt->mName << "," << rsuIt->mPosition.x << "," << rsuIt->mPosition.y << "," << rsuIt->mRoadId << "\n";
-			}
-		}
+		for ( AllInVector( rsuIt, shardRsus[run] ) )
+			cfg << "rsu " << rsuIt->mName << "," << rsuIt->mPosition.x << "," << rsuIt->mPosition.y << "," << rsuIt->mRoadId << "\n";
 
 	}
 
@@ -424,8 +1575,6 @@ Rect ParseRect( string strRect ) {
 
 }
 
-#define ISEVEN(x) (x%2)==0
-
 int main( int argc, char *pArgv[] ) {
 
 	if ( argc == 1 ) {
@@ -440,6 +1589,9 @@ int main( int argc, char *pArgv[] ) {
 
 	}
 
+	if ( pArgv[1][0] == '-' && pArgv[1][1] == 'm' )
+		return MergeShards( argc, pArgv );
+
 
 	ofstream log;
 	char strLog[200];
@@ -462,9 +1614,8 @@ int main( int argc, char *pArgv[] ) {
 	map<string,string> globalConfigs;
 	vector< map<string,string> > runConfigs;
 	vector< vector< RsuDef > > rsuDefinitions;
-	while ( !configInput.eof() ) {
+	while ( configInput >> varName >> varValue ) {
 
-		configInput >> varName >> varValue;
 		if ( varName == "run" ) {
 			runConfigs.push_back( globalConfigs );
 			rsuDefinitions.push_back( vector< RsuDef >() );
@@ -483,6 +1634,24 @@ int main( int argc, char *pArgv[] ) {
 
 	int runNumber = atoi( pArgv[2] );
 
+	bool resume = false;
+	const char *oldBuildingFile = NULL;		// --update: the building file the K-factors were computed with
+	for ( int a = 3; a < argc; a++ ) {
+		if ( string( pArgv[a] ) == "--resume" )
+			resume = true;
+		else if ( string( pArgv[a] ) == "--update" && a+1 < argc )
+			oldBuildingFile = pArgv[++a];
+	}
+
+	// Everything in the run's configuration that changes the K factors, so that a journal
+	// is only resumed by the configuration that wrote it.
+	string runSignature;
+	map<string,string>::iterator cfgIt;
+	for ( AllInVector( cfgIt, runConfigs[runNumber] ) ) {
+		if ( cfgIt->first != "cores" && cfgIt->first != "useVisualiser" )
+			runSignature += cfgIt->first + "=" + cfgIt->second + ";";
+	}
+
 	string basename = runConfigs[runNumber]["basename"];
 	int raycount = atoi( runConfigs[runNumber]["raycount"].c_str() );
 	Real increment = atof( runConfigs[runNumber]["increment"].c_str() );
@@ -490,9 +1659,44 @@ int main( int argc, char *pArgv[] ) {
 	Real rxGain = atof( runConfigs[runNumber]["rxGain"].c_str() );
 	Rect area = ParseRect( runConfigs[runNumber]["area"] );
 	Real laneWidth = atof( runConfigs[runNumber]["laneWidth"].c_str() );
+	bool reciprocal = ( runConfigs[runNumber]["reciprocal"] == "true" );
+	bool adaptive = ( runConfigs[runNumber]["adaptive"] == "true" );
+	Real targetError = atof( runConfigs[runNumber]["targetError"].c_str() );
+	int maxRays = atoi( runConfigs[runNumber]["maxRays"].c_str() );
+	if ( maxRays <= 0 )
+		maxRays = 8 * raycount;
+	bool streaming = ( runConfigs[runNumber]["streaming"] == "true" );
+	unsigned int seed = strtoul( runConfigs[runNumber]["seed"].c_str(), NULL, 10 );
+	bool imageSource = ( runConfigs[runNumber]["engine"] == "image" );
+	int maxReflections = atoi( runConfigs[runNumber]["maxReflections"].c_str() );
+	bool binaryOutput = ( runConfigs[runNumber]["output"] == "binary" );
+	string strShardLinks = runConfigs[runNumber]["links"];	// the source links this run is to do (all, if not given)
+	Real statsInterval = atof( runConfigs[runNumber]["statsInterval"].c_str() );
+	if ( statsInterval <= 0 )
+		statsInterval = 10;
+	RunOptions options;
+	options.mTrace.mRayCount = raycount;
+	options.mTrace.mSeed = seed;
+	options.mTrace.mCullAtBounds = ( runConfigs[runNumber]["cullBounds"] == "true" );
+	options.mTrace.mMaxReflections = ( maxReflections > 0 ? maxReflections : UINT_MAX );
+	options.mTrace.mPowerFloor = atof( runConfigs[runNumber]["powerFloor"].c_str() );
+	options.mTrace.mRoulette = ( runConfigs[runNumber]["roulette"] == "true" );
+	options.mTrace.mRecordTouched = ( runConfigs[runNumber]["touched"] == "true" || oldBuildingFile );
+	options.mIncrement = increment;
+	options.mLaneWidth = laneWidth;
+	options.mRxGain = rxGain;
+	options.mReciprocal = reciprocal;
+	options.mAdaptive = adaptive;
+	options.mTargetError = targetError;
+	options.mMaxRays = maxRays;
+	options.mStreaming = streaming;
+	options.mImageSource = imageSource;
+	options.mMaxReflections = maxReflections;
+	options.mUseVisualiser = false;
 #ifdef USE_VISUALISER
 	gLaneWidth = laneWidth;
 	bool useVisualiser = ( runConfigs[runNumber]["useVisualiser"] == "true" );
+	options.mUseVisualiser = useVisualiser;
 	if ( useVisualiser )
 		InitVisualiser();
 #endif // #ifdef USE_VISUALISER
@@ -528,6 +1732,22 @@ int main( int argc, char *pArgv[] ) {
 	Real range = pUrc->GetFreeSpaceRange();
 	Real rangeSq = range*range;
 
+	// The map rect covers the nodes; grow it to take in the outermost lanes and the receivers' discs.
+	int maxLanes = 1;
+	for ( int l = 0; l < pUrc->GetSummedLinkCount(); l++ )
+		maxLanes = MAX( maxLanes, pUrc->GetSummedLink( l )->NumberOfLanes );
+	Real margin = maxLanes * laneWidth + sqrt( rxGain ) * pUrc->GetWavelength() / ( 2 * M_PI );
+	Rect mapRect = pUrc->GetMapRect();
+	options.mRangeSq = rangeSq;
+
+	// Only links that could be in LOS, and in range, are worth expanding into receivers.
+	pUrc->GetLinkNeighbours( range, &options.mNeighbours );
+	int neighbourPairs = 0;
+	for ( unsigned int l = 0; l < options.mNeighbours.size(); l++ )
+		neighbourPairs += options.mNeighbours[l].size();
+	log << "Link pairs in reach: " << neighbourPairs << " of " << pUrc->GetSummedLinkCount()*pUrc->GetSummedLinkCount() << "\n";
+	options.mTrace.mBounds = Rect( mapRect.location - Vector2D( margin, margin ), mapRect.size + Vector2D( margin, margin ) * 2 );
+
 #ifdef USE_VISUALISER
 	if ( useVisualiser )
 		PrepareMap(area);
@@ -536,176 +1756,320 @@ int main( int argc, char *pArgv[] ) {
 
 	bool bSmallArea = false;//( area.size.x != 0 );
 
-	RiceFactorMap riceData;
-
-	// Start iterating through the links in the road network.
-	int linkCount = pUrc->GetSummedLinkCount();
-	log << "Processing " << basename << " with " << linkCount << " links.\n";
-	std::cerr << "\rAnalysing 1 of " << linkCount << " links. Overall 0% complete. ETA: Calculating...";
-	for ( int linkIndex = 0; linkIndex < linkCount; linkIndex++ ) {
+	// The buildings each source position's rays touched go beside the output, so that a change
+	// to the buildings can be patched in with --update rather than starting again.
+	char strF[200];
+	sprintf( strF, "%s-%d.urc.k", basename.c_str(), runNumber );
+	string strTouched = string( strF ) + ".touched";
+	if ( oldBuildingFile ) {
 
-		// Get the time.
-		time_t currTime;
-		time( &currTime );
+		log << "Updating '" << strF << "' from the buildings in '" << oldBuildingFile << "'.\n";
+		int result = UpdateKFactors( options, cores, strF, strTouched.c_str(), oldBuildingFile, log );
+		delete pUrc;
+		return result;
 
-		// Get the data for the source link.
-		UrcData::Link *pLink = pUrc->GetSummedLink( linkIndex );
-		UrcData::Node *pNode1, *pNode2;
-		pNode1 = pUrc->GetNode( pLink->nodeAindex );
-		pNode2 = pUrc->GetNode( pLink->nodeBindex );
+	}
 
-		bool bIn1 = area.PointWithin( pNode1->position );
-		bool bIn2 = area.PointWithin( pNode2->position );
+	RiceFactorMap riceData;
 
-		if ( bSmallArea && !bIn1 && !bIn2 )
-			continue;
+	// Each source link's results go to a journal as soon as they're complete, so a run that is
+	// stopped part way can pick up where it left off. Records are ended by a "done" line; one
+	// that's cut short (the run died while writing it) is thrown away and its link is redone.
+	// Binary output is written as it goes, so its journal only has the "done" lines, each with
+	// where the link's record is in the output (offset and size, 0 if it has none).
+	char strJournal[200];
+	sprintf( strJournal, "%s-%d.urc.k.journal", basename.c_str(), runNumber );
+	std::vector<bool> linkDone( pUrc->GetSummedLinkCount(), false );
+
+	// A sharded run only does its own source links.
+	std::vector<bool> inShard( pUrc->GetSummedLinkCount(), strShardLinks.empty() );
+	if ( !strShardLinks.empty() && strShardLinks != "none" ) {
+		std::istringstream shardIn( strShardLinks );
+		int link;
+		char comma;
+		while ( shardIn >> link ) {
+			if ( link >= 0 && link < (int)inShard.size() )
+				inShard[link] = true;
+			shardIn >> comma;
+		}
+	}
+	// Binary output keeps the K-factors exactly, so text written alongside it does too.
+	int textPrecision = ( binaryOutput ? 17 : 12 );
+	std::ostringstream journalKept;
+	journalKept.precision( textPrecision );
+	journalKept << "journal " << runSignature << "\n";
+	std::vector<KFactorFile::IndexEntry> keptRecords;	// binary output: the records in the old output that were finished
+	if ( resume ) {
+
+		ifstream journalIn( strJournal );
+		string header, signature;
+		if ( journalIn.fail() ) {
+			log << "No journal '" << strJournal << "' to resume from; starting from scratch.\n";
+		} else if ( !( journalIn >> header >> signature ) || header != "journal" || signature != runSignature ) {
+			log << "Journal '" << strJournal << "' was written by a different configuration. Not resuming.\n";
+			return -1;
+		} else {
 
-		// Now iterate along the length of the source path.
-		LineSegment srcPath( pNode1->position, pNode2->position );
-		SourceLocationList srcLocList;
-		for ( Real srcT = 0; srcT <= 1; srcT += increment/srcPath.GetDistance() ) {
-
-			Vector2D srcDir = srcPath.GetVector().Unitise();
-			Vector2D srcLinkPos = srcPath.mStart + srcPath.GetVector() * srcT;
-			Vector2D srcLinkNorm = Vector2D( -srcDir.y, srcDir.x ).Unitise();
-			SourceLaneList srcLaneList;
-			// Note iterate through each lane.
-			for ( int srcLane = 0; srcLane < pLink->NumberOfLanes; srcLane++ ) {
-
-				Vector2D srcPos;
-				if ( ISEVEN( pLink->NumberOfLanes ) )
-					srcPos = srcLinkPos + srcLinkNorm * ( srcLane - pLink->NumberOfLanes / 2 ) * laneWidth / 2;
-				else
-					srcPos = srcLinkPos + srcLinkNorm * ( srcLane - ( pLink->NumberOfLanes - 1 ) / 2 ) * laneWidth;
+			int resumed = 0;
+			if ( binaryOutput ) {
+
+				string line;
+				while ( getline( journalIn, line ) ) {
+
+					// A line without its newline was cut short.
+					if ( journalIn.eof() )
+						break;
+					if ( line.empty() )
+						continue;
+
+					std::istringstream lineIn( line );
+					string done;
+					KFactorFile::IndexEntry record;
+					if ( !( lineIn >> done >> record.mLink >> record.mOffset >> record.mSize ) || done != "done" )
+						break;
+					if ( record.mLink < 0 || record.mLink >= (int)linkDone.size() )
+						break;
+
+					record.mUnused = 0;
+					if ( record.mSize > 0 )
+						keptRecords.push_back( record );
+					linkDone[record.mLink] = true;
+					journalKept << line << "\n";
+					resumed++;
 
-				if ( bSmallArea && !area.PointWithin( srcPos ) )
-					continue;
+				}
 
-				Raytracer *rt = new Raytracer( srcPos, raycount, cores );
-				rt->Execute();
+			} else {
 
-				// now cycle through the maps a second time
-				DestinationLookup destLookup;
-				for ( int destLink = 0; destLink < linkCount; destLink++ ) {
+				while ( 1 ) {
 
-					UrcData::Classification cls = pUrc->GetClassification( linkIndex, destLink );
+					int linkIndex, doneIndex;
+					string done;
+					SourceLocationList srcLocList;
+					if ( !ReadSourceLink( journalIn, &linkIndex, &srcLocList ) || !( journalIn >> done >> doneIndex ) || done != "done" || doneIndex != linkIndex )
+						break;
+					if ( linkIndex < 0 || linkIndex >= (int)linkDone.size() )
+						break;
 
-					DestinationLocationList destLocList;
-					UrcData::Link *pLinkDest = pUrc->GetSummedLink( destLink );
+					if ( !srcLocList.empty() )
+						riceData[linkIndex] = srcLocList;
+					linkDone[linkIndex] = true;
+					WriteSourceLink( journalKept, linkIndex, srcLocList );
+					journalKept << "done " << linkIndex << "\n";
+					resumed++;
 
-					// this link is LOS
-					LineSegment destPath( pUrc->GetNode( pLinkDest->nodeAindex )->position, pUrc->GetNode( pLinkDest->nodeBindex )->position );
-					for ( Real destT = 0; destT <= 1; destT += increment/destPath.GetDistance() ) {
+				}
 
-						Vector2D destDir = destPath.GetVector().Unitise();
-						Vector2D destLinkPos = destPath.mStart + destPath.GetVector() * destT;
-						Vector2D destLinkNorm = Vector2D( -destDir.y, destDir.x ).Unitise();
-						DestinationLaneList destLaneList;
-						for ( int destLane = 0; destLane < pLinkDest->NumberOfLanes; destLane++ ) {
+			}
+			log << "Resumed " << resumed << " links from '" << strJournal << "'.\n";
 
-							Vector2D destPos;
-							if ( ISEVEN( pLinkDest->NumberOfLanes ) )
-								destPos = destLinkPos + destLinkNorm * ( destLane - pLinkDest->NumberOfLanes / 2 ) * laneWidth / 2;
-							else
-								destPos = destLinkPos + destLinkNorm * ( destLane - ( pLinkDest->NumberOfLanes - 1 ) / 2 ) * laneWidth;
+		}
 
-							if ( (destPos-srcPos).MagnitudeSq() >= rangeSq )
-								continue;
+	}
 
-							UrcData::Classification clsRefined = cls;
-							pUrc->RefineClassification( clsRefined, srcPos, destPos/*, ( cls.mLinkPair.first != linkIndex )*/ );
-							if ( clsRefined.mClassification != Classifier::LOS )
-								continue;
+	// Start the journal again from what was kept, through a temporary file so that a crash
+	// here doesn't lose it.
+	string journalTemp = string( strJournal ) + ".tmp";
+	ofstream journal( journalTemp.c_str() );
+	journal << journalKept.str();
+	journal.close();
+	if ( journal.fail() || rename( journalTemp.c_str(), strJournal ) != 0 ) {
+		log << "Couldn't write the journal '" << strJournal << "'.\n";
+		return -1;
+	}
+	journal.clear();
+	journal.precision( textPrecision );
+	journal.open( strJournal, ios::app );
+
+	// A resumed run adds to the touched buildings it has; otherwise any old ones no longer match the output.
+	ofstream touchedOut;
+	if ( options.mTrace.mRecordTouched ) {
+		TouchedMap touched;
+		if ( resume && ReadTouched( strTouched.c_str(), &touched ) )
+			touchedOut.open( strTouched.c_str(), ios::app );
+		else {
+			touchedOut.open( strTouched.c_str() );
+			touchedOut << "touched\n";
+		}
+	} else {
+		remove( strTouched.c_str() );
+	}
 
-#ifdef USE_VISUALISER
-							if ( useVisualiser ) {
-								StartPass();
-								DrawTrace( rt );
-								DrawMarker(  srcPos, Vector3D(1,0,0) );
-								DrawMarker( destPos, Vector3D(0,1,0) );
-								Present();
-							}
-#endif // #ifdef USE_VISUALISER
+	// Binary output is written a source link at a time as each is finished, rather than all
+	// held until the end. A resumed run carries on from the records the journal says were finished.
+	KFactorWriter *pBinaryOut = NULL;
+	if ( binaryOutput ) {
 
-							Real k = rt->ComputeK( destPos, rxGain ).mFactorK;
-							destLaneList.push_back( MAX( k, 0 ) );
-							//std::cout << "S:" << linkIndex << "-" << srcLane << "-" << srcT << "\tD:" << destLink << "-" << destLane << "-" << destT << std::endl;
+		try {
+			if ( keptRecords.empty() )
+				pBinaryOut = new KFactorWriter( strF, reciprocal, increment );
+			else
+				pBinaryOut = new KFactorWriter( strF, keptRecords );
+		} catch( Exception &e ) {
+			log << e.What() << "\n";
+			return -1;
+		}
 
-						}
+	}
 
-						if ( !destLaneList.empty() )
-							destLocList.push_back( destLaneList );
+	// The pool lives for the whole run. Every source position is a task of its own, and the
+	// threads take them as they come free, so a link with a long trace doesn't hold up the rest.
+	ThreadPool pool( MAX( cores, 1 ) );
 
-					}
+	// Start iterating through the links in the road network.
+	int linkCount = pUrc->GetSummedLinkCount();
+	log << "Processing " << basename << " with " << linkCount << " links.\n";
 
-					if ( !destLocList.empty() )
-						destLookup[destLink] = destLocList;
+	// The links this run still has to do, in order.
+	std::vector<int> runLinks;
+	for ( int linkIndex = 0; linkIndex < linkCount; linkIndex++ ) {
+		if ( !linkDone[linkIndex] && inShard[linkIndex] )
+			runLinks.push_back( linkIndex );
+	}
+	int linksToDo = runLinks.size();
+
+	// Each link's source positions are queued on the pool a window of links ahead of the one being
+	// written out. The results are gathered link by link, in order, so the output doesn't depend on
+	// which thread finished first, and a slow link only holds back the results of the window after it.
+	unsigned int window = MAX( LINK_WINDOW_PER_CORE * cores, 1 );
+	std::vector< std::vector<SourceTask*> > linkTasks( linkCount );
+	std::vector<ThreadPool::TaskGroup> linkGroups( linkCount );
+	unsigned int linksQueued = 0;
+
+	// Progress is counted in this run's own links, which may be any subset of them.
+	std::cerr << "\rAnalysed 0 of " << linksToDo << " links. Overall 0% complete. ETA: Calculating...";
+
+	// Throughput goes to a JSON lines file beside the log: a line for each source link as it's
+	// finished, one for the whole run every statsInterval seconds, and one at the end.
+	char strStats[200];
+	sprintf( strStats, "logs/%s-%s.stats.jsonl", pArgv[1], pArgv[2] );
+	ofstream statsOut( strStats );
+	WorkStats runStats;
+	double startTime = Seconds();
+	double lastProgress = startTime;
+	int linksDone = 0;
+	for ( unsigned int runLink = 0; runLink < runLinks.size(); runLink++ ) {
+
+		for ( ; linksQueued < runLinks.size() && linksQueued < runLink + window; linksQueued++ ) {
+
+			int linkIndex = runLinks[linksQueued];
+
+			// Get the data for the source link.
+			UrcData::Link *pLink = pUrc->GetSummedLink( linkIndex );
+			UrcData::Node *pNode1, *pNode2;
+			pNode1 = pUrc->GetNode( pLink->nodeAindex );
+			pNode2 = pUrc->GetNode( pLink->nodeBindex );
+
+			bool bIn1 = area.PointWithin( pNode1->position );
+			bool bIn2 = area.PointWithin( pNode2->position );
+
+			if ( bSmallArea && !bIn1 && !bIn2 )
+				continue;
 
-				}
+			// Now iterate along the length of the source path.
+			std::vector<SourcePosition> srcPositions;
+			GetSourcePositions( linkIndex, increment, laneWidth, &srcPositions );
+			for ( unsigned int i = 0; i < srcPositions.size(); i++ ) {
 
-// 				vector< vector< RsuDef > >::iterator rsuDefSetIt;
-// 				vector< RsuDef >::iterator rsuDefIt;
-// 				for ( AllInVector( rsuDefSetIt, rsuDefinitions ) ) {
-// 					
-// 					for ( AllInVector( rsuDefIt, (*rsuDefSetIt) ) ) {
-// 
-// 						if ( (rsuDefIt->mPosition-srcPos).MagnitudeSq() >= rangeSq )
-// 							continue;
-// 
-// 						int rsuLinkIndex;
-// 						if ( !UrcData::GetSingleton()->LinkHasMapping( rsuDefIt->mRoadId, &rsuLinkIndex ) ) {
-// 							log << "ERROR: RSU '" << rsuDefIt->mName << "' located on link '" << rsuDefIt->mRoadId << "' has no mapping to a road index! Skipping.\n";
-// 							continue;
-// 						}
-// 
-// 						UrcData::Classification cls = pUrc->GetClassification( linkIndex, rsuLinkIndex );
-// 						if ( cls.mClassification != Classifier::LOS )
-// 							continue;
-// 
-// #ifdef USE_VISUALISER
-// 						if ( useVisualiser ) {
-// 							StartPass();
-// 							DrawMarker(              srcPos, Vector3D(1,0,0) );
-// 							DrawMarker( rsuDefIt->mPosition, Vector3D(0,1,0) );
-// 							Present();
-// 						}
-// #endif // #ifdef USE_VISUALISER
-// 
-// 						LinkPair linkPair( linkIndex, rsuLinkIndex );
-// 
-// 						RiceFactorEntry kEnt;
-// 						kEnt.mKfactor = rt->ComputeK( rsuDefIt->mPosition, rxGain ).mFactorK;
-// 						kEnt.mSrcDestPair = SrcDestPair( srcPos, rsuDefIt->mPosition );
-// 
-// 						riceData[linkPair].push_back( kEnt );
-// 
-// 						
-// 					}
-//
-// 				}
+				if ( bSmallArea && !area.PointWithin( srcPositions[i].mPosition ) )
+					continue;
 
-				delete rt;
-				if ( !destLookup.empty() )
-					srcLaneList.push_back( destLookup );
+				SourceTask *pTask = new SourceTask;
+				pTask->m_pOptions = &options;
+				pTask->mLink = linkIndex;
+				pTask->mIndex = linkTasks[linkIndex].size();
+				pTask->mPosition = srcPositions[i].mPosition;
+				pTask->mLocation = srcPositions[i].mLocation;
+				pTask->mLane = srcPositions[i].mLane;
+				linkTasks[linkIndex].push_back( pTask );
+
+				// The visualiser draws from this thread, so it does the work here too.
+				if ( options.mUseVisualiser )
+					ProcessSource( pTask );
+				else
+					pool.Submit( &ProcessSource, pTask, &linkGroups[linkIndex] );
 
 			}
 
-			if ( !srcLaneList.empty() )
-				srcLocList.push_back( srcLaneList );
-
 		}
 
-		if ( !srcLocList.empty() )
-			riceData[linkIndex] = srcLocList;
+		int linkIndex = runLinks[runLink];
+		pool.Wait( &linkGroups[linkIndex] );
 
-		// Get the time difference in seconds.
-		Real eta = ( linkCount - linkIndex ) * difftime( time(NULL), currTime );
+		std::vector<SourceTask*> &tasks = linkTasks[linkIndex];
+		SourceLocationList srcLocList;
+		SourceLaneList srcLaneList;
+		WorkStats linkStats;
+		for ( unsigned int srcIndex = 0; srcIndex < tasks.size(); srcIndex++ ) {
+
+			SourceTask *pTask = tasks[srcIndex];
+			log << pTask->mLog;
+			linkStats.Add( pTask->mStats );
+			srcLaneList.resize( pTask->mLane );
+			srcLaneList.push_back( pTask->mDestLookup );
+			if ( options.mTrace.mRecordTouched )
+				WriteTouched( touchedOut, linkIndex, pTask->mLocation, pTask->mLane, pTask->mTouched );
+
+			// Close off the location once its last lane is done.
+			if ( srcIndex+1 == tasks.size() || tasks[srcIndex+1]->mLocation != pTask->mLocation ) {
+				srcLocList.resize( pTask->mLocation );
+				srcLocList.push_back( srcLaneList );
+				srcLaneList.clear();
+			}
+
+		}
+		for ( unsigned int srcIndex = 0; srcIndex < tasks.size(); srcIndex++ )
+			delete tasks[srcIndex];
+		tasks.clear();
+
+		// The link's record and touched buildings go out before it's marked done, so a resumed run has them.
+		double ioStart = Seconds();
+		touchedOut.flush();
+		if ( pBinaryOut ) {
+			KFactorFile::IndexEntry record;
+			record.mOffset = record.mSize = 0;
+			if ( !srcLocList.empty() ) {
+				record = pBinaryOut->WriteLink( linkIndex, srcLocList );
+				if ( !pBinaryOut->Flush() ) {
+					log << "Couldn't write to '" << strF << "'. The journal has been kept.\n";
+					delete pBinaryOut;
+					return -1;
+				}
+			}
+			journal << "done " << linkIndex << " " << record.mOffset << " " << record.mSize << "\n";
+		} else {
+			if ( !srcLocList.empty() )
+				riceData[linkIndex] = srcLocList;
+			WriteSourceLink( journal, linkIndex, srcLocList );
+			journal << "done " << linkIndex << "\n";
+		}
+		journal.flush();
+		linksDone++;
+		double now = Seconds();
+		linkStats.mIOSeconds = now - ioStart;
+		runStats.Add( linkStats );
+
+		// The links are worked on together, so go by the average time per link so far.
+		Real eta = ( linksToDo - linksDone ) * ( now - startTime ) / linksDone;
+
+		// A link's cost is the thread time its source positions took.
+		double linkSeconds = linkStats.mGatherSeconds + linkStats.mTraceSeconds + linkStats.mKSeconds;
+		statsOut << "{\"event\":\"link\",\"link\":" << linkIndex << ",\"seconds\":" << linkSeconds << ",";
+		WriteStats( statsOut, linkStats, linkSeconds );
+		statsOut << "}\n";
+		if ( now - lastProgress >= statsInterval ) {
+			statsOut << "{\"event\":\"progress\",\"elapsed\":" << now - startTime << ",\"linksDone\":" << linksDone << ",\"linksToDo\":" << linksToDo << ",\"eta\":" << eta << ",";
+			WriteStats( statsOut, runStats, now - startTime );
+			statsOut << "}\n";
+			lastProgress = now;
+		}
+		statsOut.flush();
 
 		int etaHours = floor( eta / 3600 );
-		int etaMinutes = floor( ( eta - etaHours * 3500 ) / 60 );
-		Real etaSeconds = eta - etaHours * 3500 - etaMinutes * 60;
+		int etaMinutes = floor( ( eta - etaHours * 3600 ) / 60 );
+		int etaSeconds = floor( eta - etaHours * 3600 - etaMinutes * 60 );
 
-		std::cerr << "\rAnalysing " << linkIndex+1 << " of " << linkCount << " links. Overall " << floor( linkIndex * 100.0 / linkCount ) << "% complete. ETA: ";
+		std::cerr << "\rAnalysed " << linksDone << " of " << linksToDo << " links. Overall " << floor( linksDone * 100.0 / linksToDo ) << "% complete. ETA: ";
 		if ( etaHours > 0 )
 			std::cerr << etaHours << ":";
 		std::cerr << std::setfill('0') << std::setw(2) << etaMinutes << ":" << std::setfill('0') << std::setw(2) << etaSeconds << "              ";
@@ -715,151 +2079,111 @@ int main( int argc, char *pArgv[] ) {
 	log << "Road calculations complete.\n";
 	std::cerr << "\nDone.\n";
 
-// 	if ( !rsuDefinitions[runNumber].empty() ) {
-// 
-// 		log << "Calculating RSUs...\n";
-// 		int processed = 0;
-// 		int skipped = 0;
-// 		vector<RsuDef>::iterator rsuIt;
-// 		for ( AllInVector( rsuIt, rsuDefinitions[runNumber] ) ) {
-// 
-// 			int linkIndex;
-// 			if ( !UrcData::GetSingleton()->LinkHasMapping( rsuIt->mRoadId, &linkIndex ) ) {
-// 				log << "ERROR: RSU '" << rsuIt->mName << "' located on link '" << rsuIt->mRoadId << "' has no mapping to a road index! Skipping.\n";
-// 				skipped++;
-// 				continue;
-// 			}
-// 
-// 			Raytracer *rt = new Raytracer( rsuIt->mPosition, raycount, cores );
-// 			rt->Execute();
-// 
-// 			// now go through all the links in the network.
-// 			for ( int i = 0; i < linkCount; i++ ) {
-// 
-// 				UrcData::Classification cls = pUrc->GetClassification( linkIndex, i );
-// 				if ( cls.mClassification != Classifier::LOS )
-// 					continue;
-// 
-// 				UrcData::Link *pLinkDest = pUrc->GetSummedLink( i );
-// 
-// 				RiceFactorData kData;
-// 				
-// 				// this link is LOS
-// 				LineSegment destPath( pUrc->GetNode( pLinkDest->nodeAindex )->position, pUrc->GetNode( pLinkDest->nodeBindex )->position );
-// 				ForPointsOnLine( destPos, destPath, increment, _r ) {
-// 
-// 					if ( (destPos-rsuIt->mPosition).MagnitudeSq() >= rangeSq )
-// 						continue;
-// 
-// #ifdef USE_VISUALISER
-// 					if ( useVisualiser ) {
-// 						StartPass();
-// 						DrawMarker( rsuIt->mPosition, Vector3D(1,0,0) );
-// 						DrawMarker(          destPos, Vector3D(0,1,0) );
-// 						Present();
-// 					}
-// #endif // #ifdef USE_VISUALISER
-// 
-// 					RiceFactorEntry kEnt;
-// 					kEnt.mKfactor = rt->ComputeK( destPos, rxGain ).mFactorK;
-// 					kEnt.mSrcDestPair = SrcDestPair( rsuIt->mPosition, destPos );
-// 					kData.push_back( kEnt );
-// 
-// 				}
-// 
-// 				if ( kData.empty() )
-// 					continue;
-// 				
-// 				LinkPair linkPair( linkIndex, i );
-// 				if ( riceData.find( linkPair ) == riceData.end() )
-// 					riceData[linkPair] = kData;
-// 				else 
-// 					riceData[linkPair].insert( riceData[linkPair].begin(), kData.begin(), kData.end() );
-// 
-// 			}
-// 
-// 			processed++;
-// 			delete rt;
-// 
-// 		}
-// 
-// 		log << "Complete. " << processed << " RSUs processed, " << skipped << " skipped.\n";
-// 	}
-
-//	log << "Complete.\n";
-	delete pUrc;
-
-#ifdef USE_VISUALISER
-	Shutdown();
-#endif // #ifdef USE_VISUALISER
-
-	// Now save to a file
-	ofstream outputFile;
-	char strF[200];
-	sprintf( strF, "%s-%d.urc.k", basename.c_str(), runNumber );
-	outputFile.precision( 12 );
-	outputFile.open( strF );
-
-	outputFile << increment << "\n";
-	outputFile << riceData.size() << "\n";
-
-	RiceFactorMap::iterator mapIt;
-	for ( AllInVector( mapIt, riceData ) ) {
-
-		// Write the index of the source link and the number of locations.
-		outputFile << mapIt->first << " " << mapIt->second.size() << "\n";
-
-		// Iterate through the source locations
-		SourceLocationList::iterator srcLocIt;
-		for ( AllInVector( srcLocIt, mapIt->second ) ) {
-
-			// Write the number of source lanes.
-			outputFile << srcLocIt->size() << "\n";
-
-			// Now iterate through the lane list.
-			SourceLaneList::iterator srcLaneIt;
-			for ( AllInVector( srcLaneIt, (*srcLocIt) ) ) {
-
-				// Write the number of the destination links.
-				outputFile << srcLaneIt->size() << "\n";
+	// Each RSU is traced once, as a source of its own, against every position in LOS of it. They go in a
+	// table of their own, since an RSU isn't at one of the positions computed along its link.
+	std::vector<RsuDef> &rsuDefs = rsuDefinitions[runNumber];
+	if ( !rsuDefs.empty() ) {
+
+		log << "Calculating RSUs...\n";
+		std::vector<SourceTask*> rsuTasks;
+		ThreadPool::TaskGroup rsuGroup;
+		int skipped = 0;
+		for ( unsigned int r = 0; r < rsuDefs.size(); r++ ) {
+
+			int rsuLink;
+			if ( !pUrc->LinkHasMapping( rsuDefs[r].mRoadId, &rsuLink ) ) {
+				log << "ERROR: RSU '" << rsuDefs[r].mName << "' located on link '" << rsuDefs[r].mRoadId << "' has no mapping to a road index! Skipping.\n";
+				rsuTasks.push_back( NULL );
+				skipped++;
+				continue;
+			}
 
-				// Iterate through the destination lookup.
-				DestinationLookup::iterator destIt;
-				for ( AllInVector( destIt, (*srcLaneIt) ) ) {
+			SourceTask *pTask = new SourceTask;
+			pTask->m_pOptions = &options;
+			pTask->mLink = rsuLink;
+			pTask->mIndex = r;
+			pTask->mPosition = rsuDefs[r].mPosition;
+			pTask->mLocation = 0;
+			pTask->mLane = 0;
+			pTask->mAllDestinations = true;
+			rsuTasks.push_back( pTask );
+
+			if ( options.mUseVisualiser )
+				ProcessSource( pTask );
+			else
+				pool.Submit( &ProcessSource, pTask, &rsuGroup );
 
-					// Write the index of the destination link and number of locations.
-					outputFile << destIt->first << " " << destIt->second.size() << "\n";
+		}
+		pool.Wait( &rsuGroup );
+
+		// Laid out like the .urc.k file, each RSU as a source link with one location and one lane.
+		char strRsu[200];
+		sprintf( strRsu, "%s-%d.urc.rsu", basename.c_str(), runNumber );
+		double ioStart = Seconds();
+		ofstream rsuOut( strRsu );
+		rsuOut.precision( textPrecision );
+		rsuOut << "rsu\n" << increment << "\n" << rsuDefs.size() - skipped << "\n";
+		for ( unsigned int r = 0; r < rsuTasks.size(); r++ ) {
+
+			SourceTask *pTask = rsuTasks[r];
+			if ( !pTask )
+				continue;
 
-					// Iterate through destination locations.
-					DestinationLocationList::iterator destLocIt;
-					for ( AllInVector( destLocIt, destIt->second ) ) {
+			log << pTask->mLog;
+			runStats.Add( pTask->mStats );
+			rsuOut << rsuDefs[r].mName << " " << rsuDefs[r].mPosition.x << " " << rsuDefs[r].mPosition.y << "\n";
+			WriteSourceLink( rsuOut, pTask->mLink, SourceLocationList( 1, SourceLaneList( 1, pTask->mDestLookup ) ) );
+			delete pTask;
 
-						// Write the number of destination lanes.
-						outputFile << destLocIt->size() << "\n";
+		}
+		rsuOut.close();
+		runStats.mIOSeconds += Seconds() - ioStart;
+		if ( rsuOut.fail() ) {
+			log << "Couldn't write '" << strRsu << "'.\n";
+			return -1;
+		}
 
-						// Iterate through the destination lanes.
-						DestinationLaneList::iterator destLaneIt;
-						for ( AllInVector( destLaneIt, (*destLocIt) ) ) {
+		log << "Complete. " << rsuDefs.size() - skipped << " RSUs processed, " << skipped << " skipped.\n";
 
-							// Write the K-factor.
-							if ( *destLaneIt == DBL_MAX )
-								outputFile << "inf\n";
-							else
-								outputFile << *destLaneIt << "\n";
+	}
 
-						}
+//	log << "Complete.\n";
+	delete pUrc;
 
-					}
+#ifdef USE_VISUALISER
+	Shutdown();
+#endif // #ifdef USE_VISUALISER
 
-				}
+	// Now save to a file
+	double ioStart = Seconds();
+	if ( pBinaryOut ) {
+
+		try {
+			pBinaryOut->Close();
+		} catch( Exception &e ) {
+			log << e.What() << " The journal has been kept.\n";
+			delete pBinaryOut;
+			return -1;
+		}
+		delete pBinaryOut;
 
-			}
+	} else if ( !WriteKFile( strF, reciprocal, increment, riceData ) ) {
 
-		}
+		log << "Couldn't write '" << strF << "'. The journal has been kept.\n";
+		return -1;
 
 	}
 
-	outputFile.close();
+	// The output is complete, so the journal isn't needed any more.
+	journal.close();
+	remove( strJournal );
+
+	double now = Seconds();
+	runStats.mIOSeconds += now - ioStart;
+	statsOut << "{\"event\":\"summary\",\"elapsed\":" << now - startTime << ",\"linksDone\":" << linksDone << ",\"linksToDo\":" << linksToDo << ",";
+	WriteStats( statsOut, runStats, now - startTime );
+	statsOut << "}\n";
+	statsOut.close();
 
 	return 0;
 
@@ -0,0 +1,520 @@
+/*
+ *  EdgeGrid.cpp - Uniform grid over building edges for fast ray intersection.
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+#include <cfloat>
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "Singleton.h"
+#include "VectorMath.h"
+#include "UrcData.h"
+#include "EdgeGrid.h"
+
+// upper bound on the number of cells along either axis
+#define EDGEGRID_MAX_CELLS		4096
+
+// number of recently tested cells a packet remembers, so cells shared by its rays are only tested once
+#define EDGEGRID_RECENT_CELLS	8
+
+using namespace std;
+using namespace VectorMath;
+using namespace Urc;
+
+
+
+/*
+ * Constructor arguments:
+ * 		1. UrcData - the network whose buildings are to be gridded
+ */
+EdgeGrid::EdgeGrid( UrcData *pUrcData ) {
+
+	mCellsX = mCellsY = 0;
+	mCellSize = 1;
+
+	Vector2D lower( DBL_MAX, DBL_MAX ), upper( -DBL_MAX, -DBL_MAX );
+	for ( int b = 0; b < pUrcData->GetBuildingCount(); b++ ) {
+
+		UrcData::LineSet::iterator lineIt;
+		UrcData::Building *pBuilding = pUrcData->GetBuilding( b );
+		for ( AllInVector( lineIt, pBuilding->mEdgeSet ) ) {
+
+			Edge e;
+			e.mLine = *lineIt;
+			e.mBuilding = b;
+			e.mDirection = lineIt->GetVector().Unitise();
+			e.mNormal = Vector2D( e.mDirection.y, -e.mDirection.x );
+			e.mPermitivity = pBuilding->mPermitivity;
+			mEdges.push_back( e );
+
+			lower.x = std::min( lower.x, std::min( lineIt->mStart.x, lineIt->mEnd.x ) );
+			lower.y = std::min( lower.y, std::min( lineIt->mStart.y, lineIt->mEnd.y ) );
+			upper.x = std::max( upper.x, std::max( lineIt->mStart.x, lineIt->mEnd.x ) );
+			upper.y = std::max( upper.y, std::max( lineIt->mStart.y, lineIt->mEnd.y ) );
+
+		}
+
+	}
+
+	mCellStart.push_back( 0 );
+	if ( mEdges.empty() )
+		return;
+
+	// Aim for roughly one edge per cell. Most cells will be empty streets,
+	// and the ones on building outlines will hold a handful of edges.
+	Vector2D size = upper - lower;
+	mCellSize = sqrt( MAX( size.x, 1.0 ) * MAX( size.y, 1.0 ) / mEdges.size() );
+	mCellSize = MAX( mCellSize, pUrcData->GetLaneWidth() );
+	mCellSize = MAX( mCellSize, MAX( size.x, size.y ) / EDGEGRID_MAX_CELLS );
+
+	mOrigin = lower;
+	mCellsX = (int)floor( size.x / mCellSize ) + 1;
+	mCellsY = (int)floor( size.y / mCellSize ) + 1;
+
+	// Two passes: count the entries per cell, then fill them in.
+	std::vector<unsigned int> counts( mCellsX * mCellsY, 0 );
+	for ( int pass = 0; pass < 2; pass++ ) {
+
+		for ( unsigned int e = 0; e < mEdges.size(); e++ ) {
+
+			Rect r( mEdges[e].mLine );
+			int x0 = (int)floor( ( r.location.x - mOrigin.x ) / mCellSize );
+			int y0 = (int)floor( ( r.location.y - mOrigin.y ) / mCellSize );
+			int x1 = MIN( (int)floor( ( r.location.x + r.size.x - mOrigin.x ) / mCellSize ), mCellsX-1 );
+			int y1 = MIN( (int)floor( ( r.location.y + r.size.y - mOrigin.y ) / mCellSize ), mCellsY-1 );
+
+			for ( int y = y0; y <= y1; y++ ) {
+				for ( int x = x0; x <= x1; x++ ) {
+					if ( pass == 0 )
+						counts[ y*mCellsX + x ]++;
+					else
+						mCellEdges[ counts[ y*mCellsX + x ]++ ] = e;
+				}
+			}
+
+		}
+
+		if ( pass == 0 ) {
+			for ( unsigned int c = 0; c < counts.size(); c++ )
+				mCellStart.push_back( mCellStart.back() + counts[c] );
+			mCellEdges.resize( mCellStart.back() );
+			std::copy( mCellStart.begin(), mCellStart.end()-1, counts.begin() );
+		}
+
+	}
+
+	mCellX0.resize( mCellEdges.size() );
+	mCellY0.resize( mCellEdges.size() );
+	mCellX1.resize( mCellEdges.size() );
+	mCellY1.resize( mCellEdges.size() );
+	mCellBuilding.resize( mCellEdges.size() );
+	for ( unsigned int i = 0; i < mCellEdges.size(); i++ ) {
+		const Edge &edge = mEdges[ mCellEdges[i] ];
+		mCellX0[i] = edge.mLine.mStart.x;
+		mCellY0[i] = edge.mLine.mStart.y;
+		mCellX1[i] = edge.mLine.mEnd.x;
+		mCellY1[i] = edge.mLine.mEnd.y;
+		mCellBuilding[i] = edge.mBuilding;
+	}
+
+}
+
+
+
+EdgeGrid::~EdgeGrid() {
+
+	mEdges.clear();
+	mCellStart.clear();
+	mCellEdges.clear();
+	mCellX0.clear();
+	mCellY0.clear();
+	mCellX1.clear();
+	mCellY1.clear();
+	mCellBuilding.clear();
+
+}
+
+
+
+/*
+ * Method: bool ClipRay( VectorMath::LineSegment &ray, VectorMath::Real *tEnter, VectorMath::Real *tExit ) const;
+ * Description: Clips the ray against the grid bounds, giving the parametric range [0,1] of the ray inside the grid.
+ */
+bool EdgeGrid::ClipRay( LineSegment &ray, Real *tEnter, Real *tExit ) const {
+
+	Vector2D d = ray.GetVector();
+	Real lower[2] = { mOrigin.x, mOrigin.y };
+	Real upper[2] = { mOrigin.x + mCellsX * mCellSize, mOrigin.y + mCellsY * mCellSize };
+	Real start[2] = { ray.mStart.x, ray.mStart.y };
+	Real dir[2] = { d.x, d.y };
+
+	*tEnter = 0;
+	*tExit = 1;
+	for ( int axis = 0; axis < 2; axis++ ) {
+
+		if ( dir[axis] == 0 ) {
+			if ( start[axis] < lower[axis] || start[axis] > upper[axis] )
+				return false;
+			continue;
+		}
+
+		Real t0 = ( lower[axis] - start[axis] ) / dir[axis];
+		Real t1 = ( upper[axis] - start[axis] ) / dir[axis];
+		if ( t0 > t1 )
+			std::swap( t0, t1 );
+		*tEnter = MAX( *tEnter, t0 );
+		*tExit = MIN( *tExit, t1 );
+
+	}
+
+	return *tEnter <= *tExit;
+
+}
+
+
+
+/*
+ * Method: bool FindNearestHit( VectorMath::LineSegment ray, VectorMath::Real minDistance, long ignoreBuilding, Hit *pHit ) const;
+ * Description: Finds the closest edge crossed by the ray. Hits closer than minDistance to the start
+ * 				of the ray, and edges of ignoreBuilding, are skipped. Returns false if nothing was hit.
+ */
+bool EdgeGrid::FindNearestHit( LineSegment ray, Real minDistance, long ignoreBuilding, Hit *pHit ) const {
+
+	Real tEnter, tExit;
+	if ( mEdges.empty() || !ClipRay( ray, &tEnter, &tExit ) )
+		return false;
+
+	Vector2D d = ray.GetVector();
+	Real length = d.Magnitude();
+	if ( length == 0 )
+		return false;
+
+	// Find the cell the clipped ray starts in.
+	Vector2D p = ray.mStart + d * tEnter;
+	int x = MIN( MAX( (int)floor( ( p.x - mOrigin.x ) / mCellSize ), 0 ), mCellsX-1 );
+	int y = MIN( MAX( (int)floor( ( p.y - mOrigin.y ) / mCellSize ), 0 ), mCellsY-1 );
+
+	// Set up the DDA. tMax is the ray parameter at which we cross into the next column/row,
+	// tDelta is how far the parameter moves to cross one whole cell.
+	int stepX = ( d.x > 0 ? 1 : ( d.x < 0 ? -1 : 0 ) );
+	int stepY = ( d.y > 0 ? 1 : ( d.y < 0 ? -1 : 0 ) );
+	Real tMaxX = ( stepX != 0 ? ( mOrigin.x + ( x + ( stepX > 0 ) ) * mCellSize - ray.mStart.x ) / d.x : DBL_MAX );
+	Real tMaxY = ( stepY != 0 ? ( mOrigin.y + ( y + ( stepY > 0 ) ) * mCellSize - ray.mStart.y ) / d.y : DBL_MAX );
+	Real tDeltaX = ( stepX != 0 ? mCellSize / fabs( d.x ) : DBL_MAX );
+	Real tDeltaY = ( stepY != 0 ? mCellSize / fabs( d.y ) : DBL_MAX );
+
+	Real Dmin = DBL_MAX;
+	Vector2D temp;
+
+	while ( 1 ) {
+
+		int cell = y*mCellsX + x;
+		for ( unsigned int i = mCellStart[cell]; i < mCellStart[cell+1]; i++ ) {
+
+			const Edge &edge = mEdges[ mCellEdges[i] ];
+			if ( edge.mBuilding == ignoreBuilding )
+				continue;
+
+			LineSegment line = edge.mLine;
+			if ( !line.IntersectLine( ray, &temp ) )
+				continue;
+
+			// we want to make sure this ray has actually gone somewhere.
+			// Also, we want to make sure that the found intersection is the closest one.
+			Real dist = ( ray.mStart - temp ).Magnitude();
+			if ( dist >= minDistance && dist < Dmin ) {
+				Dmin = dist;
+				pHit->mPoint = temp;
+				pHit->mDistance = dist;
+				pHit->mEdgeIndex = mCellEdges[i];
+			}
+
+		}
+
+		// Anything closer than the far side of this cell has been seen already, so we can stop.
+		Real tNext = MIN( tMaxX, tMaxY );
+		if ( Dmin <= tNext * length || tNext >= tExit )
+			break;
+
+		if ( tMaxX < tMaxY ) {
+			x += stepX;
+			tMaxX += tDeltaX;
+		} else {
+			y += stepY;
+			tMaxY += tDeltaY;
+		}
+
+		if ( x < 0 || x >= mCellsX || y < 0 || y >= mCellsY )
+			break;
+
+	}
+
+	return Dmin != DBL_MAX;
+
+}
+
+
+
+/*
+ * Method: void FindNearestHits( const VectorMath::LineSegment *rays, unsigned int count, VectorMath::Real minDistance, long ignoreBuilding, Hit *pHits, bool *pFound ) const;
+ * Description: As FindNearestHit, for a packet of up to EDGEGRID_PACKET_SIZE rays at once. The rays should
+ * 				be close together (e.g. adjacent launch angles), so that they pass through mostly the same cells.
+ * 				pFound[i] says whether pHits[i] was filled in.
+ */
+void EdgeGrid::FindNearestHits( const LineSegment *rays, unsigned int count, Real minDistance, long ignoreBuilding, Hit *pHits, bool *pFound ) const {
+
+	PacketState state;
+	int x[EDGEGRID_PACKET_SIZE], y[EDGEGRID_PACKET_SIZE], stepX[EDGEGRID_PACKET_SIZE], stepY[EDGEGRID_PACKET_SIZE];
+	Real tMaxX[EDGEGRID_PACKET_SIZE], tMaxY[EDGEGRID_PACKET_SIZE], tDeltaX[EDGEGRID_PACKET_SIZE], tDeltaY[EDGEGRID_PACKET_SIZE];
+	Real tEntry[EDGEGRID_PACKET_SIZE], tExit[EDGEGRID_PACKET_SIZE], length[EDGEGRID_PACKET_SIZE];
+	bool active[EDGEGRID_PACKET_SIZE];
+
+	// Set up a DDA for each ray, exactly as FindNearestHit does. Unused lanes get a zero length
+	// ray, which can never cross an edge.
+	for ( unsigned int i = 0; i < EDGEGRID_PACKET_SIZE; i++ ) {
+
+		LineSegment ray = ( i < count ? rays[i] : LineSegment() );
+		Vector2D d = ray.GetVector();
+		state.mStartX[i] = ray.mStart.x;
+		state.mStartY[i] = ray.mStart.y;
+		state.mEndX[i] = ray.mEnd.x;
+		state.mEndY[i] = ray.mEnd.y;
+		state.mDmin[i] = DBL_MAX;
+		state.mHitX[i] = state.mHitY[i] = state.mHitEdge[i] = 0;
+		length[i] = d.Magnitude();
+		if ( i < count )
+			pFound[i] = false;
+
+		active[i] = ( i < count && !mEdges.empty() && length[i] != 0 && ClipRay( ray, &tEntry[i], &tExit[i] ) );
+		if ( !active[i] )
+			continue;
+
+		Vector2D p = ray.mStart + d * tEntry[i];
+		x[i] = MIN( MAX( (int)floor( ( p.x - mOrigin.x ) / mCellSize ), 0 ), mCellsX-1 );
+		y[i] = MIN( MAX( (int)floor( ( p.y - mOrigin.y ) / mCellSize ), 0 ), mCellsY-1 );
+		stepX[i] = ( d.x > 0 ? 1 : ( d.x < 0 ? -1 : 0 ) );
+		stepY[i] = ( d.y > 0 ? 1 : ( d.y < 0 ? -1 : 0 ) );
+		tMaxX[i] = ( stepX[i] != 0 ? ( mOrigin.x + ( x[i] + ( stepX[i] > 0 ) ) * mCellSize - ray.mStart.x ) / d.x : DBL_MAX );
+		tMaxY[i] = ( stepY[i] != 0 ? ( mOrigin.y + ( y[i] + ( stepY[i] > 0 ) ) * mCellSize - ray.mStart.y ) / d.y : DBL_MAX );
+		tDeltaX[i] = ( stepX[i] != 0 ? mCellSize / fabs( d.x ) : DBL_MAX );
+		tDeltaY[i] = ( stepY[i] != 0 ? mCellSize / fabs( d.y ) : DBL_MAX );
+
+	}
+
+	int recent[EDGEGRID_RECENT_CELLS];
+	unsigned int recentNext = 0;
+	std::fill( recent, recent + EDGEGRID_RECENT_CELLS, -1 );
+
+	while ( 1 ) {
+
+		// Always move on the ray whose next cell is nearest, so the cells are tested roughly
+		// near to far and the hit distances shrink as early as possible.
+		int r = -1;
+		for ( unsigned int i = 0; i < EDGEGRID_PACKET_SIZE; i++ ) {
+			if ( active[i] && ( r < 0 || tEntry[i] * length[i] < tEntry[r] * length[r] ) )
+				r = i;
+		}
+		if ( r < 0 )
+			break;
+
+		// Every cell from here on is beyond the nearest hit this ray already has.
+		if ( state.mDmin[r] <= tEntry[r] * length[r] ) {
+			active[r] = false;
+			continue;
+		}
+
+		// Neighbouring rays mostly cross the same cells, so skip any we've just done.
+		// Testing the rays against cells they don't cross is harmless: any hit is still a real crossing.
+		int cell = y[r]*mCellsX + x[r];
+		if ( std::find( recent, recent + EDGEGRID_RECENT_CELLS, cell ) == recent + EDGEGRID_RECENT_CELLS ) {
+			IntersectCell( cell, minDistance, ignoreBuilding, &state );
+			recent[recentNext] = cell;
+			recentNext = ( recentNext + 1 ) % EDGEGRID_RECENT_CELLS;
+		}
+
+		Real tNext = MIN( tMaxX[r], tMaxY[r] );
+		if ( tNext >= tExit[r] ) {
+			active[r] = false;
+			continue;
+		}
+
+		if ( tMaxX[r] < tMaxY[r] ) {
+			x[r] += stepX[r];
+			tMaxX[r] += tDeltaX[r];
+		} else {
+			y[r] += stepY[r];
+			tMaxY[r] += tDeltaY[r];
+		}
+		tEntry[r] = tNext;
+
+		if ( x[r] < 0 || x[r] >= mCellsX || y[r] < 0 || y[r] >= mCellsY )
+			active[r] = false;
+
+	}
+
+	for ( unsigned int i = 0; i < count; i++ ) {
+		if ( state.mDmin[i] == DBL_MAX )
+			continue;
+		pFound[i] = true;
+		pHits[i].mPoint = Vector2D( state.mHitX[i], state.mHitY[i] );
+		pHits[i].mDistance = state.mDmin[i];
+		pHits[i].mEdgeIndex = (unsigned int)state.mHitEdge[i];
+	}
+
+}
+
+
+
+/*
+ * Method: void IntersectCell( int cell, VectorMath::Real minDistance, long ignoreBuilding, PacketState *pState ) const;
+ * Description: Tests every ray in the packet against every edge in the cell, keeping the nearest hit for each ray.
+ */
+void EdgeGrid::IntersectCell( int cell, Real minDistance, long ignoreBuilding, PacketState *pState ) const {
+
+#ifdef __AVX2__
+
+	// One ray per lane, with each edge broadcast across the lanes. The arithmetic follows
+	// LineSegment::IntersectLine step for step, so the hits match the single ray path exactly.
+	__m256d r0x = _mm256_loadu_pd( pState->mStartX );
+	__m256d r0y = _mm256_loadu_pd( pState->mStartY );
+	__m256d r1x = _mm256_loadu_pd( pState->mEndX );
+	__m256d r1y = _mm256_loadu_pd( pState->mEndY );
+	__m256d vx = _mm256_sub_pd( r1x, r0x );
+	__m256d vy = _mm256_sub_pd( r1y, r0y );
+	__m256d dmin = _mm256_loadu_pd( pState->mDmin );
+	__m256d hitX = _mm256_loadu_pd( pState->mHitX );
+	__m256d hitY = _mm256_loadu_pd( pState->mHitY );
+	__m256d hitEdge = _mm256_loadu_pd( pState->mHitEdge );
+	__m256d minDist = _mm256_set1_pd( minDistance );
+
+	for ( unsigned int i = mCellStart[cell]; i < mCellStart[cell+1]; i++ ) {
+
+		if ( mCellBuilding[i] == ignoreBuilding )
+			continue;
+
+		__m256d p0x = _mm256_set1_pd( mCellX0[i] );
+		__m256d p0y = _mm256_set1_pd( mCellY0[i] );
+		__m256d p1x = _mm256_set1_pd( mCellX1[i] );
+		__m256d p1y = _mm256_set1_pd( mCellY1[i] );
+
+		// the edge's ends are on opposite sides of the ray, and the ray's ends on opposite sides of the edge
+		__m256d c1a = _mm256_cmp_pd( _mm256_mul_pd( _mm256_sub_pd( r1y, p0y ), _mm256_sub_pd( r0x, p0x ) ),
+									 _mm256_mul_pd( _mm256_sub_pd( r0y, p0y ), _mm256_sub_pd( r1x, p0x ) ), _CMP_GT_OQ );
+		__m256d c1b = _mm256_cmp_pd( _mm256_mul_pd( _mm256_sub_pd( r1y, p1y ), _mm256_sub_pd( r0x, p1x ) ),
+									 _mm256_mul_pd( _mm256_sub_pd( r0y, p1y ), _mm256_sub_pd( r1x, p1x ) ), _CMP_GT_OQ );
+		__m256d c2a = _mm256_cmp_pd( _mm256_mul_pd( _mm256_sub_pd( r0y, p0y ), _mm256_sub_pd( p1x, p0x ) ),
+									 _mm256_mul_pd( _mm256_sub_pd( p1y, p0y ), _mm256_sub_pd( r0x, p0x ) ), _CMP_GT_OQ );
+		__m256d c2b = _mm256_cmp_pd( _mm256_mul_pd( _mm256_sub_pd( r1y, p0y ), _mm256_sub_pd( p1x, p0x ) ),
+									 _mm256_mul_pd( _mm256_sub_pd( p1y, p0y ), _mm256_sub_pd( r1x, p0x ) ), _CMP_GT_OQ );
+		__m256d crossing = _mm256_and_pd( _mm256_xor_pd( c1a, c1b ), _mm256_xor_pd( c2a, c2b ) );
+		if ( _mm256_movemask_pd( crossing ) == 0 )
+			continue;
+
+		__m256d ux = _mm256_sub_pd( p0x, p1x );
+		__m256d uy = _mm256_sub_pd( p0y, p1y );
+		__m256d wx = _mm256_sub_pd( p0x, r0x );
+		__m256d wy = _mm256_sub_pd( p0y, r0y );
+		__m256d t = _mm256_div_pd( _mm256_sub_pd( _mm256_mul_pd( ux, wy ), _mm256_mul_pd( uy, wx ) ),
+								   _mm256_sub_pd( _mm256_mul_pd( ux, vy ), _mm256_mul_pd( uy, vx ) ) );
+		__m256d px = _mm256_add_pd( r0x, _mm256_mul_pd( vx, t ) );
+		__m256d py = _mm256_add_pd( r0y, _mm256_mul_pd( vy, t ) );
+		__m256d dx = _mm256_sub_pd( r0x, px );
+		__m256d dy = _mm256_sub_pd( r0y, py );
+		__m256d dist = _mm256_sqrt_pd( _mm256_add_pd( _mm256_mul_pd( dx, dx ), _mm256_mul_pd( dy, dy ) ) );
+
+		__m256d closer = _mm256_and_pd( crossing, _mm256_and_pd( _mm256_cmp_pd( dist, minDist, _CMP_GE_OQ ), _mm256_cmp_pd( dist, dmin, _CMP_LT_OQ ) ) );
+		dmin = _mm256_blendv_pd( dmin, dist, closer );
+		hitX = _mm256_blendv_pd( hitX, px, closer );
+		hitY = _mm256_blendv_pd( hitY, py, closer );
+		hitEdge = _mm256_blendv_pd( hitEdge, _mm256_set1_pd( mCellEdges[i] ), closer );
+
+	}
+
+	_mm256_storeu_pd( pState->mDmin, dmin );
+	_mm256_storeu_pd( pState->mHitX, hitX );
+	_mm256_storeu_pd( pState->mHitY, hitY );
+	_mm256_storeu_pd( pState->mHitEdge, hitEdge );
+
+#else
+
+	Vector2D temp;
+	for ( unsigned int i = mCellStart[cell]; i < mCellStart[cell+1]; i++ ) {
+
+		if ( mCellBuilding[i] == ignoreBuilding )
+			continue;
+
+		LineSegment line = mEdges[ mCellEdges[i] ].mLine;
+		for ( unsigned int r = 0; r < EDGEGRID_PACKET_SIZE; r++ ) {
+
+			LineSegment ray( Vector2D( pState->mStartX[r], pState->mStartY[r] ), Vector2D( pState->mEndX[r], pState->mEndY[r] ) );
+			if ( !line.IntersectLine( ray, &temp ) )
+				continue;
+
+			Real dist = ( ray.mStart - temp ).Magnitude();
+			if ( dist >= minDistance && dist < pState->mDmin[r] ) {
+				pState->mDmin[r] = dist;
+				pState->mHitX[r] = temp.x;
+				pState->mHitY[r] = temp.y;
+				pState->mHitEdge[r] = mCellEdges[i];
+			}
+
+		}
+
+	}
+
+#endif // #ifdef __AVX2__
+
+}
+
+
+
+/*
+ * Method: void FindEdgesNear( VectorMath::Vector2D centre, VectorMath::Real radius, std::vector<unsigned int> *pEdges ) const;
+ * Description: Gets the indices (ascending, without repeats) of every edge that comes within radius of the centre.
+ */
+void EdgeGrid::FindEdgesNear( Vector2D centre, Real radius, std::vector<unsigned int> *pEdges ) const {
+
+	pEdges->clear();
+	if ( mEdges.empty() )
+		return;
+
+	int x0 = MAX( (int)floor( ( centre.x - radius - mOrigin.x ) / mCellSize ), 0 );
+	int y0 = MAX( (int)floor( ( centre.y - radius - mOrigin.y ) / mCellSize ), 0 );
+	int x1 = MIN( (int)floor( ( centre.x + radius - mOrigin.x ) / mCellSize ), mCellsX-1 );
+	int y1 = MIN( (int)floor( ( centre.y + radius - mOrigin.y ) / mCellSize ), mCellsY-1 );
+	for ( int y = y0; y <= y1; y++ )
+		for ( int x = x0; x <= x1; x++ )
+			for ( unsigned int i = mCellStart[ y*mCellsX + x ]; i < mCellStart[ y*mCellsX + x + 1 ]; i++ )
+				pEdges->push_back( mCellEdges[i] );
+
+	std::sort( pEdges->begin(), pEdges->end() );
+	pEdges->erase( std::unique( pEdges->begin(), pEdges->end() ), pEdges->end() );
+
+	// the cells are only a box around the circle; drop the edges that don't actually reach it
+	unsigned int kept = 0;
+	for ( unsigned int i = 0; i < pEdges->size(); i++ ) {
+		LineSegment line = mEdges[ (*pEdges)[i] ].mLine;
+		if ( line.DistanceFromPoint( centre ) <= radius )
+			(*pEdges)[kept++] = (*pEdges)[i];
+	}
+	pEdges->resize( kept );
+
+}
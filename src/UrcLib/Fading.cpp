@@ -73,8 +73,11 @@ Fading::Fading(const char* componentsFile, int seed) {
 		mComponents2.push_back(temp);
 	}
 	
-	random_shuffle(mComponents1.begin(), mComponents1.end());
-	random_shuffle(mComponents2.begin(), mComponents2.end());
+	// the components are only ever read through the sample table, so lay them out for the hot path
+	if (posix_memalign((void**)&mSamples, FADING_TABLE_ALIGNMENT, mNumGaussianComponents*sizeof(GaussianSample)) != 0) {
+		THROW_EXCEPTION("Could not allocate fading table of %d samples\n", mNumGaussianComponents);
+	}
+	BuildSampleTable();
 	mCurrentIndex = 0;
 	pthread_mutex_init(&mListMutex, NULL);
 	
@@ -84,36 +87,43 @@ Fading::Fading(const char* componentsFile, int seed) {
 
 Fading::~Fading() {
 	pthread_mutex_destroy(&mListMutex);
+	free(mSamples);
 }
-	
 
-void Fading::SetArrayIdx() {
-	if (mCurrentIndex < mNumGaussianComponents) {
-		//just increment the array index
-		pthread_mutex_lock(&mListMutex);
-		++mCurrentIndex;
-		pthread_mutex_unlock(&mListMutex);
-	} else {
+
+void Fading::BuildSampleTable() {
+	random_shuffle(mComponents1.begin(), mComponents1.end());
+	random_shuffle(mComponents2.begin(), mComponents2.end());
+	for (int i=0; i<mNumGaussianComponents; i++) {
+		double c1 = mComponents1[i], c2 = mComponents2[i];
+		mSamples[i].mRayleighPower = (c1*c1 + c2*c2) / 2;
+		mSamples[i].mRicianTerm = M_SQRT2 * c1;
+	}
+}
+
+
+Fading::GaussianSample Fading::NextSample() {
+	pthread_mutex_lock(&mListMutex);
+	if (mCurrentIndex >= mNumGaussianComponents) {
 		//reset the index to 0 and reshuffle the array
-		pthread_mutex_lock(&mListMutex);
 		mCurrentIndex = 0;
-		random_shuffle(mComponents1.begin(), mComponents1.end());
-		random_shuffle(mComponents2.begin(), mComponents2.end());
-		pthread_mutex_unlock(&mListMutex);
+		BuildSampleTable();
 	}
+	GaussianSample sample = mSamples[mCurrentIndex++];
+	pthread_mutex_unlock(&mListMutex);
+	return sample;
 }
 
 double Fading::CalculateFading(int classification, double kFactor) {
 	if ( kFactor == DBL_MAX )
 		return 1;
 	if (classification == 0) {
-		//rician fading for LOS		
-		SetArrayIdx();
-		return ((pow((mComponents1[mCurrentIndex]+sqrt(2.0*kFactor)),2)+pow(mComponents2[mCurrentIndex],2))/(2*(kFactor+1)));
+		//rician fading for LOS
+		GaussianSample g = NextSample();
+		return (g.mRayleighPower + g.mRicianTerm*sqrt(kFactor) + kFactor) / (kFactor + 1);
 	} else if (classification <= 2) {
 		//rayleigh fading for NLOS1/2
-		SetArrayIdx();
-		return ((pow(mComponents1[mCurrentIndex],2)+pow(mComponents2[mCurrentIndex],2))/2);
+		return NextSample().mRayleighPower;
 	} else {
 		return 0;
 	}
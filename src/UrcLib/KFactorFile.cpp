@@ -0,0 +1,429 @@
+/*
+ *  KFactorFile.cpp - Binary file of pre-computed K-factors
+ *  Copyright (C) 2012  C. S. Cooper, A. Mukunthan
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Contact Details: Cooper - andor734@gmail.com
+ */
+
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Singleton.h"
+#include "VectorMath.h"
+#include "UrcData.h"
+#include "KFactorFile.h"
+
+using namespace std;
+using namespace VectorMath;
+using namespace Urc;
+
+
+// what follows a K-factor's tag byte
+enum KTag {
+	K_ZERO = 0,			// nothing: K is 0 (Rayleigh)
+	K_INFINITE,			// nothing: K is infinite (DBL_MAX)
+	K_VALUE				// the K-factor, as a double
+};
+
+
+// orders index entries by link
+static bool IndexEntryBefore( const KFactorFile::IndexEntry &a, const KFactorFile::IndexEntry &b ) {
+	return a.mLink < b.mLink;
+}
+
+
+// Counts (and link indices) are written 7 bits to a byte, low bits first, the top bit set on all but the last.
+static void AppendCount( std::vector<char> *pRecord, unsigned int count ) {
+	while ( count >= 0x80 ) {
+		pRecord->push_back( (char)( ( count & 0x7f ) | 0x80 ) );
+		count >>= 7;
+	}
+	pRecord->push_back( (char)count );
+}
+
+
+// The file isn't trusted: anything that would run past the end of its record throws.
+static unsigned int TakeCount( const char **pp, const char *end ) {
+	unsigned int count = 0;
+	for ( int shift = 0; ; shift += 7 ) {
+		if ( *pp >= end || shift > 28 ) {
+			THROW_EXCEPTION( "Malformed record in K-factor file." );
+		}
+		unsigned char c = *(*pp)++;
+		count |= (unsigned int)( c & 0x7f ) << shift;
+		if ( !( c & 0x80 ) )
+			break;
+	}
+	return count;
+}
+
+
+// The length of a list, each item of which takes at least a byte of what's left of the record.
+static unsigned int TakeLength( const char **pp, const char *end ) {
+	unsigned int length = TakeCount( pp, end );
+	if ( length > (size_t)( end - *pp ) ) {
+		THROW_EXCEPTION( "Malformed record in K-factor file." );
+	}
+	return length;
+}
+
+
+// Most K-factors are Rayleigh (0), so those take a single byte.
+static void AppendK( std::vector<char> *pRecord, double k ) {
+	if ( k == 0 ) {
+		pRecord->push_back( K_ZERO );
+	} else if ( k == DBL_MAX ) {
+		pRecord->push_back( K_INFINITE );
+	} else {
+		pRecord->push_back( K_VALUE );
+		pRecord->insert( pRecord->end(), (const char*)&k, (const char*)&k + sizeof(k) );
+	}
+}
+
+
+// The values may not be aligned in the record, so they're copied out rather than cast.
+static double TakeK( const char **pp, const char *end ) {
+	if ( *pp >= end ) {
+		THROW_EXCEPTION( "Malformed record in K-factor file." );
+	}
+	char tag = *(*pp)++;
+	if ( tag == K_ZERO )
+		return 0;
+	if ( tag == K_INFINITE )
+		return DBL_MAX;
+	if ( tag != K_VALUE || end - *pp < (ptrdiff_t)sizeof(double) ) {
+		THROW_EXCEPTION( "Malformed record in K-factor file." );
+	}
+	double k;
+	memcpy( &k, *pp, sizeof(k) );
+	*pp += sizeof(k);
+	return k;
+}
+
+
+/*
+ * Method: static bool IsKFactorFile( const char *filename );
+ * Description: Whether the file starts like a binary K-factor file (as opposed to a text one).
+ */
+bool KFactorFile::IsKFactorFile( const char *filename ) {
+
+	FILE *pFile = fopen( filename, "rb" );
+	if ( !pFile )
+		return false;
+
+	char magic[4];
+	bool isBinary = ( fread( magic, 1, 4, pFile ) == 4 && memcmp( magic, KFACTORFILE_MAGIC, 4 ) == 0 );
+	fclose( pFile );
+	return isBinary;
+
+}
+
+
+
+/*
+ * Constructor arguments:
+ * 		1. Filename - file to create (or overwrite)
+ * 		2. Reciprocal - whether the K-factors were computed in reciprocal mode
+ * 		3. Increment - distance between positions along the links
+ */
+KFactorWriter::KFactorWriter( const char *filename, bool reciprocal, Real increment ) {
+
+	m_pFile = fopen( filename, "wb" );
+	if ( !m_pFile ) {
+		THROW_EXCEPTION( "Cannot create K-factor file: %s", filename );
+	}
+
+	KFactorFile::Header header;
+	memcpy( header.mMagic, KFACTORFILE_MAGIC, 4 );
+	header.mVersion = KFACTORFILE_VERSION;
+	header.mFlags = ( reciprocal ? KFACTORFILE_RECIPROCAL : 0 );
+	header.mUnused = 0;
+	header.mIncrement = increment;
+
+	mOffset = 0;
+	Write( &header, sizeof(header) );
+
+}
+
+
+/*
+ * Constructor arguments:
+ * 		1. Filename - file left part written (not closed) by an earlier writer
+ * 		2. Records - the complete records in it to keep. Anything after the last of them is cut off,
+ * 					 and writing carries on from there. Throws if the file doesn't hold them.
+ */
+KFactorWriter::KFactorWriter( const char *filename, const std::vector<KFactorFile::IndexEntry> &records ) : mIndex( records ) {
+
+	m_pFile = fopen( filename, "r+b" );
+	if ( !m_pFile ) {
+		THROW_EXCEPTION( "Cannot open K-factor file: %s", filename );
+	}
+
+	// The records are written one after another, so the last one kept ends where writing goes on from.
+	mOffset = sizeof(KFactorFile::Header);
+	std::vector<KFactorFile::IndexEntry>::const_iterator recordIt;
+	for ( AllInVector( recordIt, records ) ) {
+		if ( recordIt->mOffset + recordIt->mSize > mOffset )
+			mOffset = recordIt->mOffset + recordIt->mSize;
+	}
+
+	KFactorFile::Header header;
+	struct stat st;
+	if ( fread( &header, sizeof(header), 1, m_pFile ) != 1 || memcmp( header.mMagic, KFACTORFILE_MAGIC, 4 ) != 0
+		|| header.mVersion != KFACTORFILE_VERSION || fstat( fileno( m_pFile ), &st ) != 0 || (uint64_t)st.st_size < mOffset ) {
+		fclose( m_pFile );
+		m_pFile = NULL;
+		THROW_EXCEPTION( "K-factor file doesn't hold the records to keep: %s", filename );
+	}
+
+	if ( ftruncate( fileno( m_pFile ), mOffset ) != 0 || fseeko( m_pFile, mOffset, SEEK_SET ) != 0 ) {
+		fclose( m_pFile );
+		m_pFile = NULL;
+		THROW_EXCEPTION( "Cannot cut back K-factor file: %s", filename );
+	}
+
+}
+
+
+KFactorWriter::~KFactorWriter() {
+
+	if ( m_pFile )
+		fclose( m_pFile );
+
+}
+
+
+/*
+ * Method: void Write( const void *pData, size_t size );
+ * Description: Appends raw bytes to the file.
+ */
+void KFactorWriter::Write( const void *pData, size_t size ) {
+
+	fwrite( pData, 1, size, m_pFile );
+	mOffset += size;
+
+}
+
+
+/*
+ * Method: KFactorFile::IndexEntry WriteLink( int linkIndex, const UrcData::SourceLocationList &srcLocList );
+ * Description: Appends one source link's K-factors as a record, and returns where it was put.
+ */
+KFactorFile::IndexEntry KFactorWriter::WriteLink( int linkIndex, const UrcData::SourceLocationList &srcLocList ) {
+
+	KFactorFile::IndexEntry entry;
+	entry.mLink = linkIndex;
+	entry.mUnused = 0;
+	entry.mOffset = mOffset;
+
+	// The record is put together in memory, so it goes to the file in one write.
+	std::vector<char> record;
+	AppendCount( &record, srcLocList.size() );
+	UrcData::SourceLocationList::const_iterator srcLocIt;
+	for ( AllInVector( srcLocIt, srcLocList ) ) {
+
+		AppendCount( &record, srcLocIt->size() );
+		UrcData::SourceLaneList::const_iterator srcLaneIt;
+		for ( AllInVector( srcLaneIt, (*srcLocIt) ) ) {
+
+			AppendCount( &record, srcLaneIt->size() );
+			UrcData::DestinationLookup::const_iterator destIt;
+			for ( AllInVector( destIt, (*srcLaneIt) ) ) {
+
+				AppendCount( &record, destIt->first );
+				AppendCount( &record, destIt->second.size() );
+				UrcData::DestinationLocationList::const_iterator destLocIt;
+				for ( AllInVector( destLocIt, destIt->second ) ) {
+
+					AppendCount( &record, destLocIt->size() );
+					UrcData::DestinationLaneList::const_iterator destLaneIt;
+					for ( AllInVector( destLaneIt, (*destLocIt) ) )
+						AppendK( &record, *destLaneIt );
+
+				}
+
+			}
+
+		}
+
+	}
+
+	Write( &record[0], record.size() );
+	entry.mSize = record.size();
+	mIndex.push_back( entry );
+	return entry;
+
+}
+
+
+/*
+ * Method: bool Flush();
+ * Description: Pushes the records written so far out to the file. Returns false if that failed.
+ */
+bool KFactorWriter::Flush() {
+
+	return fflush( m_pFile ) == 0 && ferror( m_pFile ) == 0;
+
+}
+
+
+/*
+ * Method: void Close();
+ * Description: Writes the index and footer and closes the file. Throws if anything failed to be written.
+ */
+void KFactorWriter::Close() {
+
+	if ( !m_pFile )
+		return;
+
+	std::sort( mIndex.begin(), mIndex.end(), IndexEntryBefore );
+
+	KFactorFile::Footer footer;
+	footer.mIndexOffset = mOffset;
+	footer.mCount = mIndex.size();
+	memcpy( footer.mMagic, KFACTORFILE_INDEX_MAGIC, 4 );
+
+	if ( !mIndex.empty() )
+		Write( &mIndex[0], mIndex.size() * sizeof(KFactorFile::IndexEntry) );
+	Write( &footer, sizeof(footer) );
+
+	bool failed = ( ferror( m_pFile ) != 0 );
+	failed = ( fclose( m_pFile ) != 0 ) || failed;
+	m_pFile = NULL;
+	if ( failed ) {
+		THROW_EXCEPTION( "Could not write the K-factor file." );
+	}
+
+}
+
+
+
+/*
+ * Constructor arguments:
+ * 		1. Filename - file to map. Throws if it can't be mapped, or isn't a complete K-factor file
+ * 					  with every record inside it.
+ */
+KFactorReader::KFactorReader( const char *filename ) {
+
+	int fd = open( filename, O_RDONLY );
+	if ( fd < 0 ) {
+		THROW_EXCEPTION( "Cannot open K-factor file: %s", filename );
+	}
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size < (off_t)( sizeof(KFactorFile::Header) + sizeof(KFactorFile::Footer) ) ) {
+		close( fd );
+		THROW_EXCEPTION( "K-factor file is too short: %s", filename );
+	}
+
+	mSize = st.st_size;
+	void *pMap = mmap( NULL, mSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( pMap == MAP_FAILED ) {
+		THROW_EXCEPTION( "Cannot map K-factor file: %s", filename );
+	}
+	m_pData = (const char*)pMap;
+
+	KFactorFile::Footer footer;
+	memcpy( &mHeader, m_pData, sizeof(mHeader) );
+	memcpy( &footer, m_pData + mSize - sizeof(footer), sizeof(footer) );
+	if ( memcmp( mHeader.mMagic, KFACTORFILE_MAGIC, 4 ) != 0 || mHeader.mVersion != KFACTORFILE_VERSION
+		|| memcmp( footer.mMagic, KFACTORFILE_INDEX_MAGIC, 4 ) != 0
+		|| footer.mIndexOffset < sizeof(KFactorFile::Header) || footer.mIndexOffset > mSize
+		|| footer.mCount > ( mSize - footer.mIndexOffset ) / sizeof(KFactorFile::IndexEntry)
+		|| footer.mIndexOffset + (uint64_t)footer.mCount * sizeof(KFactorFile::IndexEntry) + sizeof(footer) != mSize ) {
+		munmap( (void*)m_pData, mSize );
+		THROW_EXCEPTION( "Not a complete K-factor file: %s", filename );
+	}
+
+	mIndex.resize( footer.mCount );
+	if ( footer.mCount > 0 )
+		memcpy( &mIndex[0], m_pData + footer.mIndexOffset, footer.mCount * sizeof(KFactorFile::IndexEntry) );
+
+	// Every record has to lie between the header and the index.
+	std::vector<KFactorFile::IndexEntry>::const_iterator entryIt;
+	for ( AllInVector( entryIt, mIndex ) ) {
+		if ( entryIt->mLink < 0 || entryIt->mOffset < sizeof(KFactorFile::Header) || entryIt->mOffset > footer.mIndexOffset
+			|| entryIt->mSize > footer.mIndexOffset - entryIt->mOffset ) {
+			munmap( (void*)m_pData, mSize );
+			THROW_EXCEPTION( "K-factor file's index is corrupt: %s", filename );
+		}
+	}
+	std::sort( mIndex.begin(), mIndex.end(), IndexEntryBefore );
+
+}
+
+
+KFactorReader::~KFactorReader() {
+
+	munmap( (void*)m_pData, mSize );
+
+}
+
+
+/*
+ * Method: bool ReadLink( int linkIndex, UrcData::SourceLocationList *pSrcLocList ) const;
+ * Description: Decodes the given source link's K-factors. Returns false if the file has none for it, and
+ * 				throws if its record is malformed.
+ */
+bool KFactorReader::ReadLink( int linkIndex, UrcData::SourceLocationList *pSrcLocList ) const {
+
+	KFactorFile::IndexEntry key;
+	key.mLink = linkIndex;
+	std::vector<KFactorFile::IndexEntry>::const_iterator it = std::lower_bound( mIndex.begin(), mIndex.end(), key, IndexEntryBefore );
+	if ( it == mIndex.end() || it->mLink != linkIndex )
+		return false;
+
+	const char *p = m_pData + it->mOffset;
+	const char *end = p + it->mSize;
+	pSrcLocList->assign( TakeLength( &p, end ), UrcData::SourceLaneList() );
+	UrcData::SourceLocationList::iterator srcLocIt;
+	for ( AllInVector( srcLocIt, (*pSrcLocList) ) ) {
+
+		srcLocIt->resize( TakeLength( &p, end ) );
+		UrcData::SourceLaneList::iterator srcLaneIt;
+		for ( AllInVector( srcLaneIt, (*srcLocIt) ) ) {
+
+			unsigned int destCount = TakeLength( &p, end );
+			for ( unsigned int d = 0; d < destCount; d++ ) {
+
+				int destLink = TakeCount( &p, end );
+				UrcData::DestinationLocationList &destLocList = (*srcLaneIt)[destLink];
+				destLocList.resize( TakeLength( &p, end ) );
+				UrcData::DestinationLocationList::iterator destLocIt;
+				for ( AllInVector( destLocIt, destLocList ) ) {
+
+					destLocIt->resize( TakeLength( &p, end ) );
+					UrcData::DestinationLaneList::iterator destLaneIt;
+					for ( AllInVector( destLaneIt, (*destLocIt) ) )
+						*destLaneIt = TakeK( &p, end );
+
+				}
+
+			}
+
+		}
+
+	}
+
+	return true;
+
+}
@@ -21,6 +21,7 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <iterator>
 #include <vector>
 #include <cfloat>
 #include <string>
@@ -32,6 +33,8 @@
 #include "VectorMath.h"
 #include "UrcData.h"
 #include "Classifier.h"
+#include "EdgeGrid.h"
+#include "KFactorFile.h"
 
 using namespace std;
 using namespace VectorMath;
@@ -41,6 +44,12 @@ using namespace Urc;
 DECLARE_SINGLETON( UrcData );
 
 
+// orders K-factor runs by where they end
+static bool RunEndsBefore( const UrcData::KRun &a, const UrcData::KRun &b ) {
+	return a.mEnd < b.mEnd;
+}
+
+
 
 
 
@@ -98,6 +107,9 @@ UrcData::UrcData( VectorMath::Real laneWidth, VectorMath::Real lambda, VectorMat
 	mBucketSize = grid;
 	mLambdaBy4PiSq = pow( mWavelength / (4 * M_PI), 2 );
 	mFreeSpaceRange = ( mWavelength / ( 4 * M_PI ) ) * sqrt( mTransmitPower / ( mSystemLoss * mSensitivity ) );
+	mEdgeGrid = NULL;
+	mReciprocalK = false;
+	mInterpolateK = false;
 
 }
 
@@ -141,9 +153,13 @@ UrcData::UrcData(
 	mLambdaBy4PiSq = pow( mWavelength / (4 * M_PI), 2 );
 	mFreeSpaceRange = sqrt( mLambdaBy4PiSq * mTransmitPower / ( mSystemLoss * mSensitivity ) );
 
+	mEdgeGrid = NULL;
+	mReciprocalK = false;
+	mInterpolateK = false;
 	LoadNetwork( linksFile, nodesFile, classFile, buildingFile, linkMapFile, NULL, NULL, NULL );
 	ComputeSummedLinkSet();
 	ComputeBuckets();
+	ComputeEdgeGrid();
 
 }
 
@@ -194,6 +210,9 @@ UrcData::UrcData(
 	mLambdaBy4PiSq = pow( mWavelength / (4 * M_PI), 2 );
 	mFreeSpaceRange = sqrt( mLambdaBy4PiSq * mTransmitPower / ( mSystemLoss * mSensitivity ) );
 
+	mEdgeGrid = NULL;
+	mReciprocalK = false;
+	mInterpolateK = false;
 	LoadNetwork( linksFile, nodesFile, classFile, NULL, linkMapFile, intLinkMapFile, riceDataFile, carDefFile );
 	ComputeSummedLinkSet();
 	ComputeBuckets();
@@ -208,6 +227,7 @@ UrcData::~UrcData() {
 	mSummedLinkSet.clear();
 	mClassificationMap.clear();
 	mBuildingSet.clear();
+	delete mEdgeGrid;
 
 }
 
@@ -343,6 +363,59 @@ UrcData::Classification UrcData::GetClassification( std::string link1, std::stri
 
 
 
+/*
+ * Method: void GetLinkNeighbours( VectorMath::Real range, std::vector< std::vector<int> > *pNeighbours );
+ * Description: For every summed link, gets the links (ascending) that any of its lanes could reach in LOS.
+ */
+void UrcData::GetLinkNeighbours( Real range, std::vector< std::vector<int> > *pNeighbours ) {
+
+	int linkCount = GetSummedLinkCount();
+	pNeighbours->assign( linkCount, std::vector<int>() );
+
+	// Bounds of each link, grown by half its width so that the outermost lanes are inside.
+	std::vector<Rect> bounds( linkCount );
+	for ( int l = 0; l < linkCount; l++ ) {
+		Link *pLink = GetSummedLink( l );
+		LineSegment path( GetNode( pLink->nodeAindex )->position, GetNode( pLink->nodeBindex )->position );
+		Real halfWidth = pLink->NumberOfLanes*mLaneWidth*0.5;
+		Rect r( path );
+		bounds[l] = Rect( r.location - Vector2D( halfWidth, halfWidth ), r.size + Vector2D( halfWidth, halfWidth ) * 2 );
+	}
+
+	// Pairs missing from the map are out of range, so only the map needs looking at.
+	ClassificationMap::iterator cm;
+	for ( AllInVector( cm, mClassificationMap ) ) {
+
+		if ( cm->second.mClassification != Classifier::LOS && cm->second.mClassification != Classifier::NLOS1 && cm->second.mClassification != Classifier::NLOS2 )
+			continue;
+
+		int l1 = cm->first.first;
+		int l2 = cm->first.second;
+		if ( l1 < 0 || l2 < 0 || l1 >= linkCount || l2 >= linkCount )
+			continue;
+
+		// gap between the two rects along each axis
+		Rect &a = bounds[l1];
+		Rect &b = bounds[l2];
+		Real dx = MAX( 0, MAX( a.location.x - ( b.location.x + b.size.x ), b.location.x - ( a.location.x + a.size.x ) ) );
+		Real dy = MAX( 0, MAX( a.location.y - ( b.location.y + b.size.y ), b.location.y - ( a.location.y + a.size.y ) ) );
+		if ( dx*dx + dy*dy >= range*range )
+			continue;
+
+		(*pNeighbours)[l1].push_back( l2 );
+		if ( l2 != l1 )
+			(*pNeighbours)[l2].push_back( l1 );
+
+	}
+
+	for ( int l = 0; l < linkCount; l++ )
+		std::sort( (*pNeighbours)[l].begin(), (*pNeighbours)[l].end() );
+
+}
+
+
+
+
 /**
  *	Get the classification and k factor between the given points.
  */
@@ -415,8 +488,7 @@ void UrcData::RefineClassification( UrcData::Classification &cls, VectorMath::Ve
 
 		// Find the common link between them.
 		LinkIndexSet commonLinkSet;
-		LinkIndexSet::iterator linkIt = std::set_intersection( n1->mConnectedLinks.begin(), n1->mConnectedLinks.end(), n2->mConnectedLinks.begin(), n2->mConnectedLinks.end(), commonLinkSet.begin() );
-		commonLinkSet.resize( linkIt - commonLinkSet.begin() );
+		std::set_intersection( n1->mConnectedLinks.begin(), n1->mConnectedLinks.end(), n2->mConnectedLinks.begin(), n2->mConnectedLinks.end(), std::back_inserter( commonLinkSet ) );
 
 #ifdef DEBUG
 		if ( commonLinkSet.size() == 0 ) {
@@ -441,7 +513,7 @@ void UrcData::RefineClassification( UrcData::Classification &cls, VectorMath::Ve
 #endif // #ifdef DEBUG
 
 		// Calculate the minimum distance we need to be within.
-		Real dist = pow( GetSummedLink( *linkIt )->NumberOfLanes*mLaneWidth*0.5, 2 );
+		Real dist = pow( GetSummedLink( commonLinkSet.front() )->NumberOfLanes*mLaneWidth*0.5, 2 );
 
 		// Now work out how far from the nodes we are.
 		Real sDist, dDist;
@@ -470,6 +542,8 @@ void UrcData::RefineClassification( UrcData::Classification &cls, VectorMath::Ve
 /*
  * Method: VectorMath::Real GetK( LinkPair p, Vector2D srcPos, Vector2D destPos );
  * Description: Get the pre-computed k-factor between the given source and destination.
+ * 				If the data was computed in reciprocal mode, the lookup is turned around
+ * 				whenever the source link is above the destination link.
  */
 Real UrcData::GetK( OrderedIndexPair p, Vector2D srcPos, int srcLane, Vector2D destPos, int destLane, bool flipped ) {
 
@@ -477,42 +551,388 @@ Real UrcData::GetK( OrderedIndexPair p, Vector2D srcPos, int srcLane, Vector2D d
 	unsigned int sourceLink = ( flipped ? p.second :  p.first );
 	unsigned int destLink   = ( flipped ?  p.first : p.second );
 
+	// The channel is the same both ways, so only one direction was stored.
+	if ( mReciprocalK && sourceLink > destLink ) {
+		std::swap( sourceLink, destLink );
+		std::swap( srcPos, destPos );
+		std::swap( srcLane, destLane );
+	}
+
 	// Get pointers to the link data structures.
 	Link *pSource = GetSummedLink( sourceLink );
 	Link *pDest   = GetSummedLink(   destLink );
 
-	// Calculate how far along the links each position is. This rounds to nearest integer.
-	unsigned int sourcePos	   = floor( GetNode( pSource->nodeAindex )->position.Distance(  srcPos ) / mLengthIncrement + 0.5 );
-	unsigned int destinationPos = floor( GetNode(   pDest->nodeAindex )->position.Distance( destPos ) / mLengthIncrement + 0.5 );
-
 	// TODO: the lane indexing isn't quite right due to the summing of links in both directions.
 	// TODO: See if you can think of a way to fix this. Maybe rework the raytracer to consider links in both directions...
 
+	// Calculate how far along the links each position is. This rounds to nearest integer.
+	if ( !mInterpolateK ) {
+		unsigned int sourcePos	   = floor( GetNode( pSource->nodeAindex )->position.Distance(  srcPos ) / mLengthIncrement + 0.5 );
+		unsigned int destinationPos = floor( GetNode(   pDest->nodeAindex )->position.Distance( destPos ) / mLengthIncrement + 0.5 );
+		return LookupK( sourceLink, sourcePos, srcLane, destLink, destinationPos, destLane );
+	}
+
+	// Or take the four positions computed around the pair, weighted bilinearly.
+	unsigned int sourcePos0, destinationPos0;
+	Real sourceWeight, destinationWeight;
+	GetInterpolationPoint( pSource, srcPos, mLengthIncrement, &sourcePos0, &sourceWeight );
+	GetInterpolationPoint( pDest, destPos, mLengthIncrement, &destinationPos0, &destinationWeight );
+
+	Real k[4], weights[4];
+	for ( int corner = 0; corner < 4; corner++ ) {
+		weights[corner] = ( corner & 1 ? sourceWeight : 1 - sourceWeight ) * ( corner & 2 ? destinationWeight : 1 - destinationWeight );
+		k[corner] = ( weights[corner] > 0 ? LookupK( sourceLink, sourcePos0 + ( corner & 1 ), srcLane, destLink, destinationPos0 + ( corner >> 1 ), destLane ) : 0 );
+	}
+	return BlendK( k, weights, 4 );
+
+}
+
+
+/*
+ * Method: int FindRsu( const std::string &name, VectorMath::Vector2D position );
+ * Description: Get the index of the RSU with pre-computed K-factors by its name, or if the name is empty, the
+ * 				one within a lane width of the position. Returns -1 if there isn't one.
+ */
+int UrcData::FindRsu( const std::string &name, Vector2D position ) {
+
+	int nearest = -1;
+	Real nearestDistance = mLaneWidth;
+	for ( unsigned int r = 0; r < mRsuRiceFactors.size(); r++ ) {
+
+		if ( !name.empty() ) {
+			if ( mRsuRiceFactors[r].mName == name )
+				return r;
+			continue;
+		}
+
+		Real distance = mRsuRiceFactors[r].mPosition.Distance( position );
+		if ( distance <= nearestDistance ) {
+			nearest = r;
+			nearestDistance = distance;
+		}
+
+	}
+
+	return nearest;
+
+}
+
+
+/*
+ * Method: VectorMath::Real GetRsuK( int rsu, int destLink, VectorMath::Vector2D destPos, int destLane );
+ * Description: Get the pre-computed k-factor between an RSU (from FindRsu) and a position on a link. The
+ * 				channel is the same both ways, so this serves whether the RSU sends or receives.
+ */
+Real UrcData::GetRsuK( int rsu, int destLink, Vector2D destPos, int destLane ) {
+
+	if ( rsu < 0 || rsu >= (int)mRsuRiceFactors.size() )
+		return 0;	// Don't know this RSU, so assume Rayleigh.
+
+	RsuRiceFactors &rsuData = mRsuRiceFactors[rsu];
+	DestinationRunLookup::iterator destIt = rsuData.mDestinations.find( destLink );
+	if ( destIt == rsuData.mDestinations.end() )
+		return 0;	// No connection between the RSU and this link, so assume Rayleigh.
+
+	Link *pDest = GetSummedLink( destLink );
+	if ( !mInterpolateK ) {
+		unsigned int destinationPos = floor( GetNode( pDest->nodeAindex )->position.Distance( destPos ) / rsuData.mIncrement + 0.5 );
+		return LookupRun( destIt->second, destinationPos, destLane );
+	}
+
+	// Or the two positions computed either side, weighted linearly.
+	unsigned int destinationPos0;
+	Real destinationWeight;
+	GetInterpolationPoint( pDest, destPos, rsuData.mIncrement, &destinationPos0, &destinationWeight );
+
+	Real k[2], weights[2];
+	weights[0] = 1 - destinationWeight;
+	weights[1] = destinationWeight;
+	k[0] = LookupRun( destIt->second, destinationPos0, destLane );
+	k[1] = ( destinationWeight > 0 ? LookupRun( destIt->second, destinationPos0 + 1, destLane ) : 0 );
+	return BlendK( k, weights, 2 );
+
+}
+
+
+/*
+ * Method: void GetInterpolationPoint( Link *pLink, VectorMath::Vector2D position, VectorMath::Real increment, unsigned int *pIndex, VectorMath::Real *pWeight );
+ * Description: Finds the computed positions either side of the given one along a link: the index of the one before, and
+ * 				the weight of the one after. The position is measured along the link, so that a lane's offset to the side
+ * 				doesn't move it. Positions past the last one computed are given that one.
+ */
+void UrcData::GetInterpolationPoint( Link *pLink, Vector2D position, Real increment, unsigned int *pIndex, Real *pWeight ) {
+
+	Vector2D start = GetNode( pLink->nodeAindex )->position;
+	Vector2D dir = GetNode( pLink->nodeBindex )->position - start;
+	Real length = dir.Magnitude();
+	Real along = ( length > 0 ? MAX( ( position - start ).DotProduct( dir ) / length, 0 ) : 0 ) / increment;
+
+	unsigned int lastIndex = floor( length / increment );
+	*pIndex = floor( along );
+	*pWeight = along - *pIndex;
+	if ( *pIndex >= lastIndex ) {
+		*pIndex = lastIndex;
+		*pWeight = 0;
+	}
+
+}
+
+
+/*
+ * Method: static VectorMath::Real BlendK( const VectorMath::Real *pK, const VectorMath::Real *pWeights, int count );
+ * Description: The weighted average of K-factors, taken as logs, since they vary over orders of magnitude. Rayleigh (0)
+ * 				and pure LOS (infinite) have no log, so whichever of those or the finite K-factors has the most
+ * 				weight decides the result.
+ */
+Real UrcData::BlendK( const Real *pK, const Real *pWeights, int count ) {
+
+	Real zeroWeight = 0, finiteWeight = 0, infiniteWeight = 0;
+	Real logSum = 0;
+	for ( int i = 0; i < count; i++ ) {
+
+		if ( pWeights[i] <= 0 )
+			continue;
+
+		if ( pK[i] <= 0 )
+			zeroWeight += pWeights[i];
+		else if ( pK[i] == DBL_MAX )
+			infiniteWeight += pWeights[i];
+		else {
+			finiteWeight += pWeights[i];
+			logSum += pWeights[i] * log( pK[i] );
+		}
+
+	}
+
+	if ( finiteWeight > 0 && finiteWeight >= zeroWeight && finiteWeight >= infiniteWeight )
+		return exp( logSum / finiteWeight );
+	return ( infiniteWeight > zeroWeight ? DBL_MAX : 0 );
+
+}
+
+
+/*
+ * Method: VectorMath::Real LookupK( unsigned int sourceLink, unsigned int sourcePos, int srcLane, unsigned int destLink, unsigned int destinationPos, int destLane );
+ * Description: Get the pre-computed k-factor at the given positions along the links. Anything not in the table is Rayleigh (0).
+ */
+Real UrcData::LookupK( unsigned int sourceLink, unsigned int sourcePos, int srcLane, unsigned int destLink, unsigned int destinationPos, int destLane ) {
+
 	if ( sourceLink >= mRiceFactorData.size() )
 		return 0;	// Don't know this link, so assume Rayleigh.
 
-	SourceLocationList &srcLocList = mRiceFactorData[sourceLink];
+	SourceLocationRuns &srcLocList = mRiceFactorData[sourceLink];
 	if ( sourcePos >= srcLocList.size() )
 		return 0;	// Non-indexable position on source link, so assume Rayleigh.
 
-	SourceLaneList &srcLaneList = srcLocList[sourcePos];
-	if ( srcLane >= srcLaneList.size() )
+	SourceLaneRuns &srcLaneList = srcLocList[sourcePos];
+	if ( (unsigned int)srcLane >= srcLaneList.size() )
 		return 0;	// Non-indexable lane on source link, so assume Rayleigh.
 
-	DestinationLookup &destLookup = srcLaneList[srcLane];
-	if ( destLookup.find( destLink ) != destLookup.end() )
+	DestinationRunLookup &destLookup = srcLaneList[srcLane];
+	DestinationRunLookup::iterator destIt = destLookup.find( destLink );
+	if ( destIt == destLookup.end() )
 		return 0;	// No connection between this source and destination, so assume Rayleigh.
 
-	DestinationLocationList &destLocList = destLookup[destLink];
-	if ( destinationPos >= destLocList.size() )
-		return 0;	// Non-indexable position on destination link, so assume Rayleigh.
+	return LookupRun( destIt->second, destinationPos, destLane );
+
+}
+
 
-	DestinationLaneList &destLaneList = destLocList[destinationPos];
-	if ( destLane >= destLaneList.size() )
+/*
+ * Method: static VectorMath::Real LookupRun( const KRunList &runs, unsigned int destinationPos, int destLane );
+ * Description: Get the k-factor at the given position along a destination link from its runs.
+ */
+Real UrcData::LookupRun( const KRunList &runs, unsigned int destinationPos, int destLane ) {
+
+	if ( (unsigned int)destLane >= runs.mLanes )
 		return 0;	// Non-indexable lane on destination link, so assume Rayleigh.
 
-	// Now index the lookup.
-	return destLaneList[destLane];
+	// Find the run the position falls in: the first to end after it.
+	KRun position;
+	position.mEnd = destinationPos * runs.mLanes + destLane;
+	std::vector<KRun>::const_iterator runIt = std::upper_bound( runs.mRuns.begin(), runs.mRuns.end(), position, RunEndsBefore );
+	if ( runIt == runs.mRuns.end() )
+		return 0;	// Non-indexable position on destination link, so assume Rayleigh.
+
+	return runIt->mK;
+
+}
+
+
+/*
+ * Method: static void EncodeRuns( const DestinationLocationList &destLocList, KRunList *pRuns );
+ * Description: Run-length encodes the K-factors from one source position to one destination link.
+ */
+void UrcData::EncodeRuns( const DestinationLocationList &destLocList, KRunList *pRuns ) {
+
+	// Lanes that weren't computed are Rayleigh, so shorter locations are filled out with zeros.
+	pRuns->mLanes = 0;
+	DestinationLocationList::const_iterator destLocIt;
+	for ( AllInVector( destLocIt, destLocList ) )
+		pRuns->mLanes = MAX( pRuns->mLanes, destLocIt->size() );
+
+	pRuns->mRuns.clear();
+	unsigned int position = 0;
+	for ( AllInVector( destLocIt, destLocList ) ) {
+
+		for ( unsigned int lane = 0; lane < pRuns->mLanes; lane++, position++ ) {
+
+			double k = ( lane < destLocIt->size() ? (*destLocIt)[lane] : 0 );
+			if ( !pRuns->mRuns.empty() && pRuns->mRuns.back().mK == k ) {
+				pRuns->mRuns.back().mEnd = position + 1;
+			} else {
+				KRun run;
+				run.mEnd = position + 1;
+				run.mK = k;
+				pRuns->mRuns.push_back( run );
+			}
+
+		}
+
+	}
+
+	// Anything past the last run is Rayleigh anyway.
+	if ( !pRuns->mRuns.empty() && pRuns->mRuns.back().mK == 0 )
+		pRuns->mRuns.pop_back();
+
+	// Give back what the vector grew into while it was being built.
+	std::vector<KRun>( pRuns->mRuns ).swap( pRuns->mRuns );
+
+}
+
+
+/*
+ * Method: void SetRiceFactors( int linkIndex, const SourceLocationList &srcLocList );
+ * Description: Stores the pre-computed K-factors from one source link, encoded as runs.
+ */
+void UrcData::SetRiceFactors( int linkIndex, const SourceLocationList &srcLocList ) {
+
+	// Only links with data are in the file, so place each one by its ID.
+	if ( linkIndex >= (int)mRiceFactorData.size() )
+		mRiceFactorData.resize( linkIndex + 1 );
+
+	SourceLocationRuns &srcLocRuns = mRiceFactorData[linkIndex];
+	srcLocRuns.assign( srcLocList.size(), SourceLaneRuns() );
+	for ( unsigned int srcLoc = 0; srcLoc < srcLocList.size(); srcLoc++ ) {
+
+		srcLocRuns[srcLoc].resize( srcLocList[srcLoc].size() );
+		for ( unsigned int srcLane = 0; srcLane < srcLocList[srcLoc].size(); srcLane++ ) {
+
+			DestinationLookup::const_iterator destIt;
+			for ( AllInVector( destIt, srcLocList[srcLoc][srcLane] ) )
+				EncodeRuns( destIt->second, &srcLocRuns[srcLoc][srcLane][destIt->first] );
+
+		}
+
+	}
+
+}
+
+
+/*
+ * Method: void LoadRsuRiceFactors( const char *rsuDataFile );
+ * Description: Loads the pre-computed K-factors from RSUs, written by the Raytracer's RSU pass. Each run of a
+ * 				sharded configuration writes its own, so this may be called for several files.
+ */
+void UrcData::LoadRsuRiceFactors( const char *rsuDataFile ) {
+
+	ifstream stream( rsuDataFile );
+	if ( stream.fail() ) {
+		THROW_EXCEPTION( "Cannot open RSU Rice datafile: %s", rsuDataFile );
+	}
+
+	std::string header;
+	Real increment;
+	int numRsus;
+	if ( !( stream >> header >> increment >> numRsus ) || header != "rsu" ) {
+		THROW_EXCEPTION( "Not an RSU Rice datafile: %s", rsuDataFile );
+	}
+
+	for ( int r = 0; r < numRsus; r++ ) {
+
+		// Each RSU is written as a source link with one location and one lane, after its name and position.
+		RsuRiceFactors rsuData;
+		SourceLocationList srcLocList;
+		rsuData.mIncrement = increment;
+		stream >> rsuData.mName >> rsuData.mPosition.x >> rsuData.mPosition.y;
+		ReadRiceFactors( stream, &rsuData.mLink, &srcLocList );
+		if ( stream.fail() ) {
+			THROW_EXCEPTION( "RSU Rice datafile is incomplete: %s", rsuDataFile );
+		}
+
+		if ( !srcLocList.empty() && !srcLocList[0].empty() ) {
+			DestinationLookup::const_iterator destIt;
+			for ( AllInVector( destIt, srcLocList[0][0] ) )
+				EncodeRuns( destIt->second, &rsuData.mDestinations[destIt->first] );
+		}
+		mRsuRiceFactors.push_back( rsuData );
+
+	}
+
+}
+
+
+/*
+ * Method: static void ReadRiceFactors( std::istream &stream, int *pLinkIndex, SourceLocationList *pSrcLocList );
+ * Description: Reads one source link's K-factors, as laid out in the text file.
+ */
+void UrcData::ReadRiceFactors( std::istream &stream, int *pLinkIndex, SourceLocationList *pSrcLocList ) {
+
+	// Read the index of the source link and number of locations.
+	int srcLocCount;
+	stream >> *pLinkIndex >> srcLocCount;
+	pSrcLocList->clear();
+	for ( int srcLoc = 0; srcLoc < srcLocCount; srcLoc++ ) {
+
+		// Read the number of source lanes.
+		SourceLaneList srcLaneList;
+		int srcLaneCount;
+		stream >> srcLaneCount;
+		for ( int srcLane = 0; srcLane < srcLaneCount; srcLane++ ) {
+
+			// Read the number of destination links.
+			DestinationLookup destLookup;
+			int destLinkCount;
+			stream >> destLinkCount;
+			for ( int destLink = 0; destLink < destLinkCount; destLink++ ) {
+
+				// Read the index of the destination link and the number of locations therein.
+				DestinationLocationList destLocList;
+				int destId, destLocCount;
+				stream >> destId >> destLocCount;
+				for ( int destLoc = 0; destLoc < destLocCount; destLoc++ ) {
+
+					// Read the number of destination lanes.
+					DestinationLaneList newDestLane;
+					int destLaneCount;
+					stream >> destLaneCount;
+					for ( int destLane = 0; destLane < destLaneCount; destLane++ ) {
+
+						// Read the K-Factor
+						std::string kStr;
+						stream >> kStr;
+						if ( "inf" == kStr )
+							newDestLane.push_back( DBL_MAX );
+						else
+							newDestLane.push_back( atof( kStr.c_str() ) );
+
+					}
+
+					destLocList.push_back( newDestLane );
+
+				}
+
+				destLookup[destId] = destLocList;
+
+			}
+
+			srcLaneList.push_back( destLookup );
+
+		}
+
+		pSrcLocList->push_back( srcLaneList );
+
+	}
 
 }
 
@@ -796,76 +1216,46 @@ void UrcData::LoadNetwork( const char* linksFile, const char* nodesFile, const c
 	}
 
 
-	// read the pre-computed K-factors
-	if ( riceDataFile ) {
+	// read the pre-computed K-factors, written by the Raytracer in binary
+	if ( riceDataFile && KFactorFile::IsKFactorFile( riceDataFile ) ) {
+
+		KFactorReader reader( riceDataFile );
+		mReciprocalK = reader.IsReciprocal();
+		mLengthIncrement = (int)reader.GetIncrement();
+		for ( unsigned int i = 0; i < reader.GetLinkCount(); i++ ) {
+
+			int srcId = reader.GetLink( i );
+			if ( srcId < 0 )
+				continue;
+			SourceLocationList srcLocList;
+			reader.ReadLink( srcId, &srcLocList );
+			SetRiceFactors( srcId, srcLocList );
+
+		}
+
+	// or as text
+	} else if ( riceDataFile ) {
 
 		stream.open( riceDataFile );
 		if ( stream.fail() ) {
 			THROW_EXCEPTION( "Cannot open Rice datafile: %s", riceDataFile );
 		}
 
-		stream >> dec >> mLengthIncrement;
+		// Files computed in reciprocal mode say so before the increment.
+		std::string header;
+		stream >> header;
+		mReciprocalK = ( header == "reciprocal" );
+		if ( mReciprocalK )
+			stream >> header;
+		mLengthIncrement = atoi( header.c_str() );
 		stream >> dec >> numRice;
 
 		for ( int r = 0; r < numRice; r++ ) {
 
-			// Read the index of the source link and number of locations.
+			int srcId;
 			SourceLocationList srcLocList;
-			int srcId, srcLocCount;
-			stream >> srcId >> srcLocCount;
-			for ( int srcLoc = 0; srcLoc < srcLocCount; srcLoc++ ) {
-
-				// Read the number of source lanes.
-				SourceLaneList srcLaneList;
-				int srcLaneCount;
-				stream >> srcLaneCount;
-				for ( int srcLane = 0; srcLane < srcLaneCount; srcLane++ ) {
-
-					// Read the number of destination links.
-					DestinationLookup destLookup;
-					int destLinkCount;
-					stream >> destLinkCount;
-					for ( int destLink = 0; destLink < destLinkCount; destLink++ ) {
-
-						// Read the index of the destination link and the number of locations therein.
-						DestinationLocationList destLocList;
-						int destId, destLocCount;
-						stream >> destId >> destLocCount;
-						for ( int destLoc = 0; destLoc < destLocCount; destLoc++ ) {
-
-							// Read the number of destination lanes.
-							DestinationLaneList newDestLane;
-							int destLaneCount;
-							stream >> destLaneCount;
-							for ( int destLane = 0; destLane < destLaneCount; destLane++ ) {
-
-								// Read the K-Factor
-								std::string kStr;
-								stream >> kStr;
-								if ( "inf" == kStr )
-									newDestLane.push_back( DBL_MAX );
-								else
-									newDestLane.push_back( atof( kStr.c_str() ) );
-
-							}
-
-							destLocList.push_back( newDestLane );
-
-						}
-
-						destLookup[destId] = destLocList;
-
-					}
-
-					srcLaneList.push_back( destLookup );
-
-				}
-
-				srcLocList.push_back( srcLaneList );
-
-			}
-
-			mRiceFactorData.push_back( srcLocList );
+			ReadRiceFactors( stream, &srcId, &srcLocList );
+			SetRiceFactors( srcId, srcLocList );
 
 		}
 
@@ -1005,6 +1395,19 @@ void UrcData::ComputeBuckets() {
 
 
 
+/*
+ * Method: void ComputeEdgeGrid();
+ * Description: Builds the edge grid used by the Raytracer. Call after manually adding buildings.
+ */
+void UrcData::ComputeEdgeGrid() {
+
+	delete mEdgeGrid;
+	mEdgeGrid = new EdgeGrid( this );
+
+}
+
+
+
 /*
  * Method: VectorMath::Vector3D GetVehicleTypeDimensions( std::string );
  * Description: Get the width (x), length (y), and height (z) of vehicles of the given class.
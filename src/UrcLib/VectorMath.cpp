@@ -396,9 +396,10 @@ Real LineSegment::DistanceFromPoint(Vector2D p) {
 
 Real LineSegment::DistanceAlongLine( Vector2D p ) {
 
+	// signed, so points behind the start of the line come out negative.
 	Vector2D n = GetVector().Unitise();
-	Vector2D r = mStart - p;
-	return abs( n.DotProduct( r ) );
+	Vector2D r = p - mStart;
+	return n.DotProduct( r );
 
 }
 
@@ -618,9 +619,9 @@ Real VectorMath::ComputeMedian( std::vector<Real>& dataSet ) {
 	// sort the dataset
 	std::sort( dataSet.begin(), dataSet.end() );
 	if ( ( dataSet.size() % 2 ) == 1 )
-		return dataSet[ (dataSet.size() + 1)/2 ];
+		return dataSet[ dataSet.size()/2 ];
 	else
-		return ( dataSet[ dataSet.size()/2 ] + dataSet[ dataSet.size()/2 + 1 ] ) / 2;
+		return ( dataSet[ dataSet.size()/2 - 1 ] + dataSet[ dataSet.size()/2 ] ) / 2;
 
 }
 